@@ -0,0 +1,379 @@
+#include "phgame.h"
+
+// Microbenchmarks for the game primitives of phgame.h, run directly on
+// grids built in memory, with no client processes:
+//
+//     bench [-u units,...] [-d density,...] [-t seconds] [-f function]
+//           [-o auto|dense|sparse] [-p]
+//
+// Every function is swept over the unit counts and obstacle densities
+// given (by default 100,1000,10000 units and densities 0,0.1,0.3), on a
+// square map sized so that units cover about BENCH_UNITFILL of it. The
+// results are printed as CSV on the standard output:
+//
+//     function,units,density,map,iterations,ns_per_op
+//
+// The units are indexed by cell as the server would, or as given by -o.
+// With -p, the grids get the graph of the pathfinding service, which
+// obstacle changes then keep up to date, and path_next is timed as well,
+// with no latency limit, from a unit to a random cell.
+
+#define BENCH_UNITFILL 0.05
+#define BENCH_BATCH 1024
+#define BENCH_MAXLIST 16
+
+typedef struct
+{
+    Grid *grid;
+    Client *snapshot;
+    ServerMsg *msgs;
+    ClientMsg *moves;
+    Coordinate *cells;
+    Coordinate *free_cells;
+    int *units;
+} Bench;
+
+typedef uint64_t (*BenchFn)(Bench *, int);
+
+volatile uint64_t bench_sink;
+
+uint64_t
+bench_rand(void)
+{
+    static uint64_t state = 88172645463325252ULL;
+
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return state;
+}
+
+// bench_cell - a random cell of the map
+Coordinate
+bench_cell(Grid *grid)
+{
+    Coordinate c;
+
+    c.x = bench_rand() % grid->mapsize.y;
+    c.y = bench_rand() % grid->mapsize.x;
+
+    return c;
+}
+
+// bench_setup - build a grid and the inputs of the benchmarks
+//     bench: The state to fill.
+//     units: The number of units, half hunters and half preys.
+//     density: The fraction of the cells covered by obstacles.
+//     mode: The kind of unit index.
+//     pathfind: Whether to build the graph of the pathfinding service.
+//
+// Units are given no process, so server_killclient() only marks them
+// dead. Every benchmark iteration picks its inputs from BENCH_BATCH
+// precomputed random ones; the free cells are free of obstacles.
+void
+bench_setup(Bench *bench, int units, double density, UnitMapMode mode,
+    int pathfind)
+{
+    Coordinate mapsize;
+    Client *client;
+    Grid *grid;
+    long side, obstacles;
+    int i;
+
+    side = 1;
+    while (side * side * BENCH_UNITFILL < units)
+        side++;
+    mapsize.x = mapsize.y = side;
+
+    grid = grid_new(mapsize);
+    obstacles = density * side * side;
+
+    for (i = 0; i < obstacles; i++)
+        grid_addobstacle(grid, bench_cell(grid));
+
+    grid->clients = grid_alloc(grid, units * sizeof(Client));
+    grid->num_clients = units;
+
+    for (i = 0; i < units; i++)
+    {
+        client = &grid->clients[i];
+        client->idx = i;
+        client->proc = -1;
+        client->ui.type = i % 2 ? CT_PREY : CT_HUNTER;
+        client->ui.energy = i % 2 ? 5 : 20;
+        client->ui.alive = 1;
+
+        do
+            client->ui.pos = bench_cell(grid);
+        while (grid_isobstacle(grid, client->ui.pos));
+    }
+
+    unitmap_init(grid, mode);
+
+    if (pathfind)
+        path_init(grid, UINT64_MAX, 0, 1);
+
+    bench->grid = grid;
+    bench->snapshot = grid_alloc(grid, units * sizeof(Client));
+    memcpy(bench->snapshot, grid->clients, units * sizeof(Client));
+
+    bench->msgs = grid_alloc(grid, BENCH_BATCH * sizeof(ServerMsg));
+    bench->moves = grid_alloc(grid, BENCH_BATCH * sizeof(ClientMsg));
+    bench->cells = grid_alloc(grid, BENCH_BATCH * sizeof(Coordinate));
+    bench->free_cells = grid_alloc(grid, BENCH_BATCH * sizeof(Coordinate));
+    bench->units = grid_alloc(grid, BENCH_BATCH * sizeof(int));
+
+    for (i = 0; i < BENCH_BATCH; i++)
+    {
+        bench->units[i] = bench_rand() % units;
+        bench->cells[i] = bench_cell(grid);
+
+        do
+            bench->free_cells[i] = bench_cell(grid);
+        while (grid_isobstacle(grid, bench->free_cells[i]));
+
+        bench->msgs[i] = servermsg_new(grid,
+            &grid->clients[bench->units[i]]);
+        bench->moves[i] = clientmsg_new(bench->msgs[i],
+            grid->clients[bench->units[i]].ui.type, grid->mapsize);
+    }
+}
+
+uint64_t
+bench_neighbors(Bench *bench, int i)
+{
+    Coordinate buf[4];
+    int n;
+
+    grid_neighbors(buf, &n, bench->grid->mapsize, bench->cells[i]);
+
+    return n + buf[0].x;
+}
+
+uint64_t
+bench_distance(Bench *bench, int i)
+{
+    return grid_distance(bench->cells[i],
+        bench->cells[(i + 1) % BENCH_BATCH]);
+}
+
+uint64_t
+bench_clientmsgnew(Bench *bench, int i)
+{
+    Client *client = &bench->grid->clients[bench->units[i]];
+
+    return clientmsg_new(bench->msgs[i], client->ui.type,
+        bench->grid->mapsize).move_request.x;
+}
+
+uint64_t
+bench_servermsgnew(Bench *bench, int i)
+{
+    return servermsg_new(bench->grid,
+        &bench->grid->clients[bench->units[i]]).object_count;
+}
+
+uint64_t
+bench_nearestadv(Bench *bench, int i)
+{
+    return server_clientnearestadv(bench->grid,
+        &bench->grid->clients[bench->units[i]]).x;
+}
+
+uint64_t
+bench_objects(Bench *bench, int i)
+{
+    Coordinate buf[4];
+    int n;
+
+    server_clientobjects(buf, &n, bench->grid,
+        &bench->grid->clients[bench->units[i]]);
+
+    return n;
+}
+
+// Moves are applied for real, so the grid and its unit index are restored
+// from the snapshot before every batch, outside of the timed region.
+uint64_t
+bench_processmsg(Bench *bench, int i)
+{
+    Client *client = &bench->grid->clients[bench->units[i]];
+    int grid_updated = 0;
+
+    if (!server_clientalive(client))
+        return 0;
+
+    server_processmsg(&grid_updated, NULL, bench->grid, client,
+        bench->moves[i]);
+
+    return grid_updated;
+}
+
+uint64_t
+bench_pathnext(Bench *bench, int i)
+{
+    Client *client = &bench->grid->clients[bench->units[i]];
+
+    return path_next(bench->grid, client->ui.pos, bench->cells[i]).x;
+}
+
+// An obstacle is added on a free cell and removed again, so the grid
+// stays the same.
+uint64_t
+bench_obstaclechange(Bench *bench, int i)
+{
+    return grid_addobstacle(bench->grid, bench->free_cells[i]) +
+        grid_removeobstacle(bench->grid, bench->free_cells[i]);
+}
+
+// bench_run - time a benchmark
+//     bench: The inputs.
+//     fn: The function to time.
+//     min_ns: Keep running batches until this much time was measured.
+//     iterations: Set to the number of calls made.
+//
+// Returns the mean time per call in ns.
+double
+bench_run(Bench *bench, BenchFn fn, uint64_t min_ns, uint64_t *iterations)
+{
+    Grid *grid = bench->grid;
+    uint64_t start, elapsed = 0, sink = 0;
+    int i;
+
+    *iterations = 0;
+
+    while (elapsed < min_ns)
+    {
+        memcpy(grid->clients, bench->snapshot,
+            grid->num_clients * sizeof(Client));
+        unitmap_build(grid);
+
+        start = clock_nsec();
+        for (i = 0; i < BENCH_BATCH; i++)
+            sink += fn(bench, i);
+        elapsed += clock_nsec() - start;
+
+        *iterations += BENCH_BATCH;
+    }
+
+    memcpy(grid->clients, bench->snapshot, grid->num_clients * sizeof(Client));
+    unitmap_build(grid);
+    bench_sink += sink;
+
+    return (double) elapsed / *iterations;
+}
+
+// bench_parselist - parse a comma separated list of numbers
+int
+bench_parselist(const char *arg, double *list)
+{
+    char *end;
+    int n = 0;
+
+    while (*arg && n < BENCH_MAXLIST)
+    {
+        list[n++] = strtod(arg, &end);
+        if (end == arg)
+            return 0;
+        arg = *end == ',' ? end + 1 : end;
+    }
+
+    return n;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct
+    {
+        const char *name;
+        BenchFn fn;
+    } fns[] = {
+        {"grid_neighbors", bench_neighbors},
+        {"grid_distance", bench_distance},
+        {"clientmsg_new", bench_clientmsgnew},
+        {"servermsg_new", bench_servermsgnew},
+        {"server_clientnearestadv", bench_nearestadv},
+        {"server_clientobjects", bench_objects},
+        {"server_processmsg", bench_processmsg},
+        {"obstacle_change", bench_obstaclechange},
+        {"path_next", bench_pathnext},
+    };
+    double units[BENCH_MAXLIST] = {100, 1000, 10000};
+    double densities[BENCH_MAXLIST] = {0, 0.1, 0.3};
+    double seconds = 0.1, ns;
+    const char *filter = NULL;
+    UnitMapMode mode = UNITMAP_AUTO;
+    int num_units = 3, num_densities = 3, pathfind = 0, opt, u, d, f;
+    uint64_t iterations;
+    Bench bench;
+
+    while ((opt = getopt(argc, argv, "u:d:t:f:o:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            num_units = bench_parselist(optarg, units);
+            break;
+        case 'd':
+            num_densities = bench_parselist(optarg, densities);
+            break;
+        case 't':
+            seconds = atof(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "auto"))
+                mode = UNITMAP_AUTO;
+            else if (!strcmp(optarg, "dense"))
+                mode = UNITMAP_DENSE;
+            else if (!strcmp(optarg, "sparse"))
+                mode = UNITMAP_SPARSE;
+            else
+                num_units = 0;
+            break;
+        case 'p':
+            pathfind = 1;
+            break;
+        default:
+            num_units = 0;
+        }
+
+        if (num_units == 0 || num_densities == 0)
+        {
+            fprintf(stderr, "usage: bench [-u units,...] [-d density,...] "
+                "[-t seconds] [-f function] [-o auto|dense|sparse] [-p]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("function,units,density,map,iterations,ns_per_op\n");
+
+    for (u = 0; u < num_units; u++)
+        for (d = 0; d < num_densities; d++)
+        {
+            bench_setup(&bench, units[u], densities[d], mode, pathfind);
+
+            for (f = 0; f < (int) (sizeof(fns) / sizeof(fns[0])); f++)
+            {
+                if (filter && strcmp(filter, fns[f].name))
+                    continue;
+
+                if (fns[f].fn == bench_pathnext && !bench.grid->path)
+                    continue;
+
+                ns = bench_run(&bench, fns[f].fn, seconds * 1e9, &iterations);
+                printf("%s,%d,%g,%d,%llu,%.1f\n", fns[f].name, (int) units[u],
+                    densities[d], bench.grid->mapsize.x,
+                    (unsigned long long) iterations, ns);
+                fflush(stdout);
+            }
+
+            grid_destroy(bench.grid);
+        }
+
+    return 0;
+}
@@ -13,6 +13,7 @@ main(int argc, char **argv)
 {
     Coordinate mapsize;
     ClientType type;
+    int num_units = 0, compact = 0, loadgen = 0, i;
 
     if (argc < 3)
     {
@@ -22,14 +23,34 @@ main(int argc, char **argv)
 
     mapsize.x = atoi(argv[1]);
     mapsize.y = atoi(argv[2]);
-    
+
+    // An optional third argument makes this process drive several units,
+    // using the multiplexed protocol.
+    if (argc > 3)
+        num_units = atoi(argv[3]);
+
+    // The server asks for its compact or delta encoding, and for a load
+    // generator, with words after the third argument.
+    for (i = 4; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "compact"))
+            compact = WIRE_COMPACT;
+        else if (!strcmp(argv[i], "delta"))
+            compact = WIRE_DELTA;
+        else if (!strcmp(argv[i], "loadgen"))
+            loadgen = 1;
+    }
+
 #ifdef HUNTER
     type = CT_HUNTER;
 #else
     type = CT_PREY;
 #endif
 
-    client_main(type, mapsize);
+    if (num_units > 0)
+        client_muxmain(type, mapsize, num_units, compact, loadgen);
+    else
+        client_main(type, mapsize, compact, loadgen);
 
     return 0;
 }
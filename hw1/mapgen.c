@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generates a random map in the input format of the server, for testing
+// and benchmarking on large maps:
+//
+//     mapgen <width> <height> <obstacles> <hunters> <preys> [seed]
+//
+// Every object gets a distinct cell: cells are visited in the order of
+// a random affine permutation of [0, width * height), so no memory
+// proportional to the map is needed.
+
+char outbuf[1 << 20];
+size_t outlen;
+
+void
+flush(void)
+{
+    fwrite(outbuf, 1, outlen, stdout);
+    outlen = 0;
+}
+
+void
+putint(long long value)
+{
+    char digits[24];
+    int n = 0;
+
+    if (outlen + sizeof(digits) > sizeof(outbuf))
+        flush();
+
+    if (value < 0)
+    {
+        outbuf[outlen++] = '-';
+        value = -value;
+    }
+
+    do
+    {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (n)
+        outbuf[outlen++] = digits[--n];
+}
+
+void
+putsep(char c)
+{
+    outbuf[outlen++] = c;
+}
+
+unsigned long long
+gcd(unsigned long long a, unsigned long long b)
+{
+    while (b)
+    {
+        unsigned long long t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+void
+usage(void)
+{
+    fprintf(stderr, "usage: mapgen <width> <height> <obstacles> "
+        "<hunters> <preys> [seed]\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long long cells, mul, add, cell, k = 0;
+    long long width, height, counts[3];
+    int energy[3] = {0, 20, 5};
+    int i;
+    long long j;
+
+    if (argc < 6)
+        usage();
+
+    width = atoll(argv[1]);
+    height = atoll(argv[2]);
+    counts[0] = atoll(argv[3]);
+    counts[1] = atoll(argv[4]);
+    counts[2] = atoll(argv[5]);
+    srand(argc > 6 ? atoi(argv[6]) : 1);
+
+    if (width <= 0 || height <= 0 ||
+        counts[0] < 0 || counts[1] < 0 || counts[2] < 0)
+        usage();
+
+    cells = (unsigned long long) width * height;
+    if ((unsigned long long) (counts[0] + counts[1] + counts[2]) > cells)
+    {
+        fprintf(stderr, "mapgen: more objects than cells\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Pick a multiplier coprime to the number of cells, so that
+    // k -> (mul * k + add) % cells is a permutation.
+    mul = ((unsigned long long) rand() << 31 | rand()) % cells | 1;
+    while (gcd(mul, cells) != 1)
+        mul += 2;
+    add = ((unsigned long long) rand() << 31 | rand()) % cells;
+
+    putint(width);
+    putsep(' ');
+    putint(height);
+    putsep('\n');
+
+    for (i = 0; i < 3; i++)
+    {
+        putint(counts[i]);
+        putsep('\n');
+
+        for (j = 0; j < counts[i]; j++, k++)
+        {
+            cell = (unsigned long long) ((unsigned __int128) mul * k % cells
+                + add) % cells;
+
+            // Rows are bounded by the height, columns by the width.
+            putint(cell / width);
+            putsep(' ');
+            putint(cell % width);
+
+            if (i > 0)
+            {
+                putsep(' ');
+                putint(energy[i]);
+            }
+
+            putsep('\n');
+        }
+    }
+
+    flush();
+
+    return 0;
+}
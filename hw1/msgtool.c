@@ -13,6 +13,10 @@ typedef struct
     Coordinate adv_pos;
     int object_count;
     Coordinate object_pos[4];
+    int delay_us;
+    int result;
+    Coordinate alt_move;
+    Coordinate waypoint;
 } ServerMsg;
 
 int main(int argc, char **argv)
@@ -47,6 +51,26 @@ int main(int argc, char **argv)
         msg.object_pos[i] = coord;
     }
 
+    fprintf(stderr, "delay_us (%%d): ");
+    scanf("%d", &a);
+    msg.delay_us = a;
+
+    fprintf(stderr, "result (%%d): ");
+    scanf("%d", &a);
+    msg.result = a;
+
+    fprintf(stderr, "alt_move (%%d %%d), -1 -1 for none: ");
+    scanf("%d %d", &a, &b);
+    coord.x = a;
+    coord.y = b;
+    msg.alt_move = coord;
+
+    fprintf(stderr, "waypoint (%%d %%d), -1 -1 for none: ");
+    scanf("%d %d", &a, &b);
+    coord.x = a;
+    coord.y = b;
+    msg.waypoint = coord;
+
     write(1, &msg, sizeof(ServerMsg));
     return 0;
 }
@@ -1,44 +1,266 @@
 #ifndef PHGAME_H
 #define PHGAME_H
 
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 // #define DEBUG
 
 #define POLL_NOTIMEOUT 0
-#define CLIENT_RDY(i) fds[(i)].revents & POLLIN
+#define CLIENT_RDY(i) fds[(i)].revents & (POLLIN | POLLHUP | POLLERR)
 #define SKIP_DEAD(i) if (!server_clientalive(&grid->clients[(i)])) \
                          continue;
 
+// Defaults for slow-client isolation. A send queue always has room for
+// at least one full reply frame, whatever the configured cap.
+#define SEND_CAP_DEFAULT (64 * 1024)
+#define WATCHDOG_MININTERVAL 1000000ULL
+#define WATCHDOG_MAXINTERVAL 100000000ULL
+
+// Obstacle commands on the control channel are picked up every
+// CONTROL_INTERVAL ns. A command is a line of at most CONTROL_LINE bytes.
+#define CONTROL_INTERVAL 10000000ULL
+#define CONTROL_LINE 128
+
+// Units farther than the LOD radius from their nearest adversary move at
+// a reduced rate: at level L they wait at least LOD_INTERVAL << (L - 1)
+// ns between moves unless configured otherwise, up to LOD_LEVELS - 1.
+#define LOD_LEVELS 5
+#define LOD_INTERVAL 10000000ULL
+
+// A per-type rate of PACE_RANDOM keeps the original pacing: a random
+// think time of 10 to 90 ms per move, now drawn by the server.
+#define PACE_RANDOM -1.0
+
+// A load sweep runs at most LOAD_MAXSTEPS offered rates, each one for
+// LOAD_STEPMS ms unless configured otherwise.
+#define LOAD_MAXSTEPS 32
+#define LOAD_STEPMS 2000
+
+// The adaptive wait spins for a window of WAIT_SPINSTART ns after the
+// last piece of work, doubled whenever a blocking wait ends within the
+// largest window and halved whenever one lasts longer. Blocking waits
+// last at most WAIT_MAXBLOCK ns, so the timers of the loop (watchdog,
+// events, control channel, load steps) keep running.
+#define WAIT_SPINSTART 1000ULL
+#define WAIT_SPINMAX 100000ULL
+#define WAIT_MAXBLOCK 1000000ULL
+
+// Every process has at most one receive and one send in flight on the
+// io_uring backend, so the completion queue needs two entries per process,
+// and one for the timeout of a blocking wait.
+#define URING_MAXSQ 4096
+#define URING_MAXCQ 65536
+#define URING_RECV 0
+#define URING_SEND 1
+#define URING_TIMEOUT UINT64_MAX
+
+// Latency histograms are log-linear: every power of two is split into
+// HIST_SUB linear sub-buckets, which bounds the relative error of a
+// reported percentile to 1 / HIST_SUB. Values above 2^HIST_MAXBITS ns
+// (about 18 minutes) are clamped into the last bucket.
+#define HIST_SUBBITS 3
+#define HIST_SUB (1 << HIST_SUBBITS)
+#define HIST_MAXBITS 40
+#define HIST_BUCKETS ((HIST_MAXBITS - HIST_SUBBITS + 2) * HIST_SUB)
+
+// All of the server's per-game data lives in one arena, which reserves
+// ARENA_RESERVE bytes of address space up front and hands out zeroed,
+// ARENA_ALIGN aligned blocks from it. Pages are only committed when they
+// are first touched. Arenas holding more than ARENA_HUGEPAGE bytes of
+// map data are advised to use transparent huge pages.
+#define ARENA_ALIGN 64
+#define ARENA_RESERVE ((size_t) 1 << 40)
+#define ARENA_HUGEPAGE ((size_t) 2 << 20)
+
+// The map parser reads its input in blocks of READER_BUFSIZE bytes. A
+// token never straddles two blocks: the buffer is topped up whenever
+// fewer than READER_LOOKAHEAD bytes are left, which is longer than any
+// valid integer.
+#define READER_BUFSIZE (1 << 20)
+#define READER_LOOKAHEAD 64
+
+// CellMap is an open addressing hash table from cells to integers. Keys
+// are the packed coordinates; the all-ones key never occurs for a cell
+// on the map, so it marks an empty slot.
+#define CELLMAP_EMPTY UINT64_MAX
+
+// The live units are indexed by cell as well, in a dense array over the
+// whole map when it takes at most UNITMAP_DENSEMAX bytes and there is a
+// unit for every UNITMAP_DENSEFILL cells or less, and in a CellMap
+// otherwise.
+#define UNITMAP_DENSEMAX ((size_t) 64 << 20)
+#define UNITMAP_DENSEFILL 64
+
+// The reply cache keeps the nearest adversary of a unit only while it is
+// within the cache radius, so that a move finds the entries it changes
+// among the units around it. The radius is sized to hold CACHE_REACH
+// adversaries on average, but its diamond never spans more cells than
+// there are units.
+#define CACHE_REACH 16
+
+// The pathfinding service splits the map into square clusters of
+// PATH_CLUSTER cells a side, small enough to be searched on the stack,
+// which have at most PATH_MAXNODES entrances. Maps with more than
+// PATH_MAXCLUSTERS clusters are left without. The graph gets PATH_BUDGET
+// ms to build, and a query PATH_LATENCY us, unless configured otherwise;
+// the clock is read every PATH_CHECK nodes of a query. Searches of a
+// cluster see it with a border of blocked cells, PATH_STRIDE cells a row,
+// or as a 32-bit word of free cells a row.
+#define PATH_CLUSTER 16
+#define PATH_STRIDE (PATH_CLUSTER + 2)
+#define PATH_CELLS (PATH_STRIDE * PATH_STRIDE)
+#define PATH_MAXNODES (4 * ((PATH_CLUSTER + 1) / 2))
+#define PATH_MAXCLUSTERS (1 << 24)
+#define PATH_BUDGET 10000
+#define PATH_LATENCY 200
+#define PATH_CHECK 64
+#define PATH_UNREACHABLE UINT16_MAX
+
+// Below this many items per thread, parallel_for() does not bother to
+// use another thread. It splits a loop among at most PARALLEL_MAXTHREADS.
+#define PARALLEL_MINCHUNK 4096
+#define PARALLEL_MAXTHREADS 64
+
+// The compact wire encoding packs coordinates into 16 bits and sends only
+// the objects a ServerMsg actually holds. It is used when both sides of
+// the map fit, with 0xffff left over for the -1 of "no such cell". The
+// WIRE_ALT and WIRE_WAYPOINT bits of the result byte tell whether an
+// alternative move and a waypoint follow the objects.
+//
+//     ServerMsg: pos, adv_pos (4 x u16), delay_us (u32), object_count
+//                (u8), result (u8), object_pos (object_count x 2 x u16),
+//                [alt_move (2 x u16)], [waypoint (2 x u16)]
+//     ClientMsg: move_request (2 x u16)
+//
+// Multiplexed frames keep the int count and int slots of the wide
+// encoding; a frame from the server also gives its length in bytes after
+// the count, since its entries vary in size.
+//
+// The delta encoding is the compact one for ClientMsgs and the framing,
+// but a ServerMsg only carries the fields that differ from the last one
+// sent to the same unit, after a byte with a DELTA_* bit for each:
+//
+//     ServerMsg: mask (u8), [pos (2 x u16)], [adv_pos (2 x u16)],
+//                [delay_us (u32)], [object_count (u8), object_pos],
+//                [result (u8)], [alt_move (2 x u16)], [waypoint (2 x u16)]
+#define WIRE_MAXCOMPACT 0xffff
+#define WIRE_SERVERHDR 14
+#define WIRE_SERVERMAX (WIRE_SERVERHDR + 4 * 4 + 4 + 4)
+#define WIRE_ALT 0x80
+#define WIRE_WAYPOINT 0x40
+#define WIRE_CLIENTMSG 4
+#define WIRE_DELTAMAX (1 + WIRE_SERVERMAX)
+#define WIRE_COMPACT 1
+#define WIRE_DELTA 2
+#define DELTA_POS 1
+#define DELTA_ADV 2
+#define DELTA_DELAY 4
+#define DELTA_OBJECTS 8
+#define DELTA_RESULT 16
+#define DELTA_ALT 32
+#define DELTA_WAYPOINT 64
+
+// Views other than the whole map start with a caption line of at most
+// VIEW_CAPTION bytes. Windows follow the most crowded region by default.
+#define VIEW_CAPTION 128
+#define VIEW_DENSEST -1
+#define VIEW_WIDTH 80
+#define VIEW_HEIGHT 24
+
+// Frames published for spectators go to a shared memory ring of at most
+// SPECTATE_SLOTS frames, and fewer if that would take more than
+// SPECTATE_MAXSIZE bytes. A spectator that falls behind by a whole ring
+// skips ahead instead of holding the game up.
+#define SPECTATE_MAGIC 0x7068737065637431ULL
+#define SPECTATE_SLOTS 16
+#define SPECTATE_MINSLOTS 2
+#define SPECTATE_MAXSIZE ((size_t) 64 << 20)
+#define SPECTATE_HEADER 64
+
 #ifdef DEBUG
 #define LOG(fmt, args...) fprintf(stderr, fmt, ## args)
 #else
 #define LOG(fmt, args...)
 #endif
 
+// Event tracing is compiled in with -DPHTRACE (make trace) and then
+// enabled at runtime with --trace. Events go to a ring of TRACE_EVENTS
+// records, so a long game keeps its most recent history.
+#ifdef PHTRACE
+#define TRACE_EVENTS (1 << 20)
+#define TRACE(kind, arg) trace_event((kind), (arg))
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_CLOCK() __rdtsc()
+#else
+#define TRACE_CLOCK() clock_nsec()
+#endif
+#else
+#define TRACE(kind, arg) ((void) 0)
+#endif
+
 typedef struct
 {
     int x;
     int y;
 } Coordinate;
 
+// The outcome of the move request a reply answers. MOVE_NONE is for
+// replies that answer no request, such as the first one. A denied move
+// comes with the best free move left in alt_move, if there is one; moves
+// onto obstacles added since the reply they were based on are denied
+// too, as MOVE_DENIED_OBSTACLE. With
+// the pathfinding service, replies to hunters give the next cell on the
+// way to adv_pos around the obstacles in waypoint.
+typedef enum
+{
+    MOVE_NONE,
+    MOVE_ACCEPTED,
+    MOVE_STAYED,
+    MOVE_DENIED_ALLY,
+    MOVE_DENIED_ADV,
+    MOVE_CAPTURED,
+    MOVE_KILLED,
+    MOVE_REDIRECTED,
+    MOVE_INVALID,
+    MOVE_DENIED_OBSTACLE,
+    MOVE_RESULTS
+} MoveResult;
+
 typedef struct
 {
     Coordinate pos;
     Coordinate adv_pos;
     int object_count;
     Coordinate object_pos[4];
+    int delay_us;
+    int result;
+    Coordinate alt_move;
+    Coordinate waypoint;
 } ServerMsg;
 
 typedef struct
@@ -52,68 +274,773 @@ typedef enum
     CT_PREY
 } ClientType;
 
+// The flags share a word, which keeps a Client at 24 bytes. The slot of
+// a unit is not stored: the units of a process are consecutive, so it is
+// the distance from the first unit of the process.
 typedef struct
 {
-    ClientType type;
     Coordinate pos;
     int energy;
-    int alive;
+    unsigned type : 1;
+    unsigned alive : 1;
 } UnitInfo;
 
 typedef struct
 {
-    pid_t pid;
-    int fd;
     int idx;
+    int proc;
     UnitInfo ui;
 } Client;
 
+typedef struct
+{
+    int slot;
+    ServerMsg msg;
+} MuxServerMsg;
+
+typedef struct
+{
+    int slot;
+    ClientMsg msg;
+} MuxClientMsg;
+
+typedef struct
+{
+    pid_t pid;
+    int fd;
+    ClientType type;
+    int num_units;
+    int num_alive;
+    int *units;
+    char *out;
+    size_t out_len;
+    char *in;
+    size_t in_len;
+    char *queue;
+    size_t queue_head;
+    size_t queue_len;
+    size_t queue_cap;
+    uint64_t deadline_ns;
+    int delay_us;
+    int sending;
+    int cpu;
+} Proc;
+
+typedef struct
+{
+    char *base;
+    size_t size;
+    size_t used;
+    size_t last;
+    int huge;
+} Arena;
+
+// The argument of a trace event is the index of a process for TR_RECV
+// and TR_FLUSH, the index of a unit for TR_PROCESS, TR_SEND and TR_KILL,
+// the number of ready processes for TR_POLL, the tick for TR_TICK, and
+// unused for TR_PRINT.
+typedef enum
+{
+    TR_POLL,
+    TR_RECV,
+    TR_PROCESS,
+    TR_SEND,
+    TR_FLUSH,
+    TR_KILL,
+    TR_PRINT,
+    TR_TICK,
+    TR_NUMKINDS
+} TraceKind;
+
+typedef struct
+{
+    uint64_t ts;
+    int arg;
+    int kind;
+} TraceEvent;
+
+typedef struct
+{
+    TraceEvent *events;
+    uint64_t count;
+    uint64_t tsc_start;
+    uint64_t ns_start;
+    const char *path;
+} Trace;
+
+typedef struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned sq_entries;
+    unsigned to_submit;
+} Uring;
+
+typedef struct
+{
+    uint64_t *keys;
+    int *values;
+    size_t mask;
+} CellMap;
+
+typedef enum
+{
+    VIEW_FULL,
+    VIEW_WINDOW,
+    VIEW_OVERVIEW
+} ViewMode;
+
+// What grid_print() shows. The block of the overview is the number of
+// rows and columns of cells per character. In window mode with
+// VIEW_DENSEST, buckets counts the live units of every window-sized
+// bucket of the map that holds any.
+typedef struct
+{
+    ViewMode mode;
+    int width;
+    int height;
+    int follow;
+    Coordinate origin;
+    Coordinate block;
+    int *counts;
+    int *obstacle_counts;
+    CellMap buckets;
+    char *frame;
+    size_t frame_cap;
+} View;
+
+// The shared memory ring starts with a SpectateHeader, padded to
+// SPECTATE_HEADER bytes, followed by num_slots slots of slot_size bytes.
+// head is the number of the latest published frame, which lives in slot
+// head % num_slots. The seq of a slot is odd while frame (seq - 1) / 2
+// is being written into it, and 2 * frame + 2 once it is complete.
+typedef struct
+{
+    uint64_t magic;
+    uint64_t head;
+    uint64_t slot_size;
+    uint32_t num_slots;
+    uint32_t done;
+} SpectateHeader;
+
+typedef struct
+{
+    uint64_t seq;
+    uint64_t len;
+    char data[];
+} SpectateSlot;
+
+typedef struct
+{
+    SpectateHeader *header;
+    size_t size;
+    char name[NAME_MAX];
+} Spectate;
+
+typedef enum
+{
+    UNITMAP_AUTO,
+    UNITMAP_DENSE,
+    UNITMAP_SPARSE
+} UnitMapMode;
+
+// The units on a cell form a list in index order: the first one is in
+// cells (plus one, so that the zeroed array is empty) or in map, and
+// next links each unit to the following one, -1 at the end.
+typedef struct
+{
+    UnitMapMode mode;
+    int *cells;
+    CellMap map;
+    int *next;
+} UnitMap;
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+} Histogram;
+
+// A node of the cluster graph: the middle cell of an entrance, a run of
+// free cells on the border of a cluster facing free cells across it in
+// direction dir (up, down, left or right). The rest is the state of the
+// search with the given stamp: the cost from the start and the id of the
+// previous node, -1 for the start.
+typedef struct
+{
+    Coordinate cell;
+    int dir;
+    int g;
+    int prev;
+    uint32_t stamp;
+} PathNode;
+
+// The nodes of a cluster, with room for cap of them, and the length of
+// the shortest way between every two of them that stays inside, in dist,
+// num_nodes by num_nodes. The obstacles of the cluster are kept as a
+// bitmap, row by row, PATH_CLUSTER cells each, so that searches do not
+// have to look them up one by one.
+typedef struct
+{
+    int num_nodes;
+    int cap;
+    PathNode *nodes;
+    uint16_t *dist;
+    uint64_t blocked[(PATH_CLUSTER * PATH_CLUSTER + 63) / 64];
+} PathCluster;
+
+typedef struct
+{
+    int f;
+    int g;
+    int id;
+} PathOpen;
+
+typedef struct
+{
+    uint64_t queries;
+    uint64_t found;
+    uint64_t partial;
+    uint64_t unreachable;
+    uint64_t expanded;
+    uint64_t rebuilds;
+    Histogram *latency;
+} PathStats;
+
+// The cluster graph of the pathfinding service, see path_init(). size is
+// the number of clusters down and across the map. Node k of cluster c has
+// the id c * PATH_MAXNODES + k. open is the heap of the A* search.
+typedef struct
+{
+    Coordinate size;
+    int num_clusters;
+    int num_nodes;
+    PathCluster *clusters;
+    PathOpen *open;
+    int open_len;
+    int open_cap;
+    uint32_t stamp;
+    uint64_t build_ns;
+    uint64_t latency_ns;
+    PathStats stats;
+} PathGraph;
+
+// A scripted obstacle change: at move `move`, an obstacle is added to or
+// removed from `cell`.
+typedef struct
+{
+    uint64_t move;
+    int add;
+    Coordinate cell;
+} ObstacleEvent;
+
+// The cached parts of the reply of a unit, see cache_lookup(). A nearest
+// adversary index of -1 means there is none, at distance INT_MAX. No other
+// adversary is closer than adv_bound, which is at most one more than the
+// cache radius.
+typedef struct
+{
+    Coordinate adv_pos;
+    int adv_idx;
+    int adv_distance;
+    int adv_bound;
+    int object_count;
+    Coordinate object_pos[4];
+    unsigned adv_valid : 1;
+    unsigned objects_valid : 1;
+} CacheEntry;
+
+typedef struct
+{
+    uint64_t adv_hits;
+    uint64_t adv_misses;
+    uint64_t object_hits;
+    uint64_t object_misses;
+} CacheStats;
+
 typedef struct
 {
     Coordinate mapsize;
     int num_obstacles;
     int num_clients;
+    int num_procs;
+    int units_per_proc;
+    int compact;
+    int loadgen;
+    int obstacles_cap;
+    int num_events;
     Coordinate *obstacles;
+    CellMap obstacle_map;
+    UnitMap units;
+    ObstacleEvent *events;
     Client *clients;
+    ServerMsg *sent;
+    CacheEntry *cache;
+    CacheStats cache_stats;
+    int cache_radius;
+    PathGraph *path;
+    Proc *procs;
+    View view;
+    Spectate *spectate;
+    Arena arena;
 } Grid;
 
+typedef struct
+{
+    int fd;
+    const char *name;
+    char *buf;
+    size_t pos;
+    size_t len;
+    int eof;
+    uint64_t offset;
+    uint64_t line;
+    uint64_t line_start;
+    uint64_t tok;
+} Reader;
+
+typedef struct
+{
+    int num_submitted;
+    int num_alive;
+    uint64_t count;
+    ClientMsg *moves;
+    char *submitted;
+    Coordinate *final;
+    int *captor;
+    unsigned char *result;
+    Coordinate *ref_final;
+    int *ref_captor;
+    CellMap start;
+    CellMap claims[2];
+    CellMap hunters;
+} Tick;
+
+typedef struct
+{
+    Tick *tick;
+    Grid *grid;
+    Coordinate *final;
+    int *captor;
+} TickJob;
+
+// The clusters built by path_init() so far, stopped once the graph has
+// taken longer than budget_ns since start. The threads of a phase share
+// over through atomics, so that they all stop once one of them runs over.
+typedef struct
+{
+    Grid *grid;
+    uint64_t start;
+    uint64_t budget_ns;
+    int over;
+} PathJob;
+
+typedef void (*ParallelFn)(void *, int, int);
+
+typedef struct
+{
+    ParallelFn fn;
+    void *ctx;
+    int begin;
+    int end;
+} ParallelJob;
+
+// The worker threads of parallel_for(), started on first use and kept
+// for the life of the process. Worker k runs jobs[k + 1] of every round
+// it takes part in; a round is announced by bumping round, and pending
+// counts the workers still busy with it.
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    ParallelJob jobs[PARALLEL_MAXTHREADS];
+    int num_workers;
+    int num_jobs;
+    int pending;
+    uint64_t round;
+} ParallelPool;
+
+typedef struct
+{
+    double offered;
+    double achieved;
+    uint64_t moves;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t max;
+} LoadStep;
+
+typedef enum
+{
+    SCHED_LINEAR,
+    SCHED_ROUNDROBIN,
+    SCHED_OLDEST
+} SchedPolicy;
+
+typedef enum
+{
+    IO_POLL,
+    IO_URING
+} IoBackend;
+
+typedef enum
+{
+    ENC_AUTO,
+    ENC_WIDE,
+    ENC_COMPACT,
+    ENC_DELTA
+} Encoding;
+
+typedef enum
+{
+    WATCHDOG_EVICT,
+    WATCHDOG_PENALIZE
+} WatchdogPolicy;
+
+typedef enum
+{
+    PLACE_NONE,
+    PLACE_SPREAD,
+    PLACE_GROUP
+} Placement;
+
+typedef enum
+{
+    WAIT_SPIN,
+    WAIT_BLOCK,
+    WAIT_ADAPTIVE
+} WaitPolicy;
+
+typedef struct
+{
+    uint64_t window;
+    uint64_t idle_since;
+    uint64_t window_sum;
+    uint64_t window_max;
+    uint64_t polls;
+    uint64_t blocks;
+    Histogram spun;
+    Histogram blocked;
+} WaitState;
+
+typedef struct
+{
+    SchedPolicy sched;
+    int budget;
+    int stats;
+    int tick;
+    int tick_verify;
+    int threads;
+    int parse_only;
+    int units_per_proc;
+    int deadline_ms;
+    WatchdogPolicy watchdog;
+    size_t send_cap;
+    IoBackend io;
+    double rate;
+    double type_rate[2];
+    uint64_t seed;
+    const char *trace_path;
+    ViewMode view;
+    int view_width;
+    int view_height;
+    int follow;
+    const char *publish;
+    Encoding encoding;
+    const char *control;
+    int loadgen;
+    int num_loads;
+    double load[LOAD_MAXSTEPS];
+    int load_step_ms;
+    Placement placement;
+    int server_cpu;
+    int lod_radius;
+    uint64_t lod_interval;
+    int reply_cache;
+    int redirect;
+    WaitPolicy wait;
+    uint64_t spin_max;
+    UnitMapMode occupancy;
+    int pathfind;
+    int path_budget_ms;
+    int path_latency_us;
+} ServerConfig;
+
+typedef struct
+{
+    uint64_t deadline_misses;
+    uint64_t evictions;
+    uint64_t penalties;
+    uint64_t disconnects;
+    uint64_t queue_overflows;
+    uint64_t send_stalls;
+    uint64_t bytes_sent;
+    uint64_t results[MOVE_RESULTS];
+    uint64_t redirects;
+} ServerCounters;
+
+typedef struct
+{
+    ServerConfig *config;
+    Grid *grid;
+    struct pollfd *fds;
+    int *ready;
+    int rr_next;
+    uint64_t *ready_ns;
+    Histogram *latency;
+    uint64_t start_ns;
+    uint64_t num_moves;
+    MuxClientMsg *msgin;
+    ServerCounters counters;
+    uint64_t next_watchdog;
+    uint64_t pace_tat;
+    uint64_t rng;
+    int next_event;
+    int control_fd;
+    uint64_t next_control;
+    size_t control_len;
+    char control_buf[CONTROL_LINE];
+    Spectate spectate;
+    Uring uring;
+    Tick tick;
+    int load_step;
+    int load_done;
+    uint64_t load_start;
+    uint64_t load_moves;
+    Histogram load_latency;
+    LoadStep load_steps[LOAD_MAXSTEPS];
+    int *cpus;
+    int num_cpus;
+    uint64_t lod_replies[LOD_LEVELS];
+    WaitState wait;
+} Server;
+
+#ifdef PHTRACE
+Trace trace;
+#endif
+
+ParallelPool parallel_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
 ServerMsg servermsg_new(Grid *, Client *);
-ServerMsg servermsg_recv(void);
-ssize_t servermsg_send(Client *, ServerMsg);
+size_t servermsg_encode(char *, ServerMsg *, int);
+size_t servermsg_decode(ServerMsg *, const char *, int);
+size_t servermsg_encodedelta(char *, ServerMsg *, ServerMsg *);
+size_t servermsg_decodedelta(ServerMsg *, const char *);
+size_t servermsg_deltasize(const char *, size_t);
+ServerMsg servermsg_recv(int);
+int servermsg_recvbatch(MuxServerMsg *, int, int);
+void servermsg_send(Grid *, Client *, ServerMsg);
 ClientMsg clientmsg_new(ServerMsg, ClientType, Coordinate);
-ClientMsg clientmsg_recv(Client *);
-ssize_t clientmsg_send(ClientMsg);
-void client_main(ClientType, Coordinate);
-void client_randsleep(void);
+ClientMsg clientmsg_wander(ServerMsg, Coordinate, uint64_t *);
+size_t clientmsg_need(Proc *, Grid *);
+int clientmsg_recv(Proc *, Grid *, MuxClientMsg *);
+size_t clientmsg_encode(char *, ClientMsg *, int);
+void clientmsg_decode(ClientMsg *, const char *, int);
+ssize_t clientmsg_send(ClientMsg, int);
+ssize_t clientmsg_sendbatch(char *, MuxClientMsg *, int, int);
+void client_main(ClientType, Coordinate, int, int);
+void client_muxmain(ClientType, Coordinate, int, int, int);
+void client_sleep(int);
+void *grid_alloc(Grid *, size_t);
 void grid_destroy(Grid *);
 int grid_distance(Coordinate, Coordinate);
 int grid_equal(Coordinate, Coordinate);
+int grid_onmap(Grid *, Coordinate);
 Grid *grid_fromfmt(void);
+Grid *grid_new(Coordinate);
+Coordinate grid_readcoord(Reader *, Coordinate, const char *);
+void grid_readunits(Reader *, Grid *, int, ClientType);
 void grid_neighbors(Coordinate *, int *, Coordinate, Coordinate);
+void grid_readevents(Reader *, Grid *);
+void grid_indexobstacles(Grid *, int);
+int grid_isobstacle(Grid *, Coordinate);
+int grid_addobstacle(Grid *, Coordinate);
+int grid_removeobstacle(Grid *, Coordinate);
+void grid_viewobstacle(Grid *, Coordinate, int);
+void grid_setview(Grid *, ViewMode, int, int, int);
+void grid_viewinit(Grid *);
+Coordinate grid_vieworigin(Grid *);
+size_t grid_renderwindow(Grid *);
+size_t grid_renderoverview(Grid *);
 void grid_print(Grid *);
+SpectateSlot *spectate_slot(Spectate *, uint64_t);
+void spectate_create(Spectate *, const char *, size_t);
+void spectate_publish(Spectate *, const char *, size_t);
+void spectate_close(Spectate *);
+void spectate_attach(Spectate *, const char *);
+int spectate_read(Spectate *, uint64_t *, char *, size_t *);
+void arena_init(Arena *, size_t);
+void *arena_alloc(Arena *, size_t);
+void *arena_grow(Arena *, void *, size_t);
+void arena_hugepages(Arena *);
+void arena_destroy(Arena *);
+void wire_putcoord(char *, Coordinate);
+Coordinate wire_getcoord(const char *);
+uint64_t cellmap_key(Coordinate);
+void cellmap_init(CellMap *, Arena *, size_t);
+void cellmap_clear(CellMap *);
+int cellmap_get(CellMap *, Coordinate);
+void cellmap_claim(CellMap *, Coordinate, int);
+void cellmap_put(CellMap *, Coordinate, int);
+void cellmap_remove(CellMap *, Coordinate);
+void unitmap_init(Grid *, UnitMapMode);
+void unitmap_build(Grid *);
+int unitmap_first(Grid *, Coordinate);
+void unitmap_setfirst(Grid *, Coordinate, int);
+void unitmap_add(Grid *, Client *);
+void unitmap_remove(Grid *, Client *, Coordinate);
+void unitmap_move(Grid *, Client *, Coordinate);
+uint64_t clock_nsec(void);
+int hist_bucket(uint64_t);
+uint64_t hist_bucketmax(int);
+void hist_add(Histogram *, uint64_t);
+void hist_merge(Histogram *, Histogram *);
+uint64_t hist_percentile(Histogram *, double);
 int ipc_createpipe(int *);
 int ipc_packintarg(char *, int);
 void ipc_closeclientend(int *);
-void ipc_execclient(ClientType, Coordinate);
+void ipc_pincpu(pid_t, int);
+void ipc_execclient(ClientType, Coordinate, int, int, int);
+ssize_t ipc_readfull(int, void *, size_t);
 void ipc_redirstdio(int *);
 void ipc_setcloexec(int *);
-void server_main(void);
-void server_processmsg(int *, struct pollfd *, Grid *, Client *, ClientMsg);
+void ipc_setnonblock(int);
+int uring_init(Uring *, unsigned, unsigned);
+struct io_uring_sqe *uring_getsqe(Uring *);
+void uring_submit(Uring *);
+void uring_wait(Uring *, uint64_t);
+void uring_destroy(Uring *);
+void reader_init(Reader *, int, const char *);
+void reader_destroy(Reader *);
+void reader_error(Reader *, const char *, ...);
+int reader_fill(Reader *);
+int reader_skipspace(Reader *);
+uint64_t reader_digits(const char *, int *);
+int reader_int(Reader *, const char *);
+void reader_end(Reader *);
+void *parallel_worker(void *);
+void parallel_for(int, int, ParallelFn, void *);
+#ifdef PHTRACE
+void trace_init(const char *);
+static inline void trace_event(TraceKind, int);
+void trace_write(void);
+#endif
+void server_main(ServerConfig *);
+int server_wait(Server *);
+int server_poll(Server *, uint64_t);
+int server_collectready(Server *, uint64_t);
+void server_schedule(Server *, int *);
+void server_serveproc(Server *, int);
+int server_recvproc(Server *, int);
+void server_flushproc(Server *, int);
+void server_drainproc(Server *, int);
+void server_evictproc(Server *, int, const char *);
+int server_penalizeproc(Server *, int);
+void server_watchdog(Server *, uint64_t);
+void server_controlinit(Server *);
+int server_control(Server *);
+void server_obstacles(Server *, uint64_t);
+int server_pace(Server *, Client *, ServerMsg *, uint64_t);
+int server_lodlevel(Server *, ServerMsg *);
+void server_uringinit(Server *);
+void server_uringrecv(Server *, int);
+int server_uringwait(Server *, uint64_t);
+void server_spawnprocs(Server *);
+void server_placement(Server *);
+int server_placeproc(Server *, Proc *);
+int server_cmpready(const void *, const void *, void *);
+void server_report(Server *);
+void server_loadinit(Server *);
+void server_loadstep(Server *, uint64_t);
+void server_loadreport(Server *);
+MoveResult server_processmsg(int *, struct pollfd *, Grid *, Client *,
+    ClientMsg);
+Coordinate server_altmove(Grid *, Client *, ServerMsg *);
+void server_redirect(Server *, Client *, ServerMsg *, int *);
 int server_isstable(Grid *);
-void server_forkclient(Client *, Coordinate);
-void server_linkclient(Client *, pid_t, int *);
-void server_killclient(Client *);
+void server_forkproc(Proc *, Grid *);
+void server_linkproc(Proc *, pid_t, int *);
+void server_killclient(Grid *, struct pollfd *, Client *);
 int server_clientalive(Client *);
 ClientType server_clientadvtype(Client *);
 Coordinate server_clientnearestadv(Grid *grid, Client *);
+int server_clientnearestadvidx(Grid *, Client *);
 void server_clientobjects(Coordinate *, int *, Grid *, Client *);
+void server_collectmoves(Server *, uint64_t);
+void server_tick(Server *);
+void tick_init(Tick *, Grid *);
+ClientType tick_claimtype(Grid *, Client *);
+void tick_phasestart(void *, int, int);
+void tick_phaseclaim(void *, int, int);
+void tick_phasemove(void *, int, int);
+void tick_phasecapture(void *, int, int);
+void tick_resolve(Tick *, Grid *, int);
+void tick_resolvereference(Tick *, Grid *);
+void tick_verify(Tick *, Grid *);
+MoveResult tick_denial(Tick *, Grid *, Client *);
+int tick_apply(Tick *, Grid *, struct pollfd *);
+void cache_init(Grid *);
+void cache_lookup(Grid *, Client *, ServerMsg *);
+void cache_scanadv(Grid *, Client *, CacheEntry *);
+void cache_dropobjects(Grid *, Coordinate, Client *);
+void cache_updateadv(CacheEntry *, Client *, Client *);
+void cache_move(Grid *, Client *, Coordinate);
+void cache_kill(Grid *, Client *);
+void cache_obstacle(Grid *, Coordinate);
+void cache_flush(Grid *);
+void path_init(Grid *, uint64_t, uint64_t, int);
+int path_cluster(PathGraph *, Coordinate);
+void path_bounds(Grid *, int, Coordinate *, Coordinate *);
+Coordinate path_border(Coordinate, Coordinate, int, int);
+Coordinate path_across(Coordinate, int);
+PathNode *path_node(PathGraph *, int);
+int path_isblocked(PathGraph *, Coordinate);
+void path_setblocked(PathGraph *, Coordinate, int);
+int path_local(Coordinate, Coordinate);
+void path_load(Grid *, int, unsigned char *);
+int path_entrances(Grid *, int, unsigned char *, PathNode *);
+void path_search(unsigned char *, int, uint16_t *, uint16_t *);
+void path_sweep(unsigned char *, Coordinate, Coordinate, PathNode *, int,
+    uint16_t *);
+int path_buildcluster(Grid *, int);
+void path_phasecount(void *, int, int);
+void path_phasebuild(void *, int, int);
+void path_rebuild(Grid *, int);
+void path_obstacle(Grid *, Coordinate);
+void path_push(Grid *, int, int, int);
+int path_pop(PathGraph *, PathOpen *);
+void path_relax(Grid *, int, int, int, Coordinate);
+Coordinate path_next(Grid *, Coordinate, Coordinate);
+void path_report(Grid *);
 
 // servermsg_new - create a new ServerMsg response for a client
 //     grid: the grid object
 //     client: client asking for the data
 //
 // Calculates the ServerMsg fields as required, and packs them into a
-// struct; and returns it.
+// struct; and returns it. With a reply cache, the fields are taken from
+// it where they are still valid. With the pathfinding service, hunters
+// are given their next step towards their adversary.
 ServerMsg
 servermsg_new(Grid *grid, Client *client)
 {
@@ -127,988 +1054,7079 @@ servermsg_new(Grid *grid, Client *client)
     memset(&msg, 0, sizeof(ServerMsg));
 
     msg.pos = client->ui.pos;
-    msg.adv_pos = server_clientnearestadv(grid, client);
-    server_clientobjects(object_pos, &object_count, grid, client);
-    msg.object_count = object_count;
+    msg.alt_move.x = msg.alt_move.y = -1;
+    msg.waypoint.x = msg.waypoint.y = -1;
+
+    if (grid->cache)
+        cache_lookup(grid, client, &msg);
+    else
+    {
+        msg.adv_pos = server_clientnearestadv(grid, client);
+        server_clientobjects(object_pos, &object_count, grid, client);
+        msg.object_count = object_count;
+
+        // Copy the local array into the struct.
+        for (i = 0; i < object_count; i++)
+            msg.object_pos[i] = object_pos[i];
+    }
 
-    // Copy the local array into the struct.
-    for (i = 0; i < object_count; i++)
-        msg.object_pos[i] = object_pos[i];
+    // Preys keep fleeing greedily: there is no one place to run to.
+    if (grid->path && client->ui.type == CT_HUNTER)
+        msg.waypoint = path_next(grid, client->ui.pos, msg.adv_pos);
 
     return msg;
 }
 
-// servermsg_recv - read a ServerMsg from the standard input
+// servermsg_encode - serialize a ServerMsg
+//     buf: Room for sizeof(ServerMsg) bytes.
+//     msg: The message.
+//     compact: Whether to use the compact encoding.
 //
-// Reads a ServerMsg from standard input and returns it.
-// On error, prints the reason on stderr and exits with a failure code.
-ServerMsg
-servermsg_recv(void)
+// Returns the number of bytes written. The wide encoding is the struct
+// itself.
+size_t
+servermsg_encode(char *buf, ServerMsg *msg, int compact)
 {
-    ServerMsg msg;
-    ssize_t nbytes;
-    
-    nbytes = read(0, &msg, sizeof(ServerMsg));
-    
-    if (nbytes < 0)
+    uint32_t delay_us = msg->delay_us;
+    size_t size;
+    int i;
+
+    if (!compact)
     {
-        perror("servermsg_recv");
-        exit(EXIT_FAILURE);
+        memcpy(buf, msg, sizeof(ServerMsg));
+        return sizeof(ServerMsg);
     }
 
-    return msg;
+    wire_putcoord(buf, msg->pos);
+    wire_putcoord(buf + 4, msg->adv_pos);
+    memcpy(buf + 8, &delay_us, 4);
+    buf[12] = msg->object_count;
+    buf[13] = msg->result | (msg->alt_move.x >= 0 ? WIRE_ALT : 0) |
+        (msg->waypoint.x >= 0 ? WIRE_WAYPOINT : 0);
+    size = WIRE_SERVERHDR;
+
+    for (i = 0; i < msg->object_count; i++, size += 4)
+        wire_putcoord(buf + size, msg->object_pos[i]);
+
+    if (msg->alt_move.x >= 0)
+    {
+        wire_putcoord(buf + size, msg->alt_move);
+        size += 4;
+    }
+
+    if (msg->waypoint.x >= 0)
+    {
+        wire_putcoord(buf + size, msg->waypoint);
+        size += 4;
+    }
+
+    return size;
 }
 
-// servermsg_send - send a ServerMsg to a bidirectional pipe
-//     client: The client to send the message to.
-//     msg: The message.
+// servermsg_decode - deserialize a ServerMsg
+//     msg: The message to fill.
+//     buf: The encoded message. In the compact encoding, the objects, the
+//          alternative move and the waypoint need only be there once the
+//          header has been decoded.
+//     compact: Whether to use the compact encoding.
 //
-// Sends a ServerMsg through the file descriptor of a client.
-// On error, prints the reason on stderr and exits with a failure code.
-ssize_t
-servermsg_send(Client *client, ServerMsg msg)
+// Returns the size of the encoded message, which for the compact encoding
+// is known from its header.
+size_t
+servermsg_decode(ServerMsg *msg, const char *buf, int compact)
 {
-    ssize_t nbytes;
-    
-    nbytes = write(client->fd, &msg, sizeof(ServerMsg));
+    uint32_t delay_us;
+    size_t size;
+    int i;
 
-    if (nbytes < 0)
+    if (!compact)
     {
-        perror("servermsg_send");
-        exit(EXIT_FAILURE);
+        memcpy(msg, buf, sizeof(ServerMsg));
+        return sizeof(ServerMsg);
     }
-    
-    return nbytes;
+
+    memset(msg, 0, sizeof(ServerMsg));
+    msg->pos = wire_getcoord(buf);
+    msg->adv_pos = wire_getcoord(buf + 4);
+    memcpy(&delay_us, buf + 8, 4);
+    msg->delay_us = delay_us;
+    msg->object_count = (unsigned char) buf[12];
+    if (msg->object_count > 4)
+        msg->object_count = 4;
+    msg->result = buf[13] & ~(WIRE_ALT | WIRE_WAYPOINT);
+    size = WIRE_SERVERHDR;
+
+    for (i = 0; i < msg->object_count; i++, size += 4)
+        msg->object_pos[i] = wire_getcoord(buf + size);
+
+    msg->alt_move.x = msg->alt_move.y = -1;
+    if (buf[13] & WIRE_ALT)
+    {
+        msg->alt_move = wire_getcoord(buf + size);
+        size += 4;
+    }
+
+    msg->waypoint.x = msg->waypoint.y = -1;
+    if (buf[13] & WIRE_WAYPOINT)
+    {
+        msg->waypoint = wire_getcoord(buf + size);
+        size += 4;
+    }
+
+    return size;
 }
 
-// clientmsg_new - create a new ClientMsg response to the server 
-//     msgin: The message received from the server.
-//     type: Hunter or prey.
-//     mapsize: The dimensions of the map.
+// servermsg_encodedelta - serialize what changed in a ServerMsg
+//     buf: Room for WIRE_DELTAMAX bytes.
+//     msg: The message.
+//     sent: The last message sent to the same unit, all zero before the
+//           first one. It is replaced by msg.
 //
-// Creates a new ClientMsg based on the ServerMsg and the client's own
-// type. On error, prints the reason on stderr and exits with a
-// failure code.
-ClientMsg
-clientmsg_new(ServerMsg msgin, ClientType type, Coordinate mapsize)
+// Returns the number of bytes written: the mask, and the fields that
+// differ from sent in the compact encoding.
+size_t
+servermsg_encodedelta(char *buf, ServerMsg *msg, ServerMsg *sent)
 {
-    ClientMsg msg;
-    Coordinate neighbors[4], result;
-    int num_neighbors, i, j, valid, curdistance, newdistance;
+    uint32_t delay_us = msg->delay_us;
+    size_t size = 1;
+    int mask = 0, i;
 
-    // Get the neighbors into the local array, and store the number of
-    // neighbors in num_neighbors.
-    grid_neighbors(neighbors, &num_neighbors, mapsize, msgin.pos);
+    if (!grid_equal(msg->pos, sent->pos))
+    {
+        mask |= DELTA_POS;
+        wire_putcoord(buf + size, msg->pos);
+        size += 4;
+    }
 
-    // The distance between this unit and the nearest adversary.
-    curdistance = grid_distance(msgin.pos, msgin.adv_pos);
+    if (!grid_equal(msg->adv_pos, sent->adv_pos))
+    {
+        mask |= DELTA_ADV;
+        wire_putcoord(buf + size, msg->adv_pos);
+        size += 4;
+    }
 
-    for (i = 0; i < num_neighbors; i++)
+    if (msg->delay_us != sent->delay_us)
     {
-        result = neighbors[i];
+        mask |= DELTA_DELAY;
+        memcpy(buf + size, &delay_us, 4);
+        size += 4;
+    }
 
-        for (j = 0; j < msgin.object_count; j++)
-            if (grid_equal(result, msgin.object_pos[j]))
-                goto obstructed;
+    if (msg->object_count != sent->object_count ||
+        memcmp(msg->object_pos, sent->object_pos,
+            msg->object_count * sizeof(Coordinate)))
+    {
+        mask |= DELTA_OBJECTS;
+        buf[size++] = msg->object_count;
 
-        newdistance = grid_distance(result, msgin.adv_pos);
+        for (i = 0; i < msg->object_count; i++, size += 4)
+            wire_putcoord(buf + size, msg->object_pos[i]);
+    }
 
-        // A move for a hunter is valid if it is closer to its adversary
-        // after a move (it is *chasing* the adversary), meaning that the
-        // distance must be less than the initial distance. The opposite
-        // holds true for preys.
-        if (type == CT_HUNTER)
-            valid = newdistance < curdistance;
-        else
-            valid = newdistance > curdistance;
+    if (msg->result != sent->result)
+    {
+        mask |= DELTA_RESULT;
+        buf[size++] = msg->result;
+    }
 
-        // No need to search for other moves if the current one is valid.
-        if (valid)
-            break;
+    if (!grid_equal(msg->alt_move, sent->alt_move))
+    {
+        mask |= DELTA_ALT;
+        wire_putcoord(buf + size, msg->alt_move);
+        size += 4;
+    }
 
-obstructed: // Continue the outer for-loop.
-        ;
+    if (!grid_equal(msg->waypoint, sent->waypoint))
+    {
+        mask |= DELTA_WAYPOINT;
+        wire_putcoord(buf + size, msg->waypoint);
+        size += 4;
     }
 
-    // If no valid moves were found, request to stay in the current
-    // position.
-    if (!valid)
-        result = msgin.pos;
-    msg.move_request = result;
+    buf[0] = mask;
+    *sent = *msg;
 
-    return msg;
+    return size;
 }
 
-// clientmsg_recv - read a ClientMsg from a bidirectional pipe
-//     client: The client to read the message from.
+// servermsg_decodedelta - apply a delta-encoded ServerMsg
+//     msg: The last message of the unit, all zero before the first one.
+//          It is updated with the fields that changed.
+//     buf: The encoded message.
 //
-// Reads a ClientMsg from the specified client's file descriptor.
-// On error, prints the reason on stderr and exits with a failure code.
-ClientMsg
-clientmsg_recv(Client *client)
+// Returns the size of the encoded message.
+size_t
+servermsg_decodedelta(ServerMsg *msg, const char *buf)
 {
-    ClientMsg msg;
-    ssize_t nbytes;
-    
-    nbytes = read(client->fd, &msg, sizeof(ClientMsg));
+    uint32_t delay_us;
+    size_t size = 1;
+    int mask = buf[0], i;
 
-    if (nbytes < 0)
+    if (mask & DELTA_POS)
     {
-        perror("clientmsg_recv");
-        exit(EXIT_FAILURE);
+        msg->pos = wire_getcoord(buf + size);
+        size += 4;
     }
 
-    return msg;
-}
+    if (mask & DELTA_ADV)
+    {
+        msg->adv_pos = wire_getcoord(buf + size);
+        size += 4;
+    }
 
-// clientmsg_recv - send a ClientMsg to the standard output
-//     msg: The message to send.
+    if (mask & DELTA_DELAY)
+    {
+        memcpy(&delay_us, buf + size, 4);
+        msg->delay_us = delay_us;
+        size += 4;
+    }
+
+    if (mask & DELTA_OBJECTS)
+    {
+        msg->object_count = (unsigned char) buf[size++];
+        if (msg->object_count > 4)
+            msg->object_count = 4;
+
+        for (i = 0; i < msg->object_count; i++, size += 4)
+            msg->object_pos[i] = wire_getcoord(buf + size);
+    }
+
+    if (mask & DELTA_RESULT)
+        msg->result = (unsigned char) buf[size++];
+
+    if (mask & DELTA_ALT)
+    {
+        msg->alt_move = wire_getcoord(buf + size);
+        size += 4;
+    }
+
+    if (mask & DELTA_WAYPOINT)
+    {
+        msg->waypoint = wire_getcoord(buf + size);
+        size += 4;
+    }
+
+    return size;
+}
+
+// servermsg_deltasize - get the size of a delta-encoded ServerMsg
+//     buf: The start of the message.
+//     len: The number of bytes of it at hand.
 //
-// Writes a ClientMsg to the standard output. On error, prints the
-// reason on stderr and exits with a failure code.
-ssize_t
-clientmsg_send(ClientMsg msg)
+// Returns the size of the message, as far as it is known from its first
+// len bytes: the mask gives the fixed fields, and the object count, once
+// it is there, the rest.
+size_t
+servermsg_deltasize(const char *buf, size_t len)
+{
+    size_t size = 1, tail;
+    int mask, count;
+
+    if (len < 1)
+        return 1;
+
+    mask = buf[0];
+    size += mask & DELTA_POS ? 4 : 0;
+    size += mask & DELTA_ADV ? 4 : 0;
+    size += mask & DELTA_DELAY ? 4 : 0;
+    tail = (mask & DELTA_RESULT ? 1 : 0) + (mask & DELTA_ALT ? 4 : 0) +
+        (mask & DELTA_WAYPOINT ? 4 : 0);
+
+    if (!(mask & DELTA_OBJECTS))
+        return size + tail;
+
+    if (len <= size)
+        return size + 1;
+
+    count = (unsigned char) buf[size];
+
+    return size + 1 + 4 * (count > 4 ? 4 : count) + tail;
+}
+
+// servermsg_recv - read a ServerMsg from the standard input
+//     compact: 0 for the wide encoding, WIRE_COMPACT or WIRE_DELTA.
+//
+// Reads a ServerMsg from standard input and returns it. A compact
+// message is read in two parts, its header telling the size of the rest.
+// A delta-encoded one is applied to the last message, which is kept
+// here. Exits quietly when the server has gone away. On error, prints
+// the reason on stderr and exits with a failure code.
+ServerMsg
+servermsg_recv(int compact)
 {
+    static ServerMsg view;
+    char buf[sizeof(ServerMsg)];
+    size_t size = compact ? WIRE_SERVERHDR : sizeof(ServerMsg), len = 0;
+    ServerMsg msg;
     ssize_t nbytes;
-    
-    nbytes = write(1, &msg, sizeof(ClientMsg));
 
-    if (nbytes < 0)
+    if (compact == WIRE_DELTA)
     {
-        perror("clientmsg_send");
+        while ((size = servermsg_deltasize(buf, len)) > len)
+        {
+            nbytes = ipc_readfull(0, buf + len, size - len);
+
+            if (nbytes == 0 && len == 0)
+                exit(EXIT_SUCCESS);
+
+            if (nbytes < 0 || (size_t) nbytes != size - len)
+            {
+                perror("servermsg_recv");
+                exit(EXIT_FAILURE);
+            }
+
+            len = size;
+        }
+
+        servermsg_decodedelta(&view, buf);
+
+        return view;
+    }
+
+    nbytes = ipc_readfull(0, buf, size);
+
+    if (nbytes == 0)
+        exit(EXIT_SUCCESS);
+
+    if (nbytes >= 0 && (size_t) nbytes == size && compact)
+    {
+        size = servermsg_decode(&msg, buf, compact) - WIRE_SERVERHDR;
+        nbytes = ipc_readfull(0, buf + WIRE_SERVERHDR, size);
+    }
+
+    if (nbytes < 0 || (size_t) nbytes != size)
+    {
+        perror("servermsg_recv");
         exit(EXIT_FAILURE);
     }
 
-    return nbytes;
+    servermsg_decode(&msg, buf, compact);
+
+    return msg;
 }
 
-// client_main - the main client loop
-//     type: Hunter or prey.
-//     mapsize: The size of the map.
-//
-// When the client process enters this function, it will enter a loop that
-// consists of the following steps:
+// servermsg_recvbatch - read a batch of ServerMsgs from the standard input
+//     buf: A preallocated array for the messages.
+//     max: The size of buf, which is the number of units.
+//     compact: 0 for the wide encoding, WIRE_COMPACT or WIRE_DELTA.
 //
-//     1. read a ServerMsg from standard input
-//     2. calculate a corresponding ClientMsg
-//     3. write the calculated ClientMsg to standard output
-//     4. sleep for a random amount of time
+// Reads one frame of a multiplexed client: the number of messages, then
+// the messages tagged with the slot of their unit. Delta-encoded messages
+// are applied to the last message of their slot, kept here. Returns the
+// number of messages. Exits quietly when the server has gone away. On
+// error, prints the reason on stderr and exits with a failure code.
+int
+servermsg_recvbatch(MuxServerMsg *buf, int max, int compact)
+{
+    static char *frame;
+    static ServerMsg *views;
+    size_t size, off = 0;
+    ssize_t nbytes;
+    int header[2], i;
+
+    if (!frame)
+    {
+        frame = malloc(max * sizeof(MuxServerMsg));
+        views = calloc(max, sizeof(ServerMsg));
+    }
+
+    nbytes = ipc_readfull(0, header, compact ? 2 * sizeof(int) : sizeof(int));
+
+    if (nbytes == 0)
+        exit(EXIT_SUCCESS);
+
+    size = compact ? (size_t) header[1] : header[0] * sizeof(MuxServerMsg);
+
+    if (nbytes > 0 && header[0] >= 0 && header[0] <= max &&
+        size <= max * sizeof(MuxServerMsg))
+        nbytes = ipc_readfull(0, frame, size);
+    else
+        nbytes = -1;
+
+    if (nbytes < 0 || (size_t) nbytes != size)
+    {
+        perror("servermsg_recvbatch");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < header[0]; i++)
+    {
+        memcpy(&buf[i].slot, frame + off, sizeof(int));
+        off += sizeof(int);
+
+        if (compact != WIRE_DELTA)
+        {
+            off += servermsg_decode(&buf[i].msg, frame + off, compact);
+            continue;
+        }
+
+        if (buf[i].slot < 0 || buf[i].slot >= max)
+        {
+            fprintf(stderr, "servermsg_recvbatch: bad slot %d\n",
+                buf[i].slot);
+            exit(EXIT_FAILURE);
+        }
+
+        off += servermsg_decodedelta(&views[buf[i].slot], frame + off);
+        buf[i].msg = views[buf[i].slot];
+    }
+
+    return header[0];
+}
+
+// servermsg_send - queue a ServerMsg for a client
+//     grid: The grid holding the process table.
+//     client: The client to send the message to.
+//     msg: The message.
 //
-// This loop can only be broken by a SIGTERM by the server process.
+// Appends the message to the reply frame of the process driving the
+// client; server_flushproc() writes the frame out. A process driving a
+// single unit gets the bare ServerMsg, otherwise the message is tagged
+// with the slot of the unit and counted in the frame header. Messages
+// are encoded as chosen for the grid; in the delta encoding, against the
+// last message sent to the unit, in grid->sent.
 void
-client_main(ClientType type, Coordinate mapsize)
+servermsg_send(Grid *grid, Client *client, ServerMsg msg)
 {
-    ClientMsg msgout;
-    ServerMsg msgin;
+    Proc *proc = &grid->procs[client->proc];
+    int slot = client->idx - proc->units[0];
+    size_t header = grid->compact ? 2 * sizeof(int) : sizeof(int), size;
+    char *buf;
 
-    while (1)
+    TRACE(TR_SEND, client->idx);
+
+    if (msg.delay_us > proc->delay_us)
+        proc->delay_us = msg.delay_us;
+
+    if (grid->units_per_proc == 1)
+        proc->out_len = 0;
+    else
+    {
+        if (proc->out_len == 0)
+        {
+            memset(proc->out, 0, header);
+            proc->out_len = header;
+        }
+
+        memcpy(proc->out + proc->out_len, &slot, sizeof(int));
+        proc->out_len += sizeof(int);
+    }
+
+    buf = proc->out + proc->out_len;
+
+    if (grid->compact == WIRE_DELTA)
+        size = servermsg_encodedelta(buf, &msg, &grid->sent[client->idx]);
+    else
+        size = servermsg_encode(buf, &msg, grid->compact);
+
+    proc->out_len += size;
+
+    if (grid->units_per_proc == 1)
+        return;
+
+    ((int *) proc->out)[0]++;
+
+    if (grid->compact)
+        ((int *) proc->out)[1] = proc->out_len - header;
+}
+
+// clientmsg_new - create a new ClientMsg response to the server 
+//     msgin: The message received from the server.
+//     type: Hunter or prey.
+//     mapsize: The dimensions of the map.
+//
+// Creates a new ClientMsg based on the ServerMsg and the client's own
+// type. A denied move is followed by the alternative the server offers,
+// if any, and a hunter takes the waypoint of the server unless an ally
+// stands on it. On error, prints the reason on stderr and exits with a
+// failure code.
+ClientMsg
+clientmsg_new(ServerMsg msgin, ClientType type, Coordinate mapsize)
+{
+    ClientMsg msg;
+    Coordinate neighbors[4], result;
+    int num_neighbors, i, j, valid = 0, curdistance, newdistance;
+
+    if (msgin.alt_move.x >= 0)
+    {
+        msg.move_request = msgin.alt_move;
+        return msg;
+    }
+
+    if (type == CT_HUNTER && msgin.waypoint.x >= 0)
+    {
+        for (j = 0; j < msgin.object_count; j++)
+            if (grid_equal(msgin.waypoint, msgin.object_pos[j]))
+                break;
+
+        if (j == msgin.object_count)
+        {
+            msg.move_request = msgin.waypoint;
+            return msg;
+        }
+    }
+
+    // Get the neighbors into the local array, and store the number of
+    // neighbors in num_neighbors.
+    grid_neighbors(neighbors, &num_neighbors, mapsize, msgin.pos);
+
+    // The distance between this unit and the nearest adversary.
+    curdistance = grid_distance(msgin.pos, msgin.adv_pos);
+
+    for (i = 0; i < num_neighbors; i++)
     {
-        msgin = servermsg_recv();
-        msgout = clientmsg_new(msgin, type, mapsize);
-        clientmsg_send(msgout);
-        client_randsleep();
+        result = neighbors[i];
+
+        for (j = 0; j < msgin.object_count; j++)
+            if (grid_equal(result, msgin.object_pos[j]))
+                goto obstructed;
+
+        newdistance = grid_distance(result, msgin.adv_pos);
+
+        // A move for a hunter is valid if it is closer to its adversary
+        // after a move (it is *chasing* the adversary), meaning that the
+        // distance must be less than the initial distance. The opposite
+        // holds true for preys.
+        if (type == CT_HUNTER)
+            valid = newdistance < curdistance;
+        else
+            valid = newdistance > curdistance;
+
+        // No need to search for other moves if the current one is valid.
+        if (valid)
+            break;
+
+obstructed: // Continue the outer for-loop.
+        ;
     }
+
+    // If no valid moves were found, request to stay in the current
+    // position.
+    if (!valid)
+        result = msgin.pos;
+    msg.move_request = result;
+
+    return msg;
 }
 
-// client_randsleep - sleep for a random amount of time
+// clientmsg_wander - create a load-generator response to the server
+//     msgin: The message received from the server.
+//     mapsize: The dimensions of the map.
+//     rng: The state of the random generator of the process.
 //
-// Sleeps for a random amount of time between 10ms and 100ms.
-void client_randsleep(void)
+// Picks a random neighboring cell that holds no obstacle, ally or nearest
+// adversary, and stays put if there is none. The server denies the moves
+// of load generators into any other unit, so they never fight.
+ClientMsg
+clientmsg_wander(ServerMsg msgin, Coordinate mapsize, uint64_t *rng)
 {
-    usleep(10000 * (1 + rand() % 9));
+    ClientMsg msg;
+    Coordinate neighbors[4], free[4];
+    int num_neighbors, num_free = 0, i, j;
+
+    grid_neighbors(neighbors, &num_neighbors, mapsize, msgin.pos);
+
+    for (i = 0; i < num_neighbors; i++)
+    {
+        if (grid_equal(neighbors[i], msgin.adv_pos))
+            continue;
+
+        for (j = 0; j < msgin.object_count; j++)
+            if (grid_equal(neighbors[i], msgin.object_pos[j]))
+                break;
+
+        if (j == msgin.object_count)
+            free[num_free++] = neighbors[i];
+    }
+
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+
+    msg.move_request = num_free > 0 ? free[*rng % num_free] : msgin.pos;
+
+    return msg;
 }
 
-// grid_destroy - deallocates a grid object containing its data
-//     grid: The grid to destroy.
+// clientmsg_need - get the size of the frame being received
+//     proc: The process the frame comes from.
+//     grid: The grid, for the encoding and the number of units per process.
 //
-// The data structures of the server are deallocated with this function,
-// including the Client array and the obstacle array.
-void grid_destroy(Grid *grid)
+// Returns the number of bytes of the frame whose start is in proc->in,
+// as far as it is known: for a multiplexed process, only the count
+// header until it has arrived. Returns 0 if the header is malformed.
+size_t
+clientmsg_need(Proc *proc, Grid *grid)
 {
-    if (!grid)
-        return;
+    size_t size = grid->compact ? WIRE_CLIENTMSG : sizeof(ClientMsg);
+    int count;
+
+    if (grid->units_per_proc == 1)
+        return size;
+
+    if (proc->in_len < sizeof(int))
+        return sizeof(int);
+
+    memcpy(&count, proc->in, sizeof(int));
+
+    if (count < 0 || count > proc->num_units)
+    {
+        LOG("[ipc] bad frame of %d messages from pid %d\n",
+            count, (int) proc->pid);
+        return 0;
+    }
 
-    free(grid->obstacles);
-    free(grid->clients);
-    free(grid);
+    return sizeof(int) + count * (sizeof(int) + size);
 }
 
-// grid_distance - the distance between two coordinates
-//     a: The first coordinate.
-//     b: The first coordinate.
+// clientmsg_recv - read the requests of a client process
+//     proc: The process to read from.
+//     grid: The grid, for the encoding and the number of units per process.
+//     buf: A preallocated array for proc->num_units messages.
 //
-// Returns the Manhattan Distance between two points on the grid.
+// The server end of the socket is non-blocking, so a frame may arrive
+// in pieces; they are collected in proc->in. Returns the number of
+// messages once a whole frame is in, and 0 while it is not. A
+// single-unit process sends a bare ClientMsg, which is returned as the
+// message of slot 0. Returns -1 if the process has gone away or sent a
+// malformed frame.
 int
-grid_distance(Coordinate a, Coordinate b)
+clientmsg_recv(Proc *proc, Grid *grid, MuxClientMsg *buf)
 {
-    return abs(a.x - b.x) + abs(a.y - b.y);
+    ssize_t nbytes;
+    size_t need, size, off;
+    int i, count;
+
+    while (1)
+    {
+        need = clientmsg_need(proc, grid);
+
+        if (need == 0)
+            return -1;
+
+        if (proc->in_len == need)
+            break;
+
+        nbytes = read(proc->fd, proc->in + proc->in_len,
+            need - proc->in_len);
+
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+
+        if (nbytes <= 0)
+            return -1;
+
+        proc->in_len += nbytes;
+    }
+
+    proc->in_len = 0;
+
+    if (grid->units_per_proc == 1)
+    {
+        buf[0].slot = 0;
+        clientmsg_decode(&buf[0].msg, proc->in, grid->compact);
+        return 1;
+    }
+
+    size = grid->compact ? WIRE_CLIENTMSG : sizeof(ClientMsg);
+    count = (need - sizeof(int)) / (sizeof(int) + size);
+
+    for (i = 0, off = sizeof(int); i < count; i++, off += size)
+    {
+        memcpy(&buf[i].slot, proc->in + off, sizeof(int));
+        off += sizeof(int);
+
+        if (buf[i].slot < 0 || buf[i].slot >= proc->num_units)
+            return -1;
+
+        clientmsg_decode(&buf[i].msg, proc->in + off, grid->compact);
+    }
+
+    return count;
 }
 
-// grid_equal - equality of two coordinates
-//     a: The first coordinate.
-//     b: The first coordinate.
+// clientmsg_encode - serialize a ClientMsg
+//     buf: Room for sizeof(ClientMsg) bytes.
+//     msg: The message.
+//     compact: Whether to use the compact encoding.
 //
-// Returns true if the two coordinates are equal, false otherwise.
-int
-grid_equal(Coordinate a, Coordinate b)
+// Returns the number of bytes written.
+size_t
+clientmsg_encode(char *buf, ClientMsg *msg, int compact)
 {
-    return (a.x == b.x) && (a.y == b.y);
+    if (!compact)
+    {
+        memcpy(buf, msg, sizeof(ClientMsg));
+        return sizeof(ClientMsg);
+    }
+
+    wire_putcoord(buf, msg->move_request);
+    return WIRE_CLIENTMSG;
+}
+
+// clientmsg_decode - deserialize a ClientMsg
+//     msg: The message to fill.
+//     buf: The encoded message.
+//     compact: Whether to use the compact encoding.
+void
+clientmsg_decode(ClientMsg *msg, const char *buf, int compact)
+{
+    if (!compact)
+        memcpy(msg, buf, sizeof(ClientMsg));
+    else
+        msg->move_request = wire_getcoord(buf);
+}
+
+// clientmsg_send - send a ClientMsg to the standard output
+//     msg: The message to send.
+//     compact: Whether the server uses the compact encoding.
+//
+// Writes a ClientMsg to the standard output. On error, prints the
+// reason on stderr and exits with a failure code.
+ssize_t
+clientmsg_send(ClientMsg msg, int compact)
+{
+    char buf[sizeof(ClientMsg)];
+    ssize_t nbytes;
+
+    nbytes = write(1, buf, clientmsg_encode(buf, &msg, compact));
+
+    if (nbytes < 0)
+    {
+        perror("clientmsg_send");
+        exit(EXIT_FAILURE);
+    }
+
+    return nbytes;
+}
+
+// clientmsg_sendbatch - send a batch of ClientMsgs to the standard output
+//     frame: A preallocated buffer of at least sizeof(int) + count *
+//            sizeof(MuxClientMsg) bytes, to encode the frame into.
+//     buf: The messages, tagged with the slots of their units.
+//     count: The number of messages.
+//     compact: Whether the server uses the compact encoding.
+//
+// Writes one frame of a multiplexed client, the counterpart of
+// clientmsg_recv(), with a single write. On error, prints the reason on
+// stderr and exits with a failure code.
+ssize_t
+clientmsg_sendbatch(char *frame, MuxClientMsg *buf, int count, int compact)
+{
+    size_t size = sizeof(int);
+    ssize_t nbytes;
+    int i;
+
+    memcpy(frame, &count, sizeof(int));
+
+    for (i = 0; i < count; i++)
+    {
+        memcpy(frame + size, &buf[i].slot, sizeof(int));
+        size += sizeof(int);
+        size += clientmsg_encode(frame + size, &buf[i].msg, compact);
+    }
+
+    nbytes = write(1, frame, size);
+
+    if (nbytes < 0)
+    {
+        perror("clientmsg_sendbatch");
+        exit(EXIT_FAILURE);
+    }
+
+    return nbytes;
+}
+
+// client_main - the main client loop
+//     type: Hunter or prey.
+//     mapsize: The size of the map.
+//     compact: Whether the server uses the compact encoding.
+//     loadgen: Whether to wander instead of chasing or fleeing.
+//
+// When the client process enters this function, it will enter a loop that
+// consists of the following steps:
+//
+//     1. read a ServerMsg from standard input
+//     2. sleep for as long as the server asks to
+//     3. calculate a corresponding ClientMsg
+//     4. write the calculated ClientMsg to standard output
+//
+// This loop can only be broken by a SIGTERM by the server process. A
+// load generator computes its moves with clientmsg_wander() instead.
+void
+client_main(ClientType type, Coordinate mapsize, int compact, int loadgen)
+{
+    ClientMsg msgout;
+    ServerMsg msgin;
+    uint64_t rng = getpid() | 1;
+
+    while (1)
+    {
+        msgin = servermsg_recv(compact);
+        client_sleep(msgin.delay_us);
+        if (loadgen)
+            msgout = clientmsg_wander(msgin, mapsize, &rng);
+        else
+            msgout = clientmsg_new(msgin, type, mapsize);
+        clientmsg_send(msgout, compact);
+    }
+}
+
+// client_muxmain - the main loop of a multiplexed client
+//     type: Hunter or prey.
+//     mapsize: The size of the map.
+//     num_units: The number of units driven by this process.
+//     compact: Whether the server uses the compact encoding.
+//     loadgen: Whether to wander instead of chasing or fleeing.
+//
+// Like client_main(), but for a process driving several units. Every
+// frame from the server carries the ServerMsgs of a batch of units; the
+// moves of all of them are computed together and returned in one frame,
+// after sleeping once for the whole batch, as long as its slowest unit
+// was asked to.
+void
+client_muxmain(ClientType type, Coordinate mapsize, int num_units,
+    int compact, int loadgen)
+{
+    MuxServerMsg *msgin;
+    MuxClientMsg *msgout;
+    char *frame;
+    int i, count, delay_us;
+    uint64_t rng = getpid() | 1;
+
+    msgin = malloc(num_units * sizeof(MuxServerMsg));
+    msgout = malloc(num_units * sizeof(MuxClientMsg));
+    frame = malloc(sizeof(int) + num_units * sizeof(MuxClientMsg));
+
+    while (1)
+    {
+        count = servermsg_recvbatch(msgin, num_units, compact);
+
+        delay_us = 0;
+        for (i = 0; i < count; i++)
+            if (msgin[i].msg.delay_us > delay_us)
+                delay_us = msgin[i].msg.delay_us;
+        client_sleep(delay_us);
+
+        for (i = 0; i < count; i++)
+        {
+            msgout[i].slot = msgin[i].slot;
+            if (loadgen)
+                msgout[i].msg = clientmsg_wander(msgin[i].msg, mapsize,
+                    &rng);
+            else
+                msgout[i].msg = clientmsg_new(msgin[i].msg, type, mapsize);
+        }
+
+        clientmsg_sendbatch(frame, msgout, count, compact);
+    }
+}
+
+// client_sleep - wait before the next move
+//     delay_us: The delay in microseconds the server asked for.
+//
+// Pacing is decided by the server (see server_pace()); a delay of zero
+// means moving flat out.
+void client_sleep(int delay_us)
+{
+    if (delay_us > 0)
+        usleep(delay_us);
+}
+
+// grid_alloc - allocate memory that lives as long as the grid
+//     grid: The grid.
+//     size: The number of bytes.
+//
+// Returns a zeroed block from the arena of the grid. It is released by
+// grid_destroy() along with everything else.
+void *
+grid_alloc(Grid *grid, size_t size)
+{
+    return arena_alloc(&grid->arena, size);
+}
+
+// grid_destroy - deallocates a grid object containing its data
+//     grid: The grid to destroy.
+//
+// The data structures of the server are deallocated with this function,
+// including the Client array, the obstacle array and anything else
+// allocated with grid_alloc(). They all share the arena of the grid, so
+// this is a single munmap().
+void grid_destroy(Grid *grid)
+{
+    Arena arena;
+
+    if (!grid)
+        return;
+
+    // The grid itself lives in the arena, so copy the handle out first.
+    arena = grid->arena;
+    arena_destroy(&arena);
+}
+
+// grid_distance - the distance between two coordinates
+//     a: The first coordinate.
+//     b: The first coordinate.
+//
+// Returns the Manhattan Distance between two points on the grid.
+int
+grid_distance(Coordinate a, Coordinate b)
+{
+    return abs(a.x - b.x) + abs(a.y - b.y);
+}
+
+// grid_equal - equality of two coordinates
+//     a: The first coordinate.
+//     b: The first coordinate.
+//
+// Returns true if the two coordinates are equal, false otherwise.
+int
+grid_equal(Coordinate a, Coordinate b)
+{
+    return (a.x == b.x) && (a.y == b.y);
+}
+
+// grid_onmap - check that a cell is on the map
+//     grid: The grid.
+//     c: The cell.
+int
+grid_onmap(Grid *grid, Coordinate c)
+{
+    return c.x >= 0 && c.x < grid->mapsize.y && c.y >= 0 &&
+        c.y < grid->mapsize.x;
+}
+
+// grid_fromfmt - parse a grid from standard input
+//
+// Allocates and populates the necessary memory space for the grid,
+// using the values parsed from the standard input. The format is defined
+// in the homework text.
+//
+// The input is read in large blocks, so it may just as well come from a
+// pipe. Every value is validated: counts must not be negative, and every
+// position must be on the map. On malformed or truncated input, prints
+// the line and column of the offending token on stderr and exits with a
+// failure code.
+//
+// The map may end with a script of obstacle changes, see
+// grid_readevents().
+//
+// The obstacles are laid out right after the grid, followed by the
+// clients. The client array is the last block of the arena while it is
+// being read, so it grows in place when the preys are appended to the
+// hunters.
+Grid *
+grid_fromfmt(void)
+{
+    Coordinate coord;
+    Grid *grid;
+    Reader reader;
+    int i, n;
+
+    reader_init(&reader, 0, "stdin");
+
+    // <width> <height>
+    coord.x = reader_int(&reader, "map width");
+    coord.y = reader_int(&reader, "map height");
+    if (coord.x <= 0 || coord.y <= 0)
+        reader_error(&reader, "map size must be positive");
+    grid = grid_new(coord);
+
+    // <num_obstacles>
+    n = reader_int(&reader, "obstacle count");
+    if (n < 0)
+        reader_error(&reader, "obstacle count must not be negative");
+    grid->num_obstacles = n;
+    grid->obstacles = grid_alloc(grid, n * sizeof(Coordinate));
+    grid->obstacles_cap = n;
+
+    // <x> <y>
+    for (i = 0; i < grid->num_obstacles; i++)
+        grid->obstacles[i] = grid_readcoord(&reader, grid->mapsize,
+            "obstacle");
+
+    // <num_hunters>
+    n = reader_int(&reader, "hunter count");
+    if (n < 0)
+        reader_error(&reader, "hunter count must not be negative");
+    grid->clients = grid_alloc(grid, n * sizeof(Client));
+
+    // <x> <y> <energy>
+    grid_readunits(&reader, grid, n, CT_HUNTER);
+
+    // <num_preys>
+    n = reader_int(&reader, "prey count");
+    if (n < 0 || n > INT_MAX - grid->num_clients)
+        reader_error(&reader, "invalid prey count");
+    grid->clients = arena_grow(&grid->arena, grid->clients,
+        (grid->num_clients + n) * sizeof(Client));
+
+    // <x> <y> <energy>
+    grid_readunits(&reader, grid, n, CT_PREY);
+
+    grid_indexobstacles(grid, grid->num_obstacles);
+
+    // [<num_events> <move> <add> <x> <y>...]
+    if (reader_skipspace(&reader))
+        grid_readevents(&reader, grid);
+
+    reader_end(&reader);
+    reader_destroy(&reader);
+
+    return grid;
+}
+
+// grid_readcoord - parse a position on the map
+//     reader: The input.
+//     mapsize: The size of the map.
+//     what: The kind of object at the position, for error messages.
+//
+// Positions are given as row and column, like everywhere else.
+Coordinate
+grid_readcoord(Reader *reader, Coordinate mapsize, const char *what)
+{
+    Coordinate coord;
+
+    coord.x = reader_int(reader, "row");
+    if (coord.x < 0 || coord.x >= mapsize.y)
+        reader_error(reader, "%s row %d is off the map", what, coord.x);
+
+    coord.y = reader_int(reader, "column");
+    if (coord.y < 0 || coord.y >= mapsize.x)
+        reader_error(reader, "%s column %d is off the map", what, coord.y);
+
+    return coord;
+}
+
+// grid_readunits - parse a list of units
+//     reader: The input.
+//     grid: The grid, with room for n more clients.
+//     n: The number of units to read.
+//     type: Hunter or prey.
+//
+// Appends n live clients of the given type to the grid.
+void
+grid_readunits(Reader *reader, Grid *grid, int n, ClientType type)
+{
+    Client *client;
+    const char *what = type == CT_HUNTER ? "hunter" : "prey";
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        client = &grid->clients[grid->num_clients];
+        memset(client, 0, sizeof(Client));
+
+        client->idx = grid->num_clients;
+        client->ui.type = type;
+        client->ui.pos = grid_readcoord(reader, grid->mapsize, what);
+        client->ui.energy = reader_int(reader, "energy");
+        client->ui.alive = 1;
+
+        grid->num_clients++;
+    }
+}
+
+// grid_readevents - parse the obstacle script of a map
+//     reader: The input.
+//     grid: The grid.
+//
+// The script is a count followed by that many changes, each written as
+//
+//     <move> <add> <x> <y>
+//
+// meaning that once the server has processed <move> moves, an obstacle
+// is added at row <x>, column <y> if <add> is 1, or removed if it is 0.
+// Changes must be listed in order of their moves.
+void
+grid_readevents(Reader *reader, Grid *grid)
+{
+    ObstacleEvent *event;
+    int i, n, move;
+
+    n = reader_int(reader, "event count");
+    if (n < 0)
+        reader_error(reader, "event count must not be negative");
+    grid->events = grid_alloc(grid, n * sizeof(ObstacleEvent));
+
+    for (i = 0; i < n; i++)
+    {
+        event = &grid->events[i];
+
+        move = reader_int(reader, "event move");
+        if (move < 0 ||
+            (i > 0 && (uint64_t) move < grid->events[i - 1].move))
+            reader_error(reader, "events must be in order of their moves");
+        event->move = move;
+
+        event->add = reader_int(reader, "event kind");
+        if (event->add != 0 && event->add != 1)
+            reader_error(reader, "event kind must be 0 or 1");
+
+        event->cell = grid_readcoord(reader, grid->mapsize, "event");
+        grid->num_events++;
+    }
+}
+
+// grid_indexobstacles - (re)build the obstacle lookup table
+//     grid: The grid.
+//     capacity: The number of obstacles to make room for.
+//
+// Also drops duplicate obstacles. Changes at runtime keep the table up to
+// date by themselves; this only runs again when it has to grow. The
+// arena cannot free, so the old table and array are left behind; as the
+// capacity doubles, they add up to less than the new ones.
+void
+grid_indexobstacles(Grid *grid, int capacity)
+{
+    Coordinate *obstacles = grid->obstacles;
+    int i, n = 0;
+
+    if (capacity < grid->num_obstacles)
+        capacity = grid->num_obstacles;
+
+    cellmap_init(&grid->obstacle_map, &grid->arena, capacity);
+
+    if (capacity > grid->obstacles_cap)
+    {
+        grid->obstacles = grid_alloc(grid, capacity * sizeof(Coordinate));
+        grid->obstacles_cap = capacity;
+    }
+
+    for (i = 0; i < grid->num_obstacles; i++)
+    {
+        if (cellmap_get(&grid->obstacle_map, obstacles[i]) >= 0)
+            continue;
+
+        cellmap_put(&grid->obstacle_map, obstacles[i], n);
+        grid->obstacles[n++] = obstacles[i];
+    }
+
+    grid->num_obstacles = n;
+}
+
+// grid_isobstacle - check for an obstacle
+//     grid: The grid.
+//     c: The cell.
+int
+grid_isobstacle(Grid *grid, Coordinate c)
+{
+    return cellmap_get(&grid->obstacle_map, c) >= 0;
+}
+
+// grid_addobstacle - put an obstacle on the map at runtime
+//     grid: The grid.
+//     c: The cell, which must be on the map.
+//
+// Returns true if the cell was free of obstacles. Units standing on the
+// cell are not harmed, but see it as blocked from then on. Takes constant
+// time, apart from growing the tables, which doubles them, and rebuilding
+// a cluster or two of the pathfinding service.
+int
+grid_addobstacle(Grid *grid, Coordinate c)
+{
+    if (grid_isobstacle(grid, c))
+        return 0;
+
+    if (grid->num_obstacles == grid->obstacles_cap ||
+        2 * (size_t) (grid->num_obstacles + 1) > grid->obstacle_map.mask + 1)
+        grid_indexobstacles(grid, 2 * grid->num_obstacles + 16);
+
+    cellmap_put(&grid->obstacle_map, c, grid->num_obstacles);
+    grid->obstacles[grid->num_obstacles++] = c;
+    grid_viewobstacle(grid, c, 1);
+    cache_obstacle(grid, c);
+    path_obstacle(grid, c);
+
+    return 1;
+}
+
+// grid_removeobstacle - take an obstacle off the map at runtime
+//     grid: The grid.
+//     c: The cell.
+//
+// Returns true if there was an obstacle. The last obstacle of the array
+// takes the place of the removed one, so this takes constant time.
+int
+grid_removeobstacle(Grid *grid, Coordinate c)
+{
+    Coordinate last;
+    int i = cellmap_get(&grid->obstacle_map, c);
+
+    if (i < 0)
+        return 0;
+
+    cellmap_remove(&grid->obstacle_map, c);
+    last = grid->obstacles[--grid->num_obstacles];
+
+    if (i < grid->num_obstacles)
+    {
+        grid->obstacles[i] = last;
+        cellmap_put(&grid->obstacle_map, last, i);
+    }
+
+    grid_viewobstacle(grid, c, -1);
+    cache_obstacle(grid, c);
+    path_obstacle(grid, c);
+
+    return 1;
+}
+
+// grid_viewobstacle - keep the view in step with an obstacle change
+//     grid: The grid.
+//     c: The cell that changed.
+//     delta: 1 if an obstacle was added, -1 if it was removed.
+void
+grid_viewobstacle(Grid *grid, Coordinate c, int delta)
+{
+    View *view = &grid->view;
+
+    // The view picks up every obstacle when it is set up, and the window
+    // modes look them up in the grid as they draw.
+    if (!view->frame || view->mode != VIEW_OVERVIEW)
+        return;
+
+    view->obstacle_counts[c.x / view->block.x * view->width +
+        c.y / view->block.y] += delta;
+}
+
+// grid_new - allocate an empty grid
+//     mapsize: The dimensions of the map.
+//
+// Creates the arena of a new grid and places the grid at its start. The
+// grid has no obstacles and no clients.
+Grid *
+grid_new(Coordinate mapsize)
+{
+    Arena arena;
+    Grid *grid;
+
+    arena_init(&arena, ARENA_RESERVE);
+    grid = arena_alloc(&arena, sizeof(Grid));
+    grid->arena = arena;
+    grid->mapsize = mapsize;
+    grid_indexobstacles(grid, 0);
+
+    return grid;
+}
+
+// grid_neighbors - the neighboring cells of a cell
+//     buf: A preallocated array of Coordinates to fill with the result.
+//     num_neighbors: An integer to hold the number of neighbors found.
+//     mapsize: The size of the map.
+//     pos: The cell to search whose neighboring cells.
+void
+grid_neighbors(Coordinate *buf, int *num_neighbors, Coordinate mapsize,
+    Coordinate pos)
+{
+    Coordinate coord;
+    int width = mapsize.x, height = mapsize.y, i = 0;
+
+    // Top cell
+    coord.x = pos.x + 1;
+    coord.y = pos.y;
+    if (coord.x < height)
+    {
+        buf[i] = coord;
+        i++;
+    }
+
+    // Left cell
+    coord.x = pos.x;
+    coord.y = pos.y - 1;
+    if (coord.y >= 0)
+    {
+        buf[i] = coord;
+        i++;
+    }
+    
+    // Bottom cell
+    coord.x = pos.x - 1;
+    coord.y = pos.y;
+    if (coord.x >= 0)
+    {
+        buf[i] = coord;
+        i++;
+    }
+    
+    // Right cell
+    coord.x = pos.x;
+    coord.y = pos.y + 1;
+    if (coord.y < width)
+    {
+        buf[i] = coord;
+        i++;
+    }
+
+    *num_neighbors = i;
+}
+
+// grid_setview - choose what grid_print() shows
+//     grid: The grid.
+//     mode: The whole map, a window of it, or a downsampled overview.
+//     width: The width of the output in characters, without the border.
+//     height: The height of the output in lines, without the border.
+//     follow: In window mode, the unit to keep in the middle of the
+//             window, or VIEW_DENSEST for the most crowded region.
+//
+// Must be called before the first grid_print(). The output is never
+// larger than the map.
+void
+grid_setview(Grid *grid, ViewMode mode, int width, int height, int follow)
+{
+    View *view = &grid->view;
+
+    view->mode = mode;
+    view->width = width;
+    view->height = height;
+    view->follow = follow;
+}
+
+// grid_viewinit - allocate the buffers of the view
+//     grid: The grid.
+//
+// Everything that does not depend on the units is done once here: the
+// obstacles are counted per block for the overview. Nothing allocated
+// is larger than the output, or than the number of units for the
+// buckets of VIEW_DENSEST, whatever the size of the map.
+void
+grid_viewinit(Grid *grid)
+{
+    View *view = &grid->view;
+    int rows = grid->mapsize.y, cols = grid->mapsize.x, i, nb;
+    Coordinate c;
+
+    if (view->mode == VIEW_FULL || view->width > cols || view->width < 1)
+        view->width = cols;
+    if (view->mode == VIEW_FULL || view->height > rows || view->height < 1)
+        view->height = rows;
+
+    if (view->mode == VIEW_OVERVIEW)
+    {
+        // Size the blocks to cover the map, then drop the columns and rows
+        // of blocks that would be left empty.
+        view->block.x = (rows + view->height - 1) / view->height;
+        view->block.y = (cols + view->width - 1) / view->width;
+        view->height = (rows + view->block.x - 1) / view->block.x;
+        view->width = (cols + view->block.y - 1) / view->block.y;
+        nb = view->width * view->height;
+        view->counts = grid_alloc(grid, nb * sizeof(int));
+        view->obstacle_counts = grid_alloc(grid, nb * sizeof(int));
+
+        for (i = 0; i < grid->num_obstacles; i++)
+        {
+            c = grid->obstacles[i];
+            view->obstacle_counts[c.x / view->block.x * view->width +
+                c.y / view->block.y]++;
+        }
+    }
+    else if (view->mode == VIEW_WINDOW && view->follow == VIEW_DENSEST)
+        cellmap_init(&view->buckets, &grid->arena, grid->num_clients);
+
+    view->frame_cap = VIEW_CAPTION +
+        (size_t) (view->width + 3) * (view->height + 2);
+    view->frame = grid_alloc(grid, view->frame_cap);
+}
+
+// grid_vieworigin - place the window over the map
+//     grid: The grid.
+//
+// Returns the top left cell of the window: centered on the followed
+// unit, or on the units of the window-sized bucket holding the most of
+// them. If the followed unit is dead, the window stays where it was.
+Coordinate
+grid_vieworigin(Grid *grid)
+{
+    View *view = &grid->view;
+    Coordinate center, pos, b, best;
+    int i, count, n = 0;
+    long sum_x = 0, sum_y = 0;
+
+    if (view->mode == VIEW_FULL)
+        return view->origin;
+
+    if (view->follow == VIEW_DENSEST)
+    {
+        // Only the buckets holding units are counted, in a table as large
+        // as the number of units.
+        cellmap_clear(&view->buckets);
+
+        for (i = 0; i < grid->num_clients; i++)
+        {
+            SKIP_DEAD(i);
+
+            pos = grid->clients[i].ui.pos;
+            b.x = pos.x / view->height;
+            b.y = pos.y / view->width;
+            count = cellmap_get(&view->buckets, b);
+            count = count < 0 ? 1 : count + 1;
+            cellmap_put(&view->buckets, b, count);
+
+            if (count > n)
+            {
+                n = count;
+                best = b;
+            }
+        }
+
+        if (n == 0)
+            return view->origin;
+
+        for (i = 0; i < grid->num_clients; i++)
+        {
+            SKIP_DEAD(i);
+
+            pos = grid->clients[i].ui.pos;
+            if (pos.x / view->height == best.x &&
+                pos.y / view->width == best.y)
+            {
+                sum_x += pos.x;
+                sum_y += pos.y;
+            }
+        }
+
+        center.x = sum_x / n;
+        center.y = sum_y / n;
+    }
+    else if (view->follow >= 0 && view->follow < grid->num_clients &&
+        server_clientalive(&grid->clients[view->follow]))
+        center = grid->clients[view->follow].ui.pos;
+    else
+        return view->origin;
+
+    view->origin.x = center.x - view->height / 2;
+    view->origin.y = center.y - view->width / 2;
+
+    if (view->origin.x > grid->mapsize.y - view->height)
+        view->origin.x = grid->mapsize.y - view->height;
+    if (view->origin.y > grid->mapsize.x - view->width)
+        view->origin.y = grid->mapsize.x - view->width;
+    if (view->origin.x < 0)
+        view->origin.x = 0;
+    if (view->origin.y < 0)
+        view->origin.y = 0;
+
+    return view->origin;
+}
+
+// grid_renderwindow - draw a window of the grid into the frame
+//     grid: The grid.
+//
+// Returns the length of the frame. The whole map is the window of
+// VIEW_FULL. Obstacles win over units, and among units on the same cell
+// the one with the lowest index wins, as they always have.
+size_t
+grid_renderwindow(Grid *grid)
+{
+    View *view = &grid->view;
+    Coordinate origin, pos;
+    Coordinate cell;
+    char *frame = view->frame, *row;
+    size_t len = 0, stride = view->width + 3;
+    int i, j;
+
+    origin = grid_vieworigin(grid);
+
+    if (view->mode != VIEW_FULL)
+        len = snprintf(frame, VIEW_CAPTION, "rows %d-%d, columns %d-%d\n",
+            origin.x, origin.x + view->height - 1,
+            origin.y, origin.y + view->width - 1);
+
+    // Borders, and blanks for the cells.
+    row = frame + len;
+    row[0] = '+';
+    memset(row + 1, '-', view->width);
+    row[view->width + 1] = '+';
+    row[view->width + 2] = '\n';
+
+    for (i = 1; i <= view->height; i++)
+    {
+        row = frame + len + i * stride;
+        row[0] = '|';
+        memset(row + 1, ' ', view->width);
+        row[view->width + 1] = '|';
+        row[view->width + 2] = '\n';
+    }
+
+    memcpy(frame + len + (view->height + 1) * stride, frame + len, stride);
+
+    for (i = grid->num_clients - 1; i >= 0; i--)
+    {
+        SKIP_DEAD(i);
+
+        pos = grid->clients[i].ui.pos;
+        pos.x -= origin.x;
+        pos.y -= origin.y;
+
+        if (pos.x < 0 || pos.x >= view->height ||
+            pos.y < 0 || pos.y >= view->width)
+            continue;
+
+        frame[len + (pos.x + 1) * stride + pos.y + 1] =
+            grid->clients[i].ui.type == CT_HUNTER ? 'H' : 'P';
+    }
+
+    // Whichever is shorter: the obstacles, or the cells of the window.
+    if (grid->num_obstacles < (long) view->width * view->height)
+    {
+        for (i = 0; i < grid->num_obstacles; i++)
+        {
+            cell.x = grid->obstacles[i].x - origin.x;
+            cell.y = grid->obstacles[i].y - origin.y;
+
+            if (cell.x >= 0 && cell.x < view->height &&
+                cell.y >= 0 && cell.y < view->width)
+                frame[len + (cell.x + 1) * stride + cell.y + 1] = 'X';
+        }
+    }
+    else
+    {
+        for (i = 0; i < view->height; i++)
+        {
+            row = frame + len + (i + 1) * stride + 1;
+            cell.x = origin.x + i;
+
+            for (j = 0; j < view->width; j++)
+            {
+                cell.y = origin.y + j;
+                if (grid_isobstacle(grid, cell))
+                    row[j] = 'X';
+            }
+        }
+    }
+
+    return len + (view->height + 2) * stride;
+}
+
+// grid_renderoverview - draw a downsampled grid into the frame
+//     grid: The grid.
+//
+// Every character stands for a block of cells and shows the number of
+// live units in it, or '#' for ten or more. Blocks without units show
+// 'X' if they are all obstacles, '.' if some of them are, and a blank
+// otherwise. Returns the length of the frame.
+size_t
+grid_renderoverview(Grid *grid)
+{
+    View *view = &grid->view;
+    Coordinate pos, block = view->block;
+    char *frame = view->frame, *row;
+    size_t len, stride = view->width + 3;
+    int i, j, b, area, units;
+
+    memset(view->counts, 0, view->width * view->height * sizeof(int));
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        pos = grid->clients[i].ui.pos;
+        view->counts[pos.x / block.x * view->width + pos.y / block.y]++;
+    }
+
+    len = snprintf(frame, VIEW_CAPTION, "overview, %dx%d cells per glyph\n",
+        block.x, block.y);
+
+    row = frame + len;
+    row[0] = '+';
+    memset(row + 1, '-', view->width);
+    row[view->width + 1] = '+';
+    row[view->width + 2] = '\n';
+    memcpy(frame + len + (view->height + 1) * stride, row, stride);
+
+    for (i = 0; i < view->height; i++)
+    {
+        row = frame + len + (i + 1) * stride;
+        row[0] = '|';
+
+        for (j = 0; j < view->width; j++)
+        {
+            b = i * view->width + j;
+            units = view->counts[b];
+
+            // Blocks on the bottom and right edges may be cut short.
+            area = ((i + 1) * block.x > grid->mapsize.y ?
+                grid->mapsize.y - i * block.x : block.x) *
+                ((j + 1) * block.y > grid->mapsize.x ?
+                grid->mapsize.x - j * block.y : block.y);
+
+            if (units >= 10)
+                row[j + 1] = '#';
+            else if (units > 0)
+                row[j + 1] = '0' + units;
+            else if (view->obstacle_counts[b] == area)
+                row[j + 1] = 'X';
+            else if (view->obstacle_counts[b] > 0)
+                row[j + 1] = '.';
+            else
+                row[j + 1] = ' ';
+        }
+
+        row[view->width + 1] = '|';
+        row[view->width + 2] = '\n';
+    }
+
+    return len + (view->height + 2) * stride;
+}
+
+// grid_print - print a grid to standard output
+//     grid: The grid to print.
+//
+// Prints a grid to the standard output. The format is specified in the
+// homework text; see grid_setview() for the other views. A frame is
+// drawn into a buffer and written at once, and costs time in proportion
+// to its size plus the number of units, whatever the size of the map.
+// If spectators are served, the frame is published to them as well.
+void
+grid_print(Grid *grid)
+{
+    size_t len;
+#ifdef DEBUG
+    int i;
+#endif
+
+    TRACE(TR_PRINT, 0);
+
+    if (!grid->view.frame)
+        grid_viewinit(grid);
+
+    if (grid->view.mode == VIEW_OVERVIEW)
+        len = grid_renderoverview(grid);
+    else
+        len = grid_renderwindow(grid);
+
+    fwrite(grid->view.frame, 1, len, stdout);
+    fflush(stdout);
+
+    if (grid->spectate)
+        spectate_publish(grid->spectate, grid->view.frame, len);
+
+#ifdef DEBUG
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        LOG("client %d of type %d at (%d, %d), energy = %d\n",
+                i,
+                grid->clients[i].ui.type,
+                grid->clients[i].ui.pos.x,
+                grid->clients[i].ui.pos.y,
+                grid->clients[i].ui.energy
+        );
+    }
+#endif
+}
+
+// spectate_slot - find the slot of a frame in a spectator ring
+//     spectate: The ring.
+//     frame: The number of the frame.
+SpectateSlot *
+spectate_slot(Spectate *spectate, uint64_t frame)
+{
+    SpectateHeader *header = spectate->header;
+
+    return (SpectateSlot *) ((char *) header + SPECTATE_HEADER +
+        frame % header->num_slots * header->slot_size);
+}
+
+// spectate_create - create the shared memory ring for spectators
+//     spectate: The ring to set up.
+//     name: The POSIX shared memory name, without the leading slash.
+//     frame_cap: The largest frame that will be published.
+//
+// Replaces a stale ring of the same name. On error, prints the reason on
+// stderr and exits with a failure code.
+void
+spectate_create(Spectate *spectate, const char *name, size_t frame_cap)
+{
+    SpectateHeader *header;
+    size_t slot_size;
+    uint32_t num_slots = SPECTATE_SLOTS;
+    int fd;
+
+    slot_size = (sizeof(SpectateSlot) + frame_cap + ARENA_ALIGN - 1) &
+        ~(size_t) (ARENA_ALIGN - 1);
+    while (num_slots > SPECTATE_MINSLOTS &&
+        num_slots * slot_size > SPECTATE_MAXSIZE)
+        num_slots /= 2;
+
+    snprintf(spectate->name, NAME_MAX, "/%s", name);
+    spectate->size = SPECTATE_HEADER + num_slots * slot_size;
+
+    shm_unlink(spectate->name);
+    fd = shm_open(spectate->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || ftruncate(fd, spectate->size) < 0)
+    {
+        perror("spectate_create");
+        exit(EXIT_FAILURE);
+    }
+
+    header = mmap(NULL, spectate->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        perror("spectate_create");
+        exit(EXIT_FAILURE);
+    }
+
+    header->slot_size = slot_size;
+    header->num_slots = num_slots;
+    header->head = 0;
+    __atomic_store_n(&header->magic, SPECTATE_MAGIC, __ATOMIC_RELEASE);
+    spectate->header = header;
+}
+
+// spectate_publish - publish a frame to the spectators
+//     spectate: The ring.
+//     frame: The rendered frame.
+//     len: The length of the frame.
+//
+// Never waits for anyone: the oldest frame in the ring is overwritten,
+// and its seq tells readers that were in the middle of it to skip it.
+void
+spectate_publish(Spectate *spectate, const char *frame, size_t len)
+{
+    SpectateHeader *header = spectate->header;
+    SpectateSlot *slot;
+    uint64_t n = header->head + 1;
+
+    slot = spectate_slot(spectate, n);
+    __atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(slot->data, frame, len);
+    slot->len = len;
+
+    __atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, n, __ATOMIC_RELEASE);
+}
+
+// spectate_close - end the broadcast
+//     spectate: The ring.
+//
+// Tells the spectators that no frames will follow and removes the name.
+// Attached spectators keep their mapping until they detach.
+void
+spectate_close(Spectate *spectate)
+{
+    __atomic_store_n(&spectate->header->done, 1, __ATOMIC_RELEASE);
+    munmap(spectate->header, spectate->size);
+    shm_unlink(spectate->name);
+}
+
+// spectate_attach - attach to the ring of a running server
+//     spectate: The ring to map.
+//     name: The name the server publishes under.
+//
+// On error, prints the reason on stderr and exits with a failure code.
+void
+spectate_attach(Spectate *spectate, const char *name)
+{
+    SpectateHeader *header;
+    struct stat st;
+    int fd;
+
+    snprintf(spectate->name, NAME_MAX, "/%s", name);
+
+    fd = shm_open(spectate->name, O_RDONLY, 0);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror("spectate_attach");
+        exit(EXIT_FAILURE);
+    }
+
+    spectate->size = st.st_size;
+    header = mmap(NULL, spectate->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        perror("spectate_attach");
+        exit(EXIT_FAILURE);
+    }
+
+    if (spectate->size < SPECTATE_HEADER ||
+        __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SPECTATE_MAGIC)
+    {
+        fprintf(stderr, "spectate_attach: %s is not a spectator ring\n",
+            name);
+        exit(EXIT_FAILURE);
+    }
+
+    spectate->header = header;
+}
+
+// spectate_read - read the next frame from the ring
+//     spectate: The ring.
+//     next: The number of the frame to read; updated past the frame read.
+//     buf: A buffer of header->slot_size bytes.
+//     len: Set to the length of the frame.
+//
+// Returns 1 if a frame was copied into buf, and 0 if there is no new one
+// yet. A reader that has fallen a whole ring behind jumps to the oldest
+// frame still in it; *next then moves by more than one.
+int
+spectate_read(Spectate *spectate, uint64_t *next, char *buf, size_t *len)
+{
+    SpectateHeader *header = spectate->header;
+    SpectateSlot *slot;
+    uint64_t head, seq;
+
+    while (1)
+    {
+        head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+        if (*next > head)
+            return 0;
+
+        if (head - *next >= header->num_slots)
+            *next = head - header->num_slots + 1;
+
+        slot = spectate_slot(spectate, *next);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == 2 * *next + 2)
+        {
+            *len = slot->len;
+            if (*len > header->slot_size - sizeof(SpectateSlot))
+                *len = 0;
+            memcpy(buf, slot->data, *len);
+
+            // The frame is good if the writer did not get to it meanwhile.
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+            {
+                (*next)++;
+                return 1;
+            }
+        }
+
+        // Overwritten under our feet: we are too slow, so move on.
+        (*next)++;
+    }
+}
+
+// arena_init - reserve the address space of an arena
+//     arena: The arena to initialize.
+//     size: The number of bytes to reserve.
+//
+// Reserves size bytes, or as much as the system will give, without
+// committing memory. The start of the arena is aligned to a huge page.
+// On error, prints the reason on stderr and exits with a failure code.
+void
+arena_init(Arena *arena, size_t size)
+{
+    char *base = MAP_FAILED;
+    size_t pad;
+
+    for (; size >= ARENA_HUGEPAGE; size /= 2)
+    {
+        base = mmap(NULL, size + ARENA_HUGEPAGE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (base != MAP_FAILED)
+            break;
+    }
+
+    if (base == MAP_FAILED)
+    {
+        perror("arena_init");
+        exit(EXIT_FAILURE);
+    }
+
+    // Trim the mapping so that it starts on a huge page boundary.
+    pad = (ARENA_HUGEPAGE - (uintptr_t) base % ARENA_HUGEPAGE) %
+        ARENA_HUGEPAGE;
+    if (pad)
+        munmap(base, pad);
+    munmap(base + pad + size, ARENA_HUGEPAGE - pad);
+
+    arena->base = base + pad;
+    arena->size = size;
+    arena->used = 0;
+    arena->last = 0;
+    arena->huge = 0;
+}
+
+// arena_alloc - allocate a block from an arena
+//     arena: The arena.
+//     size: The number of bytes.
+//
+// Returns a zeroed block aligned to ARENA_ALIGN. Blocks cannot be freed
+// individually. On exhaustion, prints the reason on stderr and exits
+// with a failure code.
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+    size_t offset;
+
+    offset = (arena->used + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (offset + size > arena->size)
+    {
+        fprintf(stderr, "arena_alloc: out of reserved space "
+            "(%zu of %zu bytes used)\n", arena->used, arena->size);
+        exit(EXIT_FAILURE);
+    }
+
+    arena->last = offset;
+    arena->used = offset + size;
+
+    if (!arena->huge && arena->used >= ARENA_HUGEPAGE)
+        arena_hugepages(arena);
+
+    return arena->base + offset;
+}
+
+// arena_grow - resize the last block of an arena in place
+//     arena: The arena.
+//     ptr: The block returned by the latest arena_alloc().
+//     size: The new size of the block.
+//
+// Returns ptr. It is an error to grow any other block than the last one.
+void *
+arena_grow(Arena *arena, void *ptr, size_t size)
+{
+    if ((char *) ptr != arena->base + arena->last)
+    {
+        fprintf(stderr, "arena_grow: not the last block\n");
+        abort();
+    }
+
+    if (arena->last + size > arena->size)
+    {
+        fprintf(stderr, "arena_grow: out of reserved space\n");
+        exit(EXIT_FAILURE);
+    }
+
+    arena->used = arena->last + size;
+
+    if (!arena->huge && arena->used >= ARENA_HUGEPAGE)
+        arena_hugepages(arena);
+
+    return ptr;
+}
+
+// arena_hugepages - back an arena with transparent huge pages
+//     arena: The arena.
+//
+// Advises the kernel to use huge pages for the whole reservation, which
+// cuts page faults and TLB misses for large maps. Called as soon as an
+// arena grows past ARENA_HUGEPAGE bytes, before most of it is touched.
+// This is only a hint, and failures are ignored.
+void
+arena_hugepages(Arena *arena)
+{
+    madvise(arena->base, arena->size, MADV_HUGEPAGE);
+    arena->huge = 1;
+}
+
+// arena_destroy - release an arena
+//     arena: The arena to release.
+//
+// Unmaps the arena, releasing every block allocated from it at once.
+void
+arena_destroy(Arena *arena)
+{
+    munmap(arena->base, arena->size);
+}
+
+// wire_putcoord - encode a coordinate in 16 bits per component
+//     buf: Room for 4 bytes.
+//     c: The coordinate; -1 is encoded as 0xffff.
+void
+wire_putcoord(char *buf, Coordinate c)
+{
+    uint16_t v[2] = { c.x, c.y };
+
+    memcpy(buf, v, sizeof(v));
+}
+
+// wire_getcoord - decode a coordinate encoded by wire_putcoord()
+//     buf: The 4 encoded bytes.
+Coordinate
+wire_getcoord(const char *buf)
+{
+    uint16_t v[2];
+    Coordinate c;
+
+    memcpy(v, buf, sizeof(v));
+    c.x = v[0] == WIRE_MAXCOMPACT ? -1 : v[0];
+    c.y = v[1] == WIRE_MAXCOMPACT ? -1 : v[1];
+
+    return c;
+}
+
+// cellmap_key - the hash table key of a cell
+//     c: The cell.
+uint64_t
+cellmap_key(Coordinate c)
+{
+    return (uint64_t) (uint32_t) c.x << 32 | (uint32_t) c.y;
+}
+
+// cellmap_init - allocate a cell hash table
+//     map: The table to initialize.
+//     arena: The arena to allocate the table from.
+//     n: The maximum number of cells that will be stored.
+//
+// The table is sized to at most half full, so that probe sequences stay
+// short. It starts out empty.
+void
+cellmap_init(CellMap *map, Arena *arena, size_t n)
+{
+    size_t capacity = 16;
+
+    while (capacity < 2 * n)
+        capacity *= 2;
+
+    map->mask = capacity - 1;
+    map->keys = arena_alloc(arena, capacity * sizeof(uint64_t));
+    map->values = arena_alloc(arena, capacity * sizeof(int));
+    cellmap_clear(map);
+}
+
+// cellmap_clear - remove every cell from a hash table
+//     map: The table to clear.
+void
+cellmap_clear(CellMap *map)
+{
+    size_t i;
+
+    memset(map->keys, 0xff, (map->mask + 1) * sizeof(uint64_t));
+
+    for (i = 0; i <= map->mask; i++)
+        map->values[i] = INT_MAX;
+}
+
+// cellmap_get - look up a cell
+//     map: The table to search.
+//     c: The cell.
+//
+// Returns the value stored for the cell, or -1 if there is none.
+int
+cellmap_get(CellMap *map, Coordinate c)
+{
+    uint64_t key = cellmap_key(c);
+    size_t i;
+
+    for (i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & map->mask;;
+         i = (i + 1) & map->mask)
+    {
+        if (map->keys[i] == key)
+            return map->values[i];
+
+        if (map->keys[i] == CELLMAP_EMPTY)
+            return -1;
+    }
+}
+
+// cellmap_claim - store a value for a cell, keeping the smallest one
+//     map: The table to insert into.
+//     c: The cell.
+//     value: A non-negative value to store.
+//
+// If the cell is already present, its value becomes the minimum of the
+// stored and the given value. This is safe to call from several threads
+// at once, and the result does not depend on the order of the calls.
+void
+cellmap_claim(CellMap *map, Coordinate c, int value)
+{
+    uint64_t cur, key = cellmap_key(c);
+    int old;
+    size_t i;
+
+    for (i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & map->mask;;
+         i = (i + 1) & map->mask)
+    {
+        cur = __atomic_load_n(&map->keys[i], __ATOMIC_ACQUIRE);
+
+        if (cur == CELLMAP_EMPTY)
+        {
+            __atomic_compare_exchange_n(&map->keys[i], &cur, key, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+            // On failure cur holds the key of whoever won the slot.
+            if (cur == CELLMAP_EMPTY)
+                cur = key;
+        }
+
+        if (cur == key)
+            break;
+    }
+
+    old = __atomic_load_n(&map->values[i], __ATOMIC_RELAXED);
+    while (value < old &&
+           !__atomic_compare_exchange_n(&map->values[i], &old, value, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// cellmap_put - store a value for a cell
+//     map: The table to insert into.
+//     c: The cell.
+//     value: The value, replacing any stored before.
+//
+// Not safe to call concurrently. The caller keeps the table at most half
+// full.
+void
+cellmap_put(CellMap *map, Coordinate c, int value)
+{
+    uint64_t key = cellmap_key(c);
+    size_t i;
+
+    for (i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & map->mask;;
+         i = (i + 1) & map->mask)
+        if (map->keys[i] == key || map->keys[i] == CELLMAP_EMPTY)
+            break;
+
+    map->keys[i] = key;
+    map->values[i] = value;
+}
+
+// cellmap_remove - remove a cell from a hash table
+//     map: The table.
+//     c: The cell, which need not be present.
+//
+// Entries after the hole are shifted back into it where their probe
+// sequence allows, so lookups never need tombstones. Not safe to call
+// concurrently.
+void
+cellmap_remove(CellMap *map, Coordinate c)
+{
+    uint64_t key = cellmap_key(c);
+    size_t i, j, home;
+
+    for (i = (key * 0x9e3779b97f4a7c15ULL) >> 32 & map->mask;;
+         i = (i + 1) & map->mask)
+    {
+        if (map->keys[i] == CELLMAP_EMPTY)
+            return;
+
+        if (map->keys[i] == key)
+            break;
+    }
+
+    for (j = (i + 1) & map->mask; map->keys[j] != CELLMAP_EMPTY;
+         j = (j + 1) & map->mask)
+    {
+        home = (map->keys[j] * 0x9e3779b97f4a7c15ULL) >> 32 & map->mask;
+
+        // The entry at j may move to i unless its home lies in (i, j].
+        if (((j - home) & map->mask) < ((j - i) & map->mask))
+            continue;
+
+        map->keys[i] = map->keys[j];
+        map->values[i] = map->values[j];
+        i = j;
+    }
+
+    map->keys[i] = CELLMAP_EMPTY;
+    map->values[i] = INT_MAX;
+}
+
+// unitmap_init - index the units of a grid by cell
+//     grid: The grid, with its clients.
+//     mode: UNITMAP_DENSE, UNITMAP_SPARSE, or UNITMAP_AUTO to choose by
+//           the size of the map and the number of units.
+//
+// A dense index answers with one array access, but takes memory for
+// every cell of the map; a sparse one takes memory for the units only,
+// which is all that huge and mostly empty maps can afford.
+void
+unitmap_init(Grid *grid, UnitMapMode mode)
+{
+    UnitMap *units = &grid->units;
+    size_t cells = (size_t) grid->mapsize.x * grid->mapsize.y;
+
+    if (mode == UNITMAP_AUTO)
+        mode = cells <= UNITMAP_DENSEMAX / sizeof(int) &&
+            cells <= (size_t) grid->num_clients * UNITMAP_DENSEFILL ?
+            UNITMAP_DENSE : UNITMAP_SPARSE;
+
+    units->mode = mode;
+    units->next = grid_alloc(grid, grid->num_clients * sizeof(int));
+
+    if (mode == UNITMAP_DENSE)
+        units->cells = grid_alloc(grid, cells * sizeof(int));
+    else
+        cellmap_init(&units->map, &grid->arena, grid->num_clients);
+
+    unitmap_build(grid);
+}
+
+// unitmap_build - (re)build the unit index from scratch
+//     grid: The grid.
+//
+// Moves and deaths keep the index up to date by themselves; this is for
+// clients that were changed behind its back.
+void
+unitmap_build(Grid *grid)
+{
+    UnitMap *units = &grid->units;
+    int i;
+
+    if (units->mode == UNITMAP_DENSE)
+        memset(units->cells, 0,
+            (size_t) grid->mapsize.x * grid->mapsize.y * sizeof(int));
+    else
+        cellmap_clear(&units->map);
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+        unitmap_add(grid, &grid->clients[i]);
+    }
+}
+
+// unitmap_first - the first unit on a cell
+//     grid: The grid.
+//     c: The cell, which must be on the map.
+//
+// Returns the lowest index of the live units on the cell, or -1 if there
+// is none. The others follow in grid->units.next.
+int
+unitmap_first(Grid *grid, Coordinate c)
+{
+    UnitMap *units = &grid->units;
+
+    if (units->mode == UNITMAP_DENSE)
+        return units->cells[(size_t) c.x * grid->mapsize.x + c.y] - 1;
+
+    return cellmap_get(&units->map, c);
+}
+
+// unitmap_setfirst - set the first unit on a cell
+//     grid: The grid.
+//     c: The cell.
+//     idx: The index of the unit, or -1 if there is none.
+void
+unitmap_setfirst(Grid *grid, Coordinate c, int idx)
+{
+    UnitMap *units = &grid->units;
+
+    if (units->mode == UNITMAP_DENSE)
+        units->cells[(size_t) c.x * grid->mapsize.x + c.y] = idx + 1;
+    else if (idx < 0)
+        cellmap_remove(&units->map, c);
+    else
+        cellmap_put(&units->map, c, idx);
+}
+
+// unitmap_add - index a unit at its position
+//     grid: The grid.
+//     client: The unit.
+//
+// Units seldom share a cell, so keeping the list in order is cheap.
+void
+unitmap_add(Grid *grid, Client *client)
+{
+    int *next = grid->units.next, i = client->idx, j;
+
+    j = unitmap_first(grid, client->ui.pos);
+
+    if (j < 0 || j > i)
+    {
+        next[i] = j;
+        unitmap_setfirst(grid, client->ui.pos, i);
+        return;
+    }
+
+    while (next[j] >= 0 && next[j] < i)
+        j = next[j];
+
+    next[i] = next[j];
+    next[j] = i;
+}
+
+// unitmap_remove - take a unit out of the index
+//     grid: The grid.
+//     client: The unit.
+//     c: The cell it was indexed at.
+void
+unitmap_remove(Grid *grid, Client *client, Coordinate c)
+{
+    int *next = grid->units.next, i = client->idx, j;
+
+    j = unitmap_first(grid, c);
+
+    if (j == i)
+    {
+        unitmap_setfirst(grid, c, next[i]);
+        return;
+    }
+
+    while (j >= 0 && next[j] != i)
+        j = next[j];
+
+    if (j >= 0)
+        next[j] = next[i];
+}
+
+// unitmap_move - reindex a unit that moved
+//     grid: The grid.
+//     client: The unit, at its new position.
+//     from: Its previous position.
+void
+unitmap_move(Grid *grid, Client *client, Coordinate from)
+{
+    unitmap_remove(grid, client, from);
+    unitmap_add(grid, client);
+}
+
+// clock_nsec - monotonic timestamp
+//
+// Returns the current value of the monotonic clock in nanoseconds. Only
+// differences between two calls are meaningful.
+uint64_t
+clock_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// hist_bucket - the histogram bucket of a value
+//     value: The value to classify.
+//
+// Values below HIST_SUB map to themselves. Larger values are bucketed by
+// their most significant bit, and then by the HIST_SUBBITS bits that
+// follow it.
+int
+hist_bucket(uint64_t value)
+{
+    int msb, idx;
+
+    if (value < HIST_SUB)
+        return (int) value;
+
+    msb = 63 - __builtin_clzll(value);
+    idx = (msb - HIST_SUBBITS + 1) * HIST_SUB +
+        (int) ((value >> (msb - HIST_SUBBITS)) & (HIST_SUB - 1));
+
+    if (idx >= HIST_BUCKETS)
+        idx = HIST_BUCKETS - 1;
+
+    return idx;
+}
+
+// hist_bucketmax - the largest value of a histogram bucket
+//     idx: The bucket index.
+//
+// Returns the inclusive upper bound of the values mapped into a bucket,
+// the inverse of hist_bucket().
+uint64_t
+hist_bucketmax(int idx)
+{
+    int msb, sub;
+
+    if (idx < HIST_SUB)
+        return (uint64_t) idx;
+
+    msb = idx / HIST_SUB - 1 + HIST_SUBBITS;
+    sub = idx % HIST_SUB;
+
+    return ((uint64_t) (HIST_SUB + sub + 1) << (msb - HIST_SUBBITS)) - 1;
+}
+
+// hist_add - record a sample in a histogram
+//     hist: The histogram.
+//     value: The sample, usually a duration in nanoseconds.
+void
+hist_add(Histogram *hist, uint64_t value)
+{
+    hist->buckets[hist_bucket(value)]++;
+    hist->count++;
+    hist->sum += value;
+
+    if (value > hist->max)
+        hist->max = value;
+}
+
+// hist_merge - accumulate a histogram into another one
+//     dst: The histogram to add to.
+//     src: The histogram to add.
+void
+hist_merge(Histogram *dst, Histogram *src)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+// hist_percentile - a percentile of the recorded samples
+//     hist: The histogram.
+//     p: The percentile as a fraction, e.g. 0.99 for p99.
+//
+// Returns the upper bound of the bucket holding the requested percentile,
+// capped at the largest recorded sample. Returns 0 for an empty histogram.
+uint64_t
+hist_percentile(Histogram *hist, double p)
+{
+    uint64_t rank, seen = 0, value;
+    int i;
+
+    if (hist->count == 0)
+        return 0;
+
+    rank = (uint64_t) (p * hist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->buckets[i];
+
+        if (seen >= rank)
+            break;
+    }
+
+    value = hist_bucketmax(i);
+
+    return value < hist->max ? value : hist->max;
+}
+
+// ipc_createpipe - create a bidirectional pipe
+//     fd: A two-element array of file descriptors to set.
+//
+// Creates a socket that acts similarly to a bidirectional pipe. Stores
+// the file descriptors in the variable fd.
+int
+ipc_createpipe(int *fd)
+{
+    return socketpair(AF_UNIX, SOCK_STREAM, PF_UNIX, fd);
+}
+
+// ipc_packintarg - pack an integer into a string argument
+//     buf: The preallocated string buffer to fill.
+//     arg: The integer to convert into a string.
+//
+// Takes an integer and returns a string containing the integer.
+// Required for executing child processes with integer arguments.
+int
+ipc_packintarg(char *buf, int arg)
+{
+    sprintf(buf, "%d", arg);
+}
+
+// ipc_closeclientend - close the client end of a bidirectional pipe
+//     fd: The file descriptor pair.
+//
+// Takes a bidirectional pipe, and (locally) closes the client end
+// of the pipe, so that other processes do not inherit it when forking.
+void
+ipc_closeclientend(int *fd)
+{
+    close(fd[1]);
+}
+
+// ipc_pincpu - pin a process to one core
+//     pid: The process, or 0 for the calling one.
+//     cpu: The core.
+void
+ipc_pincpu(pid_t pid, int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(pid, sizeof(cpu_set_t), &set) < 0)
+    {
+        perror("sched_setaffinity");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// ipc_execclient - executes the client processes
+//     type: Hunter or prey.
+//     mapsize: The size of the map.
+//     num_units: The number of units of a multiplexed process, or 0.
+//     compact: 0 for the wide encoding, WIRE_COMPACT or WIRE_DELTA.
+//     loadgen: Whether the client runs as a load generator.
+//
+// Packs the map size into string arguments and calls the correct
+// executable for the client process. A multiplexed process also gets
+// the number of units it drives, and the compact or delta encoding and
+// the load generator mode are asked for with the words "compact",
+// "delta" and "loadgen" after it.
+void
+ipc_execclient(ClientType type, Coordinate mapsize, int num_units,
+    int compact, int loadgen)
+{
+    char arg1[32], arg2[32], arg3[32];
+    char *argv[7];
+    const char *path;
+    int argc = 0;
+
+    ipc_packintarg(arg1, mapsize.x);
+    ipc_packintarg(arg2, mapsize.y);
+    ipc_packintarg(arg3, num_units);
+
+    path = type == CT_HUNTER ? "./hunter" : "./prey";
+    argv[argc++] = type == CT_HUNTER ? "hunter" : "prey";
+    argv[argc++] = arg1;
+    argv[argc++] = arg2;
+
+    if (num_units > 0 || compact || loadgen)
+        argv[argc++] = arg3;
+    if (compact)
+        argv[argc++] = compact == WIRE_DELTA ? "delta" : "compact";
+    if (loadgen)
+        argv[argc++] = "loadgen";
+    argv[argc] = NULL;
+
+    execv(path, argv);
+
+    perror("execv"); // execv returns only on error
+    _exit(EXIT_FAILURE);
+}
+
+// ipc_readfull - read exactly a number of bytes
+//     fd: The file descriptor to read from.
+//     buf: The buffer to fill.
+//     size: The number of bytes to read.
+//
+// Stream sockets may split a message over several reads; this keeps
+// reading until size bytes have arrived. Returns the number of bytes
+// read, which is less than size only at the end of the stream, or -1 on
+// error.
+ssize_t
+ipc_readfull(int fd, void *buf, size_t size)
+{
+    size_t done = 0;
+    ssize_t nbytes;
+
+    while (done < size)
+    {
+        nbytes = read(fd, (char *) buf + done, size - done);
+
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+
+        if (nbytes < 0)
+            return -1;
+
+        if (nbytes == 0)
+            break;
+
+        done += nbytes;
+    }
+
+    return done;
+}
+
+// ipc_redirstdio - redirect stdio to socket
+//     fd: The file descriptor pair.
+//
+// Redirects standard input and output to the specified socket.
+void
+ipc_redirstdio(int *fd)
+{
+    dup2(fd[1], 0);
+    dup2(fd[1], 1);
+}
+
+// ipc_setnonblock - make a file descriptor non-blocking
+//     fd: The file descriptor.
+void
+ipc_setnonblock(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// ipc_setcloexec - mark file descriptors with close-on-exec
+//     fd: The file descriptor pair.
+//
+// Marks both ends of the specified file descriptor pair with the
+// close-on-exec flag, so that they are not inherited when client
+// processes are launched.
+void
+ipc_setcloexec(int *fd)
+{
+    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+}
+
+// parallel_worker - thread entry point of the workers of parallel_for
+//     arg: The number of the worker, cast to a pointer.
+//
+// Waits for every round and runs its job in it, if it has one. A worker
+// is started just before the first round it takes part in, which is the
+// round current once it gets the lock.
+void *
+parallel_worker(void *arg)
+{
+    ParallelPool *pool = &parallel_pool;
+    ParallelJob *job;
+    int k = (intptr_t) arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1)
+    {
+        while (pool->round == seen)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        seen = pool->round;
+
+        if (k + 1 >= pool->num_jobs)
+            continue;
+
+        job = &pool->jobs[k + 1];
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->ctx, job->begin, job->end);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+    }
+
+    return NULL;
+}
+
+// parallel_for - run a loop on several threads
+//     n: The number of iterations.
+//     num_threads: The maximum number of threads to use.
+//     fn: Called with ctx and a [begin, end) range of iterations.
+//     ctx: Passed to fn.
+//
+// Splits [0, n) into contiguous ranges, one per thread, and returns when
+// all of them are done. The calling thread runs the first range itself,
+// and the workers of the pool the others; workers are only started the
+// first time they are needed. If one cannot be started, the calling
+// thread runs its range as well. Small loops run on the calling thread
+// only. Only one thread may be in parallel_for() at a time.
+void
+parallel_for(int n, int num_threads, ParallelFn fn, void *ctx)
+{
+    ParallelPool *pool = &parallel_pool;
+    ParallelJob *job;
+    pthread_t thread;
+    int i, chunk, num_jobs;
+
+    if (num_threads > n / PARALLEL_MINCHUNK)
+        num_threads = n / PARALLEL_MINCHUNK;
+    if (num_threads > PARALLEL_MAXTHREADS)
+        num_threads = PARALLEL_MAXTHREADS;
+
+    if (num_threads <= 1)
+    {
+        fn(ctx, 0, n);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->num_workers < num_threads - 1)
+    {
+        if (pthread_create(&thread, NULL, parallel_worker,
+            (void *) (intptr_t) pool->num_workers))
+            break;
+
+        pthread_detach(thread);
+        pool->num_workers++;
+    }
+
+    chunk = (n + num_threads - 1) / num_threads;
+
+    for (i = 0; i < num_threads; i++)
+    {
+        job = &pool->jobs[i];
+        job->fn = fn;
+        job->ctx = ctx;
+        job->begin = i * chunk;
+        job->end = (i + 1) * chunk < n ? (i + 1) * chunk : n;
+    }
+
+    num_jobs = num_threads < pool->num_workers + 1 ?
+        num_threads : pool->num_workers + 1;
+    pool->num_jobs = num_jobs;
+    pool->pending = num_jobs - 1;
+    pool->round++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    // The ranges of the workers that could not be started, then ours.
+    for (i = num_jobs; i < num_threads; i++)
+        fn(ctx, pool->jobs[i].begin, pool->jobs[i].end);
+    fn(ctx, pool->jobs[0].begin, pool->jobs[0].end);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// uring_init - set up an io_uring instance
+//     ring: The ring to set up.
+//     sq_entries: The size of the submission queue.
+//     cq_entries: The size of the completion queue.
+//
+// The rings are driven directly through the system calls, so nothing
+// beyond the kernel headers is needed. Returns 0 on success and -1 if
+// the kernel lacks io_uring or the features the server relies on, in
+// which case the caller should fall back to poll().
+int
+uring_init(Uring *ring, unsigned sq_entries, unsigned cq_entries)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(Uring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cq_entries;
+
+    ring->fd = syscall(__NR_io_uring_setup, sq_entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    // Sends and receives on sockets need 5.7's internal polling to not
+    // be punted to worker threads, and we never want to lose completions.
+    if (!(params.features & IORING_FEAT_FAST_POLL) ||
+        !(params.features & IORING_FEAT_NODROP))
+    {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    sq = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+        {
+            munmap(sq, ring->sq_ring_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (cq != sq)
+            munmap(cq, ring->cq_ring_size);
+        munmap(sq, ring->sq_ring_size);
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_ring = sq;
+    ring->cq_ring = cq;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->sq_entries = params.sq_entries;
+
+    return 0;
+}
+
+// uring_getsqe - get a cleared submission queue entry
+//     ring: The ring.
+//
+// Entries are only handed to the kernel by uring_submit(), so that the
+// replies and receives of a whole wakeup go out in one system call. If
+// the queue is full, it is submitted early.
+struct io_uring_sqe *
+uring_getsqe(Uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail, idx;
+
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) ==
+        ring->sq_entries)
+    {
+        uring_submit(ring);
+        tail = *ring->sq_tail;
+    }
+
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+// uring_submit - hand the queued entries to the kernel
+//     ring: The ring.
+void
+uring_submit(Uring *ring)
+{
+    int ret;
+
+    while (ring->to_submit > 0)
+    {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 0, 0,
+            NULL, 0);
+
+        if (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY))
+            continue;
+
+        if (ret < 0)
+        {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        ring->to_submit -= ret;
+    }
+}
+
+// uring_wait - submit the queued entries and wait for a completion
+//     ring: The ring.
+//     timeout_ns: How long to wait at most.
+//
+// The wait is bounded by a timeout entry that completes with the first
+// other completion or after timeout_ns, whichever comes first; its own
+// completion has user_data URING_TIMEOUT. A signal ends the wait early.
+void
+uring_wait(Uring *ring, uint64_t timeout_ns)
+{
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+    int ret;
+
+    ts.tv_sec = timeout_ns / 1000000000ULL;
+    ts.tv_nsec = timeout_ns % 1000000000ULL;
+
+    sqe = uring_getsqe(ring);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t) (uintptr_t) &ts;
+    sqe->len = 1;
+    sqe->off = 1;
+    sqe->user_data = URING_TIMEOUT;
+
+    for (;;)
+    {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (ret < 0 && (errno == EAGAIN || errno == EBUSY))
+            continue;
+
+        if (ret < 0 && errno == EINTR)
+            return;
+
+        if (ret < 0)
+        {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        ring->to_submit -= ret;
+        return;
+    }
+}
+
+// uring_destroy - tear down an io_uring instance
+//     ring: The ring.
+void
+uring_destroy(Uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// reader_init - set up a buffered reader
+//     reader: The reader to initialize.
+//     fd: The file descriptor to read from.
+//     name: The name of the input in error messages.
+void
+reader_init(Reader *reader, int fd, const char *name)
+{
+    memset(reader, 0, sizeof(Reader));
+
+    reader->fd = fd;
+    reader->name = name;
+    reader->buf = calloc(READER_BUFSIZE + sizeof(uint64_t), 1);
+    reader->line = 1;
+}
+
+// reader_destroy - release the buffer of a reader
+//     reader: The reader.
+void
+reader_destroy(Reader *reader)
+{
+    free(reader->buf);
+}
+
+// reader_error - report malformed input
+//     reader: The reader.
+//     fmt: A printf format string describing the problem.
+//
+// Prints the problem along with the line and column of the last token
+// read on stderr, and exits with a failure code. Tokens never contain
+// newlines, so the current line is the line of the token.
+void
+reader_error(Reader *reader, const char *fmt, ...)
+{
+    va_list args;
+
+    fprintf(stderr, "%s:%llu:%llu: ", reader->name,
+        (unsigned long long) reader->line,
+        (unsigned long long) (reader->tok - reader->line_start + 1));
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    fputc('\n', stderr);
+    exit(EXIT_FAILURE);
+}
+
+// reader_fill - top up the buffer of a reader
+//     reader: The reader.
+//
+// Moves the unread bytes to the front of the buffer and reads until at
+// least READER_LOOKAHEAD bytes are available or the input ends. Returns
+// the number of bytes available. On a read error, prints the reason on
+// stderr and exits with a failure code.
+int
+reader_fill(Reader *reader)
+{
+    ssize_t nbytes;
+
+    if (reader->pos > 0)
+    {
+        memmove(reader->buf, reader->buf + reader->pos,
+            reader->len - reader->pos);
+        reader->offset += reader->pos;
+        reader->len -= reader->pos;
+        reader->pos = 0;
+    }
+
+    while (!reader->eof && reader->len < READER_LOOKAHEAD)
+    {
+        nbytes = read(reader->fd, reader->buf + reader->len,
+            READER_BUFSIZE - reader->len);
+
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+
+        if (nbytes < 0)
+        {
+            perror("reader_fill");
+            exit(EXIT_FAILURE);
+        }
+
+        if (nbytes == 0)
+            reader->eof = 1;
+
+        reader->len += nbytes;
+    }
+
+    // Keep a word of zeros after the data for reader_digits().
+    memset(reader->buf + reader->len, 0, sizeof(uint64_t));
+
+    return (int) reader->len;
+}
+
+// reader_skipspace - skip whitespace
+//     reader: The reader.
+//
+// Advances to the next non-whitespace byte, counting lines on the way,
+// and makes sure a whole token is buffered. Records the position of the
+// token for error messages. Returns false at the end of the input.
+int
+reader_skipspace(Reader *reader)
+{
+    const char *p, *end;
+
+    if (reader->len - reader->pos < READER_LOOKAHEAD)
+        reader_fill(reader);
+
+    p = reader->buf + reader->pos;
+    end = reader->buf + reader->len;
+
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' ||
+           *p == '\r'))
+    {
+        if (*p == '\n')
+        {
+            reader->line++;
+            reader->line_start = reader->offset + (p - reader->buf) + 1;
+        }
+
+        p++;
+
+        if (end - p < READER_LOOKAHEAD && !reader->eof)
+        {
+            reader->pos = p - reader->buf;
+            reader_fill(reader);
+            p = reader->buf + reader->pos;
+            end = reader->buf + reader->len;
+        }
+    }
+
+    reader->pos = p - reader->buf;
+    reader->tok = reader->offset + reader->pos;
+
+    return p < end;
+}
+
+// reader_digits - parse up to eight leading digits at once
+//     p: The input; eight bytes must be readable.
+//     num_digits: Set to the number of leading decimal digits, at most 8.
+//
+// Returns the value of the leading digits. The bytes are processed as
+// one 64-bit word: a byte is a digit if its high nibble is 3 and adding
+// 6 to it keeps it that way. The digits are then shifted to the top of
+// the word and combined pairwise, in three multiplications.
+uint64_t
+reader_digits(const char *p, int *num_digits)
+{
+    uint64_t chunk, mask, v;
+    int n;
+
+    memcpy(&chunk, p, sizeof(chunk));
+
+    mask = ((chunk & 0xf0f0f0f0f0f0f0f0ULL) |
+        (((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4)) ^
+        0x3333333333333333ULL;
+
+    n = mask ? __builtin_ctzll(mask) / 8 : 8;
+    *num_digits = n;
+
+    if (n == 0)
+        return 0;
+
+    v = (chunk & 0x0f0f0f0f0f0f0f0fULL) << (8 * (8 - n));
+    v = (v * 10 + (v >> 8)) & 0x00ff00ff00ff00ffULL;
+    v = (v * 100 + (v >> 16)) & 0x0000ffff0000ffffULL;
+    v = (v * 10000 + (v >> 32)) & 0x00000000ffffffffULL;
+
+    return v;
+}
+
+// reader_int - parse a decimal integer
+//     reader: The reader.
+//     what: What the integer stands for, for error messages.
+//
+// Returns the next integer of the input. Exits with an error message if
+// the input ends, the next token is not an integer, or it does not fit
+// into an int.
+//
+// This is the hot path of the parser. The common case of a token that
+// is already buffered and preceded by a single separator is handled
+// without calling reader_skipspace().
+int
+reader_int(Reader *reader, const char *what)
+{
+    const char *p, *end;
+    uint64_t value;
+    int negative, total;
+
+    p = reader->buf + reader->pos;
+    end = reader->buf + reader->len;
+
+    if (end - p > READER_LOOKAHEAD && (*p == ' ' || *p == '\n') &&
+        (unsigned) (p[1] - '0') < 10)
+    {
+        if (*p == '\n')
+        {
+            reader->line++;
+            reader->line_start = reader->offset + (p - reader->buf) + 1;
+        }
+
+        p++;
+        reader->tok = reader->offset + (p - reader->buf);
+    }
+    else
+    {
+        if (!reader_skipspace(reader))
+            reader_error(reader, "unexpected end of input, expected %s",
+                what);
+
+        p = reader->buf + reader->pos;
+        end = reader->buf + reader->len;
+    }
+
+    negative = *p == '-';
+    p += negative;
+
+    // The lookahead guarantees that a valid integer is buffered, and the
+    // buffer is padded with zeros for the word read past the end of the
+    // input. Longer numbers continue digit by digit; eleven digits are
+    // enough to detect an overflow.
+    value = reader_digits(p, &total);
+
+    while (total >= 8 && total < 11)
+    {
+        if (p + total >= end || (unsigned) (p[total] - '0') >= 10)
+            break;
+
+        value = value * 10 + (p[total] - '0');
+        total++;
+    }
+
+    if (total == 0)
+        reader_error(reader, "expected %s, found '%c'", what,
+            p[-negative]);
+
+    if (total > 10 || value > (uint64_t) INT_MAX + negative)
+        reader_error(reader, "%s is out of range", what);
+
+    p += total;
+
+    if (p < end && *p != ' ' && *p != '\n' && *p != '\t' && *p != '\r')
+        reader_error(reader, "expected %s, found '%c'", what, *p);
+
+    reader->pos = p - reader->buf;
+
+    return negative ? (int) -(int64_t) value : (int) value;
+}
+
+// reader_end - check that the input is exhausted
+//     reader: The reader.
+//
+// Exits with an error message if anything but whitespace is left.
+void
+reader_end(Reader *reader)
+{
+    if (reader_skipspace(reader))
+        reader_error(reader, "unexpected trailing input");
+}
+
+#ifdef PHTRACE
+// trace_init - start recording trace events
+//     path: The file to write the trace to on exit.
+void
+trace_init(const char *path)
+{
+    trace.events = malloc(TRACE_EVENTS * sizeof(TraceEvent));
+    if (!trace.events)
+    {
+        perror("trace_init");
+        exit(EXIT_FAILURE);
+    }
+
+    // Touch the ring now, so that page faults do not land in the trace.
+    memset(trace.events, 0, TRACE_EVENTS * sizeof(TraceEvent));
+    trace.path = path;
+    trace.count = 0;
+    trace.ns_start = clock_nsec();
+    trace.tsc_start = TRACE_CLOCK();
+}
+
+// trace_event - record a trace event
+//     kind: What happened.
+//     arg: The process or unit it happened to, see TraceKind.
+//
+// Costs a timestamp counter read and a 16-byte store. The oldest events
+// are overwritten once the ring is full.
+static inline void
+trace_event(TraceKind kind, int arg)
+{
+    TraceEvent *event;
+
+    if (!trace.events)
+        return;
+
+    event = &trace.events[trace.count++ & (TRACE_EVENTS - 1)];
+    event->ts = TRACE_CLOCK();
+    event->arg = arg;
+    event->kind = kind;
+}
+
+// trace_write - write the recorded events as a Chrome trace
+//
+// The JSON trace event format loads into chrome://tracing and Perfetto.
+// The server loop, the client processes and the units show up as three
+// processes, with a thread per client process and per unit. Timestamps
+// are converted to microseconds with the rate the timestamp counter kept
+// against CLOCK_MONOTONIC over the recording.
+void
+trace_write(void)
+{
+    static const char *names[TR_NUMKINDS] = {
+        "poll", "recv", "process", "send", "flush", "kill", "print", "tick"
+    };
+    static const int pids[TR_NUMKINDS] = { 1, 2, 3, 3, 2, 3, 1, 1 };
+    TraceEvent *event;
+    uint64_t first, i;
+    double scale;
+    FILE *file;
+
+    if (!trace.events)
+        return;
+
+    file = fopen(trace.path, "w");
+    if (!file)
+    {
+        perror("trace_write");
+        exit(EXIT_FAILURE);
+    }
+
+    scale = (clock_nsec() - trace.ns_start) /
+        (double) (TRACE_CLOCK() - trace.tsc_start);
+    first = trace.count > TRACE_EVENTS ? trace.count - TRACE_EVENTS : 0;
+
+    fprintf(file, "{\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+        "\"args\":{\"name\":\"server\"}},\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,"
+        "\"args\":{\"name\":\"client processes\"}},\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":3,"
+        "\"args\":{\"name\":\"units\"}}");
+
+    for (i = first; i < trace.count; i++)
+    {
+        event = &trace.events[i & (TRACE_EVENTS - 1)];
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\","
+            "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+            names[event->kind],
+            (event->ts - trace.tsc_start) * scale / 1000.0,
+            pids[event->kind], pids[event->kind] == 1 ? 0 : event->arg);
+    }
+
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    fprintf(stderr, "wrote %llu trace events to %s\n",
+        (unsigned long long) (trace.count - first), trace.path);
+    free(trace.events);
+    trace.events = NULL;
+}
+#endif
+
+// server_main - the main loop of the server process
+//     config: Options selected on the command line.
+//
+// This function is responsible for initializing the grid, the clients,
+// forking the clients, and setting up the file descriptors. After all
+// these tasks have been completed, it will send initial messages to
+// all client messages and enter an event loop. Inside this event loop,
+// it will read requests from ready clients and serve their requests,
+// signaling other processes as required. The loop continues until
+// one type of adversaries have been defeated.
+//
+// Every client process drives config->units_per_proc units (of the same
+// type), so the polling table has one entry per process rather than per
+// unit. The order in which ready processes are served on each wakeup is
+// decided by server_schedule(), see the description of SchedPolicy
+// there. In tick mode, moves are resolved in batches by server_tick()
+// instead.
+//
+// No client can stall the loop: the sockets are non-blocking, replies
+// that cannot be written yet wait in capped per-process send queues,
+// and with a deadline configured, server_watchdog() deals with processes
+// that take too long to answer.
+//
+// With config->io set to IO_URING, poll(), read() and write() give way to
+// an io_uring: a receive stays armed on every socket, and the replies
+// and re-armed receives of a wakeup are submitted in one system call.
+//
+// With config->num_loads set, the game is a load sweep instead: the units
+// are driven by load generators, and the loop ends after the last step
+// of server_loadstep().
+void
+server_main(ServerConfig *config)
+{
+    Grid *grid;
+    int i, k, num_ready;
+    Server server;
+    ServerMsg msgout;
+    struct pollfd *fds;
+    uint64_t now;
+
+    memset(&server, 0, sizeof(Server));
+    server.config = config;
+
+#ifdef PHTRACE
+    if (config->trace_path)
+        trace_init(config->trace_path);
+#else
+    if (config->trace_path)
+        fprintf(stderr, "tracing is compiled out, rebuild with make trace\n");
+#endif
+
+    // Parse and print the grid.
+    server.start_ns = clock_nsec();
+    grid = grid_fromfmt();
+
+    if (config->parse_only)
+        fprintf(stderr, "parsed %d obstacles and %d units in %.3f s\n",
+            grid->num_obstacles, grid->num_clients,
+            (clock_nsec() - server.start_ns) / 1e9);
+
+    if (config->pathfind)
+        path_init(grid, config->path_budget_ms * 1000000ULL,
+            config->path_latency_us * 1000ULL, config->threads);
+
+    if (config->parse_only)
+    {
+        path_report(grid);
+        grid_destroy(grid);
+        exit(EXIT_SUCCESS);
+    }
+
+    unitmap_init(grid, config->occupancy);
+
+    grid_setview(grid, config->view, config->view_width,
+        config->view_height, config->follow);
+
+    if (config->publish)
+    {
+        grid_viewinit(grid);
+        spectate_create(&server.spectate, config->publish,
+            grid->view.frame_cap);
+        grid->spectate = &server.spectate;
+    }
+
+    grid_print(grid);
+    server.grid = grid;
+
+    // Coordinates up to WIRE_MAXCOMPACT - 1 fit the compact encoding.
+    grid->compact = grid->mapsize.x <= WIRE_MAXCOMPACT &&
+        grid->mapsize.y <= WIRE_MAXCOMPACT ? WIRE_COMPACT : 0;
+
+    if ((config->encoding == ENC_COMPACT || config->encoding == ENC_DELTA) &&
+        !grid->compact)
+    {
+        fprintf(stderr, "the map is too large for the compact encoding\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (config->encoding == ENC_WIDE)
+        grid->compact = 0;
+
+    // The delta encoding remembers the last message sent to every unit.
+    if (config->encoding == ENC_DELTA)
+    {
+        grid->compact = WIRE_DELTA;
+        grid->sent = grid_alloc(grid, grid->num_clients * sizeof(ServerMsg));
+    }
+
+    grid->loadgen = config->loadgen;
+    if (config->num_loads > 0)
+        server_loadinit(&server);
+
+    // Group the units into processes and fork them.
+    server_spawnprocs(&server);
+
+    if (config->reply_cache)
+        cache_init(grid);
+
+    // Allocate the file descriptor table for polling, and the scheduling
+    // state of the processes. They live in the arena of the grid.
+    fds = grid_alloc(grid, grid->num_procs * sizeof(struct pollfd));
+    server.fds = fds;
+    server.ready = grid_alloc(grid, grid->num_procs * sizeof(int));
+    server.ready_ns = grid_alloc(grid, grid->num_procs * sizeof(uint64_t));
+    server.msgin = grid_alloc(grid,
+        grid->units_per_proc * sizeof(MuxClientMsg));
+
+    // Latency histograms are large, so only pay for them when asked to.
+    if (config->stats)
+        server.latency = grid_alloc(grid,
+            grid->num_clients * sizeof(Histogram));
+
+    if (config->tick)
+        tick_init(&server.tick, grid);
+
+    server.control_fd = -1;
+    if (config->control)
+        server_controlinit(&server);
+
+    // Prepare and send the initial messages for the client processes.
+    server.rng = config->seed;
+    now = clock_nsec();
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        msgout = servermsg_new(grid, &grid->clients[i]);
+        msgout.delay_us = server_pace(&server, &grid->clients[i], &msgout,
+            now);
+        servermsg_send(grid, &grid->clients[i], msgout);
+    }
+
+    for (i = 0; i < grid->num_procs; i++)
+    {
+        // Save the file descriptors into the table data structure.
+        // We are interested in the POLLIN event of each file descriptor,
+        // and in POLLOUT while a reply is stuck in the send queue.
+        fds[i].fd = grid->procs[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    if (config->io == IO_URING)
+        server_uringinit(&server);
+
+    for (i = 0; i < grid->num_procs; i++)
+    {
+        server_flushproc(&server, i);
+
+        if (config->io == IO_URING)
+            server_uringrecv(&server, i);
+    }
+
+    server.start_ns = clock_nsec();
+    server.load_start = server.start_ns;
+    server.wait.window = WAIT_SPINSTART;
+
+    // This is the main loop of the server. A load sweep ends it once its
+    // last step is over.
+    while (!server_isstable(grid) && !server.load_done)
+    {
+        num_ready = server_wait(&server);
+
+        now = clock_nsec();
+        // The loop spins, so only wakeups with work are worth a record.
+        if (num_ready > 0)
+            TRACE(TR_POLL, num_ready);
+
+        if (config->deadline_ms > 0 && now >= server.next_watchdog)
+            server_watchdog(&server, now);
+
+        server_obstacles(&server, now);
+
+        if (config->num_loads > 0)
+            server_loadstep(&server, now);
+
+        // In tick mode requests are only collected here; they are all
+        // answered together once every live client has moved.
+        if (config->tick)
+        {
+            server_collectmoves(&server, now);
+
+            if (server.tick.num_submitted == server.tick.num_alive)
+                server_tick(&server);
+
+            continue;
+        }
+
+        num_ready = server_collectready(&server, now);
+        server_schedule(&server, &num_ready);
+
+        for (k = 0; k < num_ready; k++)
+            server_serveproc(&server, server.ready[k]);
+    }
+
+    if (config->stats)
+        server_report(&server);
+
+    if (config->num_loads > 0)
+        server_loadreport(&server);
+
+    // Take no prisoners -- kill all the remaining processes.
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        server_killclient(grid, fds, &grid->clients[i]);
+        LOG("[death] %d survived until the end\n", i);
+    }
+
+    if (config->io == IO_URING)
+        uring_destroy(&server.uring);
+
+#ifdef PHTRACE
+    trace_write();
+#endif
+
+    if (config->publish)
+        spectate_close(&server.spectate);
+
+    if (server.control_fd >= 0)
+        close(server.control_fd);
+
+    grid_destroy(grid);
+
+    LOG("[server] exiting gracefully\n");
+    exit(EXIT_SUCCESS);
+}
+
+// server_wait - wait for the next wakeup of the main loop
+//     server: The server state.
+//
+// Spins on polls that return at once, blocks, or spins for the adaptive
+// window after the last piece of work and blocks from then on, as
+// configured. The window grows when a blocking wait ends soon enough
+// that a longer window would have caught the wakeup, and shrinks when
+// one lasts longer than the largest window, as spinning was wasted.
+// Records how long the loop was idle before every wakeup with work,
+// apart for wakeups found spinning and after blocking. Returns like
+// poll().
+int
+server_wait(Server *server)
+{
+    ServerConfig *config = server->config;
+    WaitState *wait = &server->wait;
+    uint64_t now, blocked;
+    int num_ready;
+
+    num_ready = server_poll(server, 0);
+    wait->polls++;
+    now = clock_nsec();
+
+    if (num_ready > 0)
+    {
+        if (wait->idle_since)
+            hist_add(&wait->spun, now - wait->idle_since);
+        wait->idle_since = 0;
+        return num_ready;
+    }
+
+    if (!wait->idle_since)
+        wait->idle_since = now;
+
+    if (config->wait == WAIT_SPIN || (config->wait == WAIT_ADAPTIVE &&
+        now - wait->idle_since < wait->window))
+        return num_ready;
+
+    wait->window_sum += wait->window;
+    wait->blocks++;
+
+    num_ready = server_poll(server, WAIT_MAXBLOCK);
+    blocked = clock_nsec() - now;
+
+    if (config->wait == WAIT_ADAPTIVE)
+    {
+        if (num_ready > 0 && blocked < config->spin_max)
+            wait->window = wait->window ? wait->window * 2 : WAIT_SPINSTART;
+        else if (blocked >= config->spin_max)
+            wait->window /= 2;
+
+        if (wait->window > config->spin_max)
+            wait->window = config->spin_max;
+        else if (wait->window < WAIT_SPINSTART)
+            wait->window = 0;
+
+        if (wait->window > wait->window_max)
+            wait->window_max = wait->window;
+    }
+
+    if (num_ready <= 0)
+        return num_ready;
+
+    hist_add(&wait->blocked, clock_nsec() - wait->idle_since);
+    wait->idle_since = 0;
+
+    return num_ready;
+}
+
+// server_poll - check the processes for requests
+//     server: The server state.
+//     timeout_ns: How long to block at most, 0 to return at once.
+//
+// Runs one poll(), or one pass over the completions of the io_uring
+// backend. Sockets that can take more of a stuck send queue are drained
+// on the way. Returns the number of processes flagged in server->fds,
+// like poll(), and 0 if a signal came first.
+int
+server_poll(Server *server, uint64_t timeout_ns)
+{
+    Grid *grid = server->grid;
+    struct pollfd *fds = server->fds;
+    struct timespec ts;
+    int num_ready, i;
+
+    if (server->config->io == IO_URING)
+        return server_uringwait(server, timeout_ns);
+
+    if (timeout_ns == 0)
+        num_ready = poll(fds, grid->num_procs, POLL_NOTIMEOUT);
+    else
+    {
+        ts.tv_sec = timeout_ns / 1000000000ULL;
+        ts.tv_nsec = timeout_ns % 1000000000ULL;
+        num_ready = ppoll(fds, grid->num_procs, &ts, NULL);
+    }
+
+    if (num_ready < 0)
+    {
+        for (i = 0; i < grid->num_procs; i++)
+            fds[i].revents = 0;
+        return 0;
+    }
+
+    for (i = 0; i < grid->num_procs; i++)
+        if (fds[i].fd >= 0 && fds[i].revents & POLLOUT)
+            server_drainproc(server, i);
+
+    return num_ready;
+}
+
+// server_collectready - gather the processes with pending requests
+//     server: The server state.
+//     now: The time poll() returned.
+//
+// Fills server->ready with the indices of the processes whose requests
+// can be read, and returns their count. A request seen for the first
+// time is stamped with now, so that requests left over by an exhausted
+// budget keep their original arrival time on the next wakeup.
+//
+// With the round-robin policy the scan starts at server->rr_next instead
+// of index 0, so the list is already in service order.
+int
+server_collectready(Server *server, uint64_t now)
+{
+    Grid *grid = server->grid;
+    struct pollfd *fds = server->fds;
+    int i, k, n = grid->num_procs, num_ready = 0;
+
+    for (k = 0; k < n; k++)
+    {
+        i = k;
+        if (server->config->sched == SCHED_ROUNDROBIN)
+            i = (server->rr_next + k) % n;
+
+        if (fds[i].fd < 0)
+            continue;
+
+        if (CLIENT_RDY(i))
+        {
+            if (!server->ready_ns[i])
+                server->ready_ns[i] = now;
+
+            server->ready[num_ready] = i;
+            num_ready++;
+        }
+    }
+
+    return num_ready;
+}
+
+// server_cmpready - qsort comparator for the oldest-first policy
+//
+// All requests found on one wakeup carry the same stamp, so ties are
+// broken in round-robin order from server->rr_next; by index they would
+// always favor the low indices.
+int
+server_cmpready(const void *a, const void *b, void *arg)
+{
+    Server *server = arg;
+    uint64_t *ready_ns = server->ready_ns;
+    int i = *(const int *) a, j = *(const int *) b;
+    int n = server->grid->num_procs;
+
+    if (ready_ns[i] != ready_ns[j])
+        return ready_ns[i] < ready_ns[j] ? -1 : 1;
+
+    return (i - server->rr_next + n) % n - (j - server->rr_next + n) % n;
+}
+
+// server_schedule - order the ready processes for service
+//     server: The server state.
+//     num_ready: The number of ready processes, updated to the number of
+//                processes that will be served on this wakeup.
+//
+// The policies are:
+//
+//     SCHED_LINEAR      index order, starting at 0 on every wakeup; low
+//                       indices always go first (the original behavior)
+//     SCHED_ROUNDROBIN  index order, starting after the last client
+//                       served on the previous wakeup
+//     SCHED_OLDEST      the request that has waited longest goes first;
+//                       requests of the same age in round-robin order
+//
+// If a per-wakeup budget is configured, only the first budget processes
+// are served; the others stay pending and are picked up again after the
+// next poll().
+void
+server_schedule(Server *server, int *num_ready)
+{
+    ServerConfig *config = server->config;
+
+    if (config->sched == SCHED_OLDEST)
+        qsort_r(server->ready, *num_ready, sizeof(int), server_cmpready,
+            server);
+
+    if (config->budget > 0 && *num_ready > config->budget)
+        *num_ready = config->budget;
+
+    if (config->sched != SCHED_LINEAR && *num_ready > 0)
+        server->rr_next = (server->ready[*num_ready - 1] + 1) %
+            server->grid->num_procs;
+}
+
+// server_serveproc - read, process and answer the requests of a process
+//     server: The server state.
+//     p: The index of the ready process.
+//
+// Reads one frame from the process and processes its moves in order.
+// The replies are collected into a single frame, which is written once
+// all moves have been processed. The latency of a request is measured
+// from the wakeup it was first seen on until its reply has been written.
+void
+server_serveproc(Server *server, int p)
+{
+    Client *client;
+    Grid *grid = server->grid;
+    MuxClientMsg *msgin = server->msgin;
+    Proc *proc = &grid->procs[p];
+    int i, count, grid_updated = 0;
+    MoveResult result;
+    ServerMsg msgout;
+    uint64_t now;
+
+    // A process may have been killed by an earlier request on this wakeup.
+    if (server->fds[p].fd < 0)
+        return;
+
+    count = server_recvproc(server, p);
+    now = clock_nsec();
+
+    for (i = 0; i < count; i++)
+    {
+        client = &grid->clients[proc->units[msgin[i].slot]];
+
+        // The unit may have been killed while its request was in flight.
+        if (!server_clientalive(client))
+            continue;
+
+        result = server_processmsg(&grid_updated, server->fds, grid,
+            client, msgin[i].msg);
+        server->num_moves++;
+        server->counters.results[result]++;
+
+        // We check that the process is still alive before
+        // dispatching a response, because server_processmsg
+        // may have killed it in some scenarios.
+        if (server_clientalive(client))
+        {
+            msgout = servermsg_new(grid, client);
+            msgout.result = result;
+
+            if (result == MOVE_DENIED_ALLY || result == MOVE_DENIED_ADV ||
+                result == MOVE_DENIED_OBSTACLE)
+                server_redirect(server, client, &msgout, &grid_updated);
+        }
+
+        if (server_clientalive(client))
+        {
+            msgout.delay_us = server_pace(server, client, &msgout, now);
+            servermsg_send(grid, client, msgout);
+        }
+
+        // Update the grid if necessary.
+        if (grid_updated)
+        {
+            grid_print(grid);
+            grid_updated = 0;
+        }
+    }
+
+    server_flushproc(server, p);
+
+    if (count == 0)
+        return;
+
+    now = clock_nsec();
+
+    if (server->latency)
+        for (i = 0; i < count; i++)
+            hist_add(&server->latency[proc->units[msgin[i].slot]],
+                now - server->ready_ns[p]);
+
+    if (server->config->num_loads > 0)
+        for (i = 0; i < count; i++)
+            hist_add(&server->load_latency, now - server->ready_ns[p]);
+
+    server->ready_ns[p] = 0;
+}
+
+// server_recvproc - read the requests of a ready process
+//     server: The server state.
+//     p: The index of the process.
+//
+// Reads into server->msgin and returns the number of requests, or 0 if
+// no whole frame has arrived yet. A process that has gone away or sent
+// garbage is evicted. A complete frame disarms the deadline of the
+// process. On the io_uring backend the frame is already in proc->in.
+int
+server_recvproc(Server *server, int p)
+{
+    Grid *grid = server->grid;
+    Proc *proc = &grid->procs[p];
+    int count, complete;
+
+    complete = proc->in_len > 0 &&
+        proc->in_len == clientmsg_need(proc, grid);
+
+    count = clientmsg_recv(proc, grid, server->msgin);
+
+    if (count < 0)
+    {
+        server->counters.disconnects++;
+        server_evictproc(server, p, "disconnected");
+        return 0;
+    }
+
+    if (count > 0)
+    {
+        proc->deadline_ns = 0;
+        TRACE(TR_RECV, p);
+    }
+
+    // The io_uring backend receives the next frame once this one is out
+    // of the way.
+    if (server->config->io == IO_URING && complete)
+        server_uringrecv(server, p);
+
+    return count;
+}
+
+// server_flushproc - send the reply frame of a process
+//     server: The server state.
+//     p: The index of the process.
+//
+// Moves whatever servermsg_send() has queued for the process into its
+// send queue and writes as much of the queue as the socket takes. A
+// process whose queue would exceed its cap is evicted. Sending a reply
+// arms the deadline of the process, if one is configured.
+void
+server_flushproc(Server *server, int p)
+{
+    Proc *proc = &server->grid->procs[p];
+
+    if (proc->out_len == 0)
+        return;
+
+    TRACE(TR_FLUSH, p);
+
+    if (server->fds[p].fd < 0)
+    {
+        proc->out_len = 0;
+        return;
+    }
+
+    if (proc->queue_head + proc->queue_len + proc->out_len > proc->queue_cap)
+    {
+        // The kernel may still be reading the queue for an io_uring send.
+        // The frame then waits in proc->out until the send completes.
+        if (proc->sending)
+            return;
+
+        memmove(proc->queue, proc->queue + proc->queue_head,
+            proc->queue_len);
+        proc->queue_head = 0;
+    }
+
+    if (proc->queue_len + proc->out_len > proc->queue_cap)
+    {
+        proc->out_len = 0;
+        server->counters.queue_overflows++;
+        server_evictproc(server, p, "send queue overflow");
+        return;
+    }
+
+    memcpy(proc->queue + proc->queue_head + proc->queue_len, proc->out,
+        proc->out_len);
+    proc->queue_len += proc->out_len;
+    server->counters.bytes_sent += proc->out_len;
+    proc->out_len = 0;
+
+    // The time the process was told to sleep does not count against it.
+    if (server->config->deadline_ms > 0)
+        proc->deadline_ns = clock_nsec() + proc->delay_us * 1000ULL +
+            server->config->deadline_ms * 1000000ULL;
+    proc->delay_us = 0;
+
+    server_drainproc(server, p);
+}
+
+// server_drainproc - write out the send queue of a process
+//     server: The server state.
+//     p: The index of the process.
+//
+// Writes until the queue is empty or the socket is full. While data is
+// left over, the process is polled for POLLOUT as well. A process whose
+// socket is broken is evicted. On the io_uring backend, the queue is
+// handed to the kernel as a single send instead.
+void
+server_drainproc(Server *server, int p)
+{
+    Proc *proc = &server->grid->procs[p];
+    struct io_uring_sqe *sqe;
+    ssize_t nbytes;
+
+    if (server->config->io == IO_URING)
+    {
+        if (proc->sending || proc->queue_len == 0)
+            return;
+
+        sqe = uring_getsqe(&server->uring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = proc->fd;
+        sqe->addr = (uint64_t) (uintptr_t) (proc->queue + proc->queue_head);
+        sqe->len = proc->queue_len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = (uint64_t) p << 1 | URING_SEND;
+        proc->sending = 1;
+        return;
+    }
+
+    while (proc->queue_len > 0)
+    {
+        nbytes = send(proc->fd, proc->queue + proc->queue_head,
+            proc->queue_len, MSG_NOSIGNAL);
+
+        if (nbytes < 0 && errno == EINTR)
+            continue;
+
+        if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (!(server->fds[p].events & POLLOUT))
+                server->counters.send_stalls++;
+
+            server->fds[p].events |= POLLOUT;
+            return;
+        }
+
+        if (nbytes < 0)
+        {
+            server->counters.disconnects++;
+            server_evictproc(server, p, "broken pipe");
+            return;
+        }
+
+        proc->queue_head += nbytes;
+        proc->queue_len -= nbytes;
+    }
+
+    proc->queue_head = 0;
+    server->fds[p].events &= ~POLLOUT;
+}
+
+// server_evictproc - remove a misbehaving process from the game
+//     server: The server state.
+//     p: The index of the process.
+//     why: The reason, for the debug log.
+//
+// Kills every live unit of the process, which in turn kills the process
+// itself. In tick mode the units are also taken out of the current tick,
+// so that it does not wait for them.
+void
+server_evictproc(Server *server, int p, const char *why)
+{
+    Client *client;
+    Grid *grid = server->grid;
+    Proc *proc = &grid->procs[p];
+    Tick *tick = &server->tick;
+    int i, evicted = 0;
+
+    for (i = 0; i < proc->num_units; i++)
+    {
+        client = &grid->clients[proc->units[i]];
+
+        if (!server_clientalive(client))
+            continue;
+
+        if (server->config->tick)
+        {
+            if (tick->submitted[client->idx])
+                tick->num_submitted--;
+            tick->submitted[client->idx] = 0;
+            tick->num_alive--;
+        }
+
+        server_killclient(grid, server->fds, client);
+        evicted = 1;
+    }
+
+    proc->queue_len = 0;
+    proc->in_len = 0;
+    proc->out_len = 0;
+    proc->deadline_ns = 0;
+    server->counters.evictions++;
+
+    // Only read by LOG(), which is empty outside debug builds.
+    (void) why;
+    LOG("[watchdog] evicted process %d (%s)\n", p, why);
+
+    if (evicted)
+        grid_print(grid);
+}
+
+// server_penalizeproc - punish a process for missing its deadline
+//     server: The server state.
+//     p: The index of the process.
+//
+// Every live unit of the process loses one energy, and hunters that run
+// out die as if exhausted. In tick mode, units that have not moved yet
+// are made to stay in place, so that the tick can go on without them.
+// Returns true if a unit died.
+int
+server_penalizeproc(Server *server, int p)
+{
+    Client *client;
+    Grid *grid = server->grid;
+    Proc *proc = &grid->procs[p];
+    Tick *tick = &server->tick;
+    int i, died = 0;
+
+    for (i = 0; i < proc->num_units; i++)
+    {
+        client = &grid->clients[proc->units[i]];
+
+        if (!server_clientalive(client))
+            continue;
+
+        client->ui.energy--;
+
+        if (client->ui.type == CT_HUNTER && client->ui.energy <= 0)
+        {
+            if (server->config->tick)
+            {
+                if (tick->submitted[client->idx])
+                    tick->num_submitted--;
+                tick->submitted[client->idx] = 0;
+                tick->num_alive--;
+            }
+
+            server_killclient(grid, server->fds, client);
+            LOG("[death] hunter %d exhausted by penalties\n", client->idx);
+            died = 1;
+            continue;
+        }
+
+        if (server->config->tick && !tick->submitted[client->idx])
+        {
+            tick->moves[client->idx].move_request = client->ui.pos;
+            tick->submitted[client->idx] = 1;
+            tick->num_submitted++;
+        }
+    }
+
+    server->counters.penalties++;
+
+    return died;
+}
+
+// server_watchdog - enforce the request deadlines
+//     server: The server state.
+//     now: The current time.
+//
+// A process misses its deadline when it has not answered a reply within
+// config->deadline_ms, whether because it is slow to move or because it
+// does not read its socket. Depending on config->watchdog, it is then
+// evicted, or penalized and given another deadline.
+void
+server_watchdog(Server *server, uint64_t now)
+{
+    Grid *grid = server->grid;
+    Proc *proc;
+    uint64_t interval;
+    int p, died = 0;
+
+    for (p = 0; p < grid->num_procs; p++)
+    {
+        proc = &grid->procs[p];
+
+        if (server->fds[p].fd < 0 || !proc->deadline_ns ||
+            now < proc->deadline_ns)
+            continue;
+
+        server->counters.deadline_misses++;
+
+        if (server->config->watchdog == WATCHDOG_EVICT)
+        {
+            server_evictproc(server, p, "missed deadline");
+            continue;
+        }
+
+        died |= server_penalizeproc(server, p);
+        proc->deadline_ns = now + server->config->deadline_ms * 1000000ULL;
+    }
+
+    if (died)
+        grid_print(grid);
+
+    // Check a few times per deadline, within sensible bounds.
+    interval = server->config->deadline_ms * 1000000ULL / 4;
+    if (interval < WATCHDOG_MININTERVAL)
+        interval = WATCHDOG_MININTERVAL;
+    if (interval > WATCHDOG_MAXINTERVAL)
+        interval = WATCHDOG_MAXINTERVAL;
+    server->next_watchdog = now + interval;
+}
+
+// server_controlinit - open the control channel
+//     server: The server state.
+//
+// The channel is a named pipe at config->control, created if needed.
+// Any process can write commands into it, one per line:
+//
+//     add <x> <y>
+//     remove <x> <y>
+//
+// On error, prints the reason on stderr and exits with a failure code.
+void
+server_controlinit(Server *server)
+{
+    const char *path = server->config->control;
+
+    if (mkfifo(path, 0600) < 0 && errno != EEXIST)
+    {
+        perror("mkfifo");
+        exit(EXIT_FAILURE);
+    }
+
+    // O_RDWR keeps a writer around, so the pipe never reads end of file
+    // between two clients of the channel.
+    server->control_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (server->control_fd < 0)
+    {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// server_control - run the commands waiting on the control channel
+//     server: The server state.
+//
+// Malformed commands and cells off the map are reported and ignored.
+// Returns true if the obstacles changed.
+int
+server_control(Server *server)
+{
+    Grid *grid = server->grid;
+    Coordinate c;
+    ssize_t nbytes;
+    char *line, *end, op[16];
+    int changed = 0;
+
+    while (1)
+    {
+        nbytes = read(server->control_fd,
+            server->control_buf + server->control_len,
+            CONTROL_LINE - 1 - server->control_len);
+
+        if (nbytes <= 0)
+            return changed;
+
+        server->control_len += nbytes;
+        server->control_buf[server->control_len] = '\0';
+        line = server->control_buf;
+
+        while ((end = strchr(line, '\n')))
+        {
+            *end = '\0';
+
+            if (sscanf(line, "%15s %d %d", op, &c.x, &c.y) != 3 ||
+                c.x < 0 || c.x >= grid->mapsize.y ||
+                c.y < 0 || c.y >= grid->mapsize.x)
+                fprintf(stderr, "control: bad command: %s\n", line);
+            else if (!strcmp(op, "add"))
+                changed |= grid_addobstacle(grid, c);
+            else if (!strcmp(op, "remove"))
+                changed |= grid_removeobstacle(grid, c);
+            else
+                fprintf(stderr, "control: bad command: %s\n", line);
+
+            line = end + 1;
+        }
+
+        server->control_len -= line - server->control_buf;
+        memmove(server->control_buf, line, server->control_len);
+
+        // A line that fills the buffer can never be completed.
+        if (server->control_len == CONTROL_LINE - 1)
+        {
+            fprintf(stderr, "control: command too long\n");
+            server->control_len = 0;
+        }
+    }
+}
+
+// server_obstacles - apply the obstacle changes that are due
+//     server: The server state.
+//     now: The current time.
+//
+// Runs the scripted changes of the map whose move has been reached, and
+// the commands of the control channel, and prints the grid if anything
+// changed.
+void
+server_obstacles(Server *server, uint64_t now)
+{
+    Grid *grid = server->grid;
+    ObstacleEvent *event;
+    int changed = 0;
+
+    while (server->next_event < grid->num_events &&
+        grid->events[server->next_event].move <= server->num_moves)
+    {
+        event = &grid->events[server->next_event++];
+
+        if (event->add)
+            changed |= grid_addobstacle(grid, event->cell);
+        else
+            changed |= grid_removeobstacle(grid, event->cell);
+    }
+
+    if (server->control_fd >= 0 && now >= server->next_control)
+    {
+        changed |= server_control(server);
+        server->next_control = now + CONTROL_INTERVAL;
+    }
+
+    if (changed)
+        grid_print(grid);
+}
+
+// server_pace - decide when a client may make its next move
+//     server: The server state.
+//     client: The client about to get a reply.
+//     msg: The reply, which tells how far the nearest adversary is.
+//     now: The time the reply is sent.
+//
+// Returns the delay in microseconds the client has to wait before
+// moving, which travels in the reply. Every type moves at its own rate
+// from config->type_rate in moves per second per unit, where 0 means as
+// fast as possible and PACE_RANDOM the original random think time. With
+// an LOD radius, units away from the action wait longer still, see
+// server_lodlevel(). On top of that, config->rate caps the moves of all
+// units together: moves are spaced evenly at that rate, each one taking
+// the first free slot after its own wake time, so the slots go to the
+// units that are due.
+int
+server_pace(Server *server, Client *client, ServerMsg *msg, uint64_t now)
+{
+    ServerConfig *config = server->config;
+    double type_rate = config->type_rate[client->ui.type];
+    uint64_t wake = now, lod_wake;
+    int level;
+
+    if (type_rate == PACE_RANDOM)
+    {
+        // xorshift64*, so that a seed reproduces the think times.
+        server->rng ^= server->rng >> 12;
+        server->rng ^= server->rng << 25;
+        server->rng ^= server->rng >> 27;
+        wake += 10000000ULL *
+            (1 + (server->rng * 0x2545f4914f6cdd1dULL >> 32) % 9);
+    }
+    else if (type_rate > 0)
+        wake += (uint64_t) (1e9 / type_rate);
+
+    if (config->lod_radius > 0)
+    {
+        level = server_lodlevel(server, msg);
+        server->lod_replies[level]++;
+
+        lod_wake = level > 0 ? now + (config->lod_interval << (level - 1)) :
+            now;
+        if (wake < lod_wake)
+            wake = lod_wake;
+    }
+
+    if (config->rate > 0)
+    {
+        if (wake < server->pace_tat)
+            wake = server->pace_tat;
+        server->pace_tat = wake + (uint64_t) (1e9 / config->rate);
+    }
+
+    return (wake - now) / 1000;
+}
+
+// server_lodlevel - the level of detail of a unit
+//     server: The server state.
+//     msg: The reply to the unit.
+//
+// Level 0 is full rate, for units within config->lod_radius of their
+// nearest adversary. Beyond it, the level goes up by one every time the
+// distance doubles, up to LOD_LEVELS - 1, which is also the level of a
+// unit with no adversary left.
+int
+server_lodlevel(Server *server, ServerMsg *msg)
+{
+    int radius = server->config->lod_radius, distance, level = 0;
+
+    if (msg->adv_pos.x < 0)
+        return LOD_LEVELS - 1;
+
+    distance = grid_distance(msg->pos, msg->adv_pos);
+
+    while (distance > radius && level < LOD_LEVELS - 1)
+    {
+        radius *= 2;
+        level++;
+    }
+
+    return level;
+}
+
+// server_uringinit - switch the server to the io_uring backend
+//     server: The server state.
+//
+// Falls back to poll() if the kernel cannot provide a suitable ring.
+void
+server_uringinit(Server *server)
+{
+    unsigned sq_entries = 1, cq_entries = 1;
+    unsigned in_flight = 2 * (unsigned) server->grid->num_procs;
+
+    while (sq_entries < in_flight && sq_entries < URING_MAXSQ)
+        sq_entries <<= 1;
+    while (cq_entries < in_flight + 1)
+        cq_entries <<= 1;
+
+    if (cq_entries > URING_MAXCQ ||
+        uring_init(&server->uring, sq_entries, cq_entries) < 0)
+    {
+        fprintf(stderr, "io_uring unavailable (%s), falling back to poll\n",
+            cq_entries > URING_MAXCQ ? "too many processes" :
+            strerror(errno));
+        server->config->io = IO_POLL;
+    }
+}
+
+// server_uringrecv - receive the rest of the frame of a process
+//     server: The server state.
+//     p: The index of the process.
+//
+// Asks for exactly the missing bytes of the current frame, so that a
+// receive never runs into the next one.
+void
+server_uringrecv(Server *server, int p)
+{
+    Grid *grid = server->grid;
+    Proc *proc = &grid->procs[p];
+    struct io_uring_sqe *sqe;
+
+    if (server->fds[p].fd < 0)
+        return;
+
+    sqe = uring_getsqe(&server->uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = proc->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (proc->in + proc->in_len);
+    sqe->len = clientmsg_need(proc, grid) - proc->in_len;
+    sqe->user_data = (uint64_t) p << 1 | URING_RECV;
+}
+
+// server_uringwait - the io_uring counterpart of poll()
+//     server: The server state.
+//     timeout_ns: How long to wait for a completion at most, 0 to only
+//                 reap those that are in.
+//
+// Submits what the last wakeup queued and reaps the completions that
+// are in, without entering the kernel if there is nothing to submit and
+// no wait.
+// Processes with a whole frame in proc->in are then flagged with POLLIN
+// in server->fds, so the rest of the loop cannot tell the backends apart.
+// Like poll(), returns the number of flagged processes.
+int
+server_uringwait(Server *server, uint64_t timeout_ns)
+{
+    Grid *grid = server->grid;
+    Uring *ring = &server->uring;
+    struct io_uring_cqe *cqe;
+    Proc *proc;
+    unsigned head, tail;
+    size_t need;
+    int p, num_ready = 0;
+
+    if (timeout_ns > 0 &&
+        *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        uring_wait(ring, timeout_ns);
+    else
+        uring_submit(ring);
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+        if (cqe->user_data == URING_TIMEOUT)
+            continue;
+
+        p = cqe->user_data >> 1;
+        proc = &grid->procs[p];
+
+        // Completions can trail the eviction of their process.
+        if (server->fds[p].fd < 0)
+            continue;
+
+        if ((cqe->user_data & 1) == URING_SEND)
+        {
+            proc->sending = 0;
+
+            if (cqe->res < 0)
+            {
+                server->counters.disconnects++;
+                server_evictproc(server, p, "broken pipe");
+                continue;
+            }
+
+            proc->queue_head += cqe->res;
+            proc->queue_len -= cqe->res;
+            if (proc->queue_len == 0)
+                proc->queue_head = 0;
+
+            server_drainproc(server, p);
+            server_flushproc(server, p);
+            continue;
+        }
+
+        if (cqe->res <= 0)
+        {
+            server->counters.disconnects++;
+            server_evictproc(server, p, "disconnected");
+            continue;
+        }
+
+        proc->in_len += cqe->res;
+        need = clientmsg_need(proc, grid);
+
+        if (need == 0)
+        {
+            server->counters.disconnects++;
+            server_evictproc(server, p, "disconnected");
+        }
+        else if (proc->in_len < need)
+            server_uringrecv(server, p);
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    for (p = 0; p < grid->num_procs; p++)
+    {
+        proc = &grid->procs[p];
+        server->fds[p].revents = server->fds[p].fd >= 0 &&
+            proc->in_len > 0 &&
+            proc->in_len == clientmsg_need(proc, grid) ?
+            POLLIN : 0;
+        num_ready += server->fds[p].revents != 0;
+    }
+
+    return num_ready;
+}
+
+// server_spawnprocs - group the units into processes and fork them
+//     server: The server state.
+//
+// Every process drives up to config->units_per_proc consecutive units
+// of one type. The slot of a unit is its position within its process.
+// With a placement policy, every process is pinned to the core chosen by
+// server_placeproc() before it runs.
+void
+server_spawnprocs(Server *server)
+{
+    Client *client;
+    Grid *grid = server->grid;
+    Proc *proc = NULL;
+    int i, units_per_proc = server->config->units_per_proc;
+    size_t frame_in, frame_out;
+
+    // Both encodings fit: compact frames have one more int of header,
+    // but entries smaller by more than that.
+    frame_in = sizeof(int) + units_per_proc * sizeof(MuxClientMsg);
+    frame_out = sizeof(int) + units_per_proc * sizeof(MuxServerMsg);
+
+    grid->units_per_proc = units_per_proc;
+    grid->procs = grid_alloc(grid, grid->num_clients * sizeof(Proc));
+    grid->num_procs = 0;
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        client = &grid->clients[i];
+
+        // We assign an unique index to every client, this helps us in a
+        // few different ways we'll see later.
+        client->idx = i;
+
+        if (!proc || proc->num_units == units_per_proc ||
+            proc->type != client->ui.type)
+        {
+            proc = &grid->procs[grid->num_procs];
+            proc->type = client->ui.type;
+            proc->units = grid_alloc(grid, units_per_proc * sizeof(int));
+            proc->out = grid_alloc(grid, frame_out);
+            proc->in = grid_alloc(grid, frame_in);
+            proc->queue_cap = server->config->send_cap > frame_out ?
+                server->config->send_cap : frame_out;
+            proc->queue = grid_alloc(grid, proc->queue_cap);
+            grid->num_procs++;
+        }
+
+        client->proc = proc - grid->procs;
+        proc->units[proc->num_units] = i;
+        proc->num_units++;
+        proc->num_alive++;
+    }
+
+    if (server->config->placement != PLACE_NONE)
+        server_placement(server);
+
+    for (i = 0; i < grid->num_procs; i++)
+    {
+        proc = &grid->procs[i];
+        proc->cpu = server->config->placement != PLACE_NONE ?
+            server_placeproc(server, proc) : -1;
+        server_forkproc(proc, grid);
+    }
+}
+
+// server_placement - pin the server and pick the cores of the clients
+//     server: The server state.
+//
+// The server is pinned to config->server_cpu, or to the first core it
+// may run on if that is negative, so that its loop is never migrated.
+// The other cores it may run on, in increasing order, are left for the
+// client processes in server->cpus. Core numbers follow the NUMA nodes on
+// common machines, so neighbouring entries usually share a node. On a
+// single core, the clients share it with the server.
+void
+server_placement(Server *server)
+{
+    ServerConfig *config = server->config;
+    cpu_set_t set;
+    int cpu, server_cpu = config->server_cpu;
+
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set) < 0)
+    {
+        perror("sched_getaffinity");
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_cpu < 0)
+        for (server_cpu = 0; !CPU_ISSET(server_cpu, &set); server_cpu++)
+            ;
+
+    if (server_cpu >= CPU_SETSIZE || !CPU_ISSET(server_cpu, &set))
+    {
+        fprintf(stderr, "the server cannot run on cpu %d\n", server_cpu);
+        exit(EXIT_FAILURE);
+    }
+
+    server->cpus = grid_alloc(server->grid, CPU_SETSIZE * sizeof(int));
+    server->num_cpus = 0;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set) && cpu != server_cpu)
+            server->cpus[server->num_cpus++] = cpu;
+
+    if (server->num_cpus == 0)
+        server->cpus[server->num_cpus++] = server_cpu;
+
+    ipc_pincpu(0, server_cpu);
+}
+
+// server_placeproc - choose the core of a client process
+//     server: The server state.
+//     proc: The process, with its units assigned.
+//
+// PLACE_SPREAD deals the processes out over the client cores in turn.
+// PLACE_GROUP cuts the map into one band of rows per client core, and
+// puts a process on the band of the mean position of its units; units
+// close on the map then share a core, and neighbouring bands a node.
+int
+server_placeproc(Server *server, Proc *proc)
+{
+    Grid *grid = server->grid;
+    long row = 0;
+    int i;
+
+    if (server->config->placement == PLACE_SPREAD)
+        return server->cpus[(proc - grid->procs) % server->num_cpus];
+
+    for (i = 0; i < proc->num_units; i++)
+        row += grid->clients[proc->units[i]].ui.pos.x;
+    row /= proc->num_units;
+
+    return server->cpus[row * server->num_cpus / grid->mapsize.y];
+}
+
+// server_report - print the latency statistics
+//     server: The server state.
+//
+// Prints the number of requests served and the p50, p99 and maximum
+// request latency of every client, followed by the totals, on the
+// standard error.
+void
+server_report(Server *server)
+{
+    Grid *grid = server->grid;
+    CacheStats *stats = &grid->cache_stats;
+    WaitState *wait = &server->wait;
+    Histogram total;
+    struct rusage usage;
+    uint64_t adv, objects;
+    double elapsed, cpu;
+    int i;
+
+    memset(&total, 0, sizeof(Histogram));
+    elapsed = (clock_nsec() - server->start_ns) / 1e9;
+
+    fprintf(stderr, "%-8s %-6s %10s %10s %10s %10s\n", "client", "type",
+        "served", "p50(us)", "p99(us)", "max(us)");
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        Histogram *hist = &server->latency[i];
+
+        fprintf(stderr, "%-8d %-6s %10llu %10.1f %10.1f %10.1f\n", i,
+            grid->clients[i].ui.type == CT_HUNTER ? "hunter" : "prey",
+            (unsigned long long) hist->count,
+            hist_percentile(hist, 0.50) / 1e3,
+            hist_percentile(hist, 0.99) / 1e3,
+            hist->max / 1e3);
+
+        hist_merge(&total, hist);
+    }
+
+    fprintf(stderr, "%-8s %-6s %10llu %10.1f %10.1f %10.1f\n", "all", "",
+        (unsigned long long) total.count,
+        hist_percentile(&total, 0.50) / 1e3,
+        hist_percentile(&total, 0.99) / 1e3,
+        total.max / 1e3);
+    fprintf(stderr, "%llu moves in %.3f s (%.0f moves/s)\n",
+        (unsigned long long) server->num_moves, elapsed,
+        elapsed > 0 ? server->num_moves / elapsed : 0.0);
+    fprintf(stderr, "unit index: %s\n",
+        grid->units.mode == UNITMAP_DENSE ? "dense" : "sparse");
+    fprintf(stderr, "%llu bytes of replies (%.1f per move)\n",
+        (unsigned long long) server->counters.bytes_sent,
+        server->num_moves > 0 ?
+        (double) server->counters.bytes_sent / server->num_moves : 0.0);
+    fprintf(stderr, "moves accepted %llu, stayed %llu, denied by allies "
+        "%llu, denied by adversaries %llu, denied by obstacles %llu, "
+        "captures %llu, deaths %llu, redirected %llu, invalid %llu\n",
+        (unsigned long long) server->counters.results[MOVE_ACCEPTED],
+        (unsigned long long) server->counters.results[MOVE_STAYED],
+        (unsigned long long) server->counters.results[MOVE_DENIED_ALLY],
+        (unsigned long long) server->counters.results[MOVE_DENIED_ADV],
+        (unsigned long long) server->counters.results[MOVE_DENIED_OBSTACLE],
+        (unsigned long long) server->counters.results[MOVE_CAPTURED],
+        (unsigned long long) server->counters.results[MOVE_KILLED],
+        (unsigned long long) server->counters.redirects,
+        (unsigned long long) server->counters.results[MOVE_INVALID]);
+
+    if (grid->cache)
+    {
+        adv = stats->adv_hits + stats->adv_misses;
+        objects = stats->object_hits + stats->object_misses;
+
+        fprintf(stderr, "reply cache hits: adversary %.1f%% of %llu, "
+            "objects %.1f%% of %llu\n",
+            adv > 0 ? 100.0 * stats->adv_hits / adv : 0.0,
+            (unsigned long long) adv,
+            objects > 0 ? 100.0 * stats->object_hits / objects : 0.0,
+            (unsigned long long) objects);
+    }
+
+    path_report(grid);
+
+    if (server->config->lod_radius > 0)
+    {
+        fprintf(stderr, "replies by level of detail:");
+        for (i = 0; i < LOD_LEVELS; i++)
+            fprintf(stderr, " %llu",
+                (unsigned long long) server->lod_replies[i]);
+        fprintf(stderr, "\n");
+    }
+
+    // The idle time before a wakeup shows how long the loop would have
+    // had to spin to catch it.
+    getrusage(RUSAGE_SELF, &usage);
+    cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    fprintf(stderr, "server cpu %.3f s (%.0f%% of %.3f s), %llu polls, "
+        "%llu blocking waits\n", cpu,
+        elapsed > 0 ? 100.0 * cpu / elapsed : 0.0, elapsed,
+        (unsigned long long) wait->polls,
+        (unsigned long long) wait->blocks);
+    fprintf(stderr, "idle before wakeups: spinning %llu, p50 %.1f us, "
+        "p99 %.1f us; blocked %llu, p50 %.1f us, p99 %.1f us\n",
+        (unsigned long long) wait->spun.count,
+        hist_percentile(&wait->spun, 0.50) / 1e3,
+        hist_percentile(&wait->spun, 0.99) / 1e3,
+        (unsigned long long) wait->blocked.count,
+        hist_percentile(&wait->blocked, 0.50) / 1e3,
+        hist_percentile(&wait->blocked, 0.99) / 1e3);
+
+    if (server->config->wait == WAIT_ADAPTIVE)
+        fprintf(stderr, "spin window: mean %.1f us, max %.1f us, "
+            "last %.1f us\n",
+            wait->blocks > 0 ? wait->window_sum / 1e3 / wait->blocks : 0.0,
+            wait->window_max / 1e3, wait->window / 1e3);
+
+    fprintf(stderr, "deadline misses %llu, evictions %llu, penalties %llu, "
+        "disconnects %llu, queue overflows %llu, send stalls %llu\n",
+        (unsigned long long) server->counters.deadline_misses,
+        (unsigned long long) server->counters.evictions,
+        (unsigned long long) server->counters.penalties,
+        (unsigned long long) server->counters.disconnects,
+        (unsigned long long) server->counters.queue_overflows,
+        (unsigned long long) server->counters.send_stalls);
+}
+
+// server_loadinit - prepare a load sweep
+//     server: The server state.
+//
+// The first step of the sweep starts with the game, so its rate caps the
+// initial moves as well. Hunters are given energy for the whole run:
+// load generators never eat, and a sweep whose population starves
+// halfway would not compare its steps.
+void
+server_loadinit(Server *server)
+{
+    Grid *grid = server->grid;
+    int i;
+
+    server->config->rate = server->config->load[0];
+
+    for (i = 0; i < grid->num_clients; i++)
+        if (grid->clients[i].ui.type == CT_HUNTER)
+            grid->clients[i].ui.energy = INT_MAX / 2;
+}
+
+// server_loadstep - advance a load sweep
+//     server: The server state.
+//     now: The time poll() returned.
+//
+// Every step offers config->load[step] moves per second in total, with
+// 0 for as many as the server can take, through the global rate cap of
+// server_pace(). Once a step has run for config->load_step_ms, its
+// achieved rate and the percentiles of its serving latency are saved and
+// the next rate is put in place; after the last one the run ends.
+void
+server_loadstep(Server *server, uint64_t now)
+{
+    ServerConfig *config = server->config;
+    LoadStep *step = &server->load_steps[server->load_step];
+    uint64_t elapsed = now - server->load_start;
+
+    if (elapsed < config->load_step_ms * 1000000ULL)
+        return;
+
+    step->offered = config->load[server->load_step];
+    step->moves = server->num_moves - server->load_moves;
+    step->achieved = step->moves / (elapsed / 1e9);
+    step->p50 = hist_percentile(&server->load_latency, 0.50);
+    step->p99 = hist_percentile(&server->load_latency, 0.99);
+    step->max = server->load_latency.max;
+
+    if (++server->load_step == config->num_loads)
+    {
+        server->load_done = 1;
+        return;
+    }
+
+    config->rate = config->load[server->load_step];
+    server->pace_tat = now;
+    server->load_start = now;
+    server->load_moves = server->num_moves;
+    memset(&server->load_latency, 0, sizeof(Histogram));
+}
+
+// server_loadreport - print the results of a load sweep
+//     server: The server state.
+//
+// One line per completed step: the offered and achieved rates in moves
+// per second, and the serving latency, from the wakeup a request was
+// seen on until its reply was written. The saturation throughput is the
+// highest achieved rate; it shows as the step where the achieved rate
+// stops following the offered one and the latency starts to climb.
+void
+server_loadreport(Server *server)
+{
+    LoadStep *step;
+    double peak = 0;
+    int i;
+
+    fprintf(stderr, "%-10s %10s %10s %10s %10s %10s\n", "offered",
+        "achieved", "moves", "p50(us)", "p99(us)", "max(us)");
+
+    for (i = 0; i < server->load_step; i++)
+    {
+        step = &server->load_steps[i];
+
+        if (step->offered > 0)
+            fprintf(stderr, "%-10.0f ", step->offered);
+        else
+            fprintf(stderr, "%-10s ", "max");
+
+        fprintf(stderr, "%10.0f %10llu %10.1f %10.1f %10.1f\n",
+            step->achieved, (unsigned long long) step->moves,
+            step->p50 / 1e3, step->p99 / 1e3, step->max / 1e3);
+
+        if (step->achieved > peak)
+            peak = step->achieved;
+    }
+
+    if (server->load_step < server->config->num_loads)
+        fprintf(stderr, "the game ended after %d of %d steps\n",
+            server->load_step, server->config->num_loads);
+
+    fprintf(stderr, "saturation throughput %.0f moves/s\n", peak);
+}
+
+// server_processmsg - process move requests
+//     grid_updated: Set to 1 if the grid is updated.
+//     fds: Required to switch off file descriptors of killed processes.
+//     grid: The grid containing the information of all clients.
+//     client: The client who triggered this function.
+//     msg: The move request to process.
+//
+// Processes a client message. Checks for collisions, deaths due to
+// collisions or the exhaustion of energy, transfers energy from preys to
+// hunters on their death, updates the coordinates of the clients. The
+// reply cache, if any, is told about every move and death. The units on
+// the target cell are found in the unit index rather than by a pass over
+// all units. A move off the map or of more than one cell is invalid.
+// Returns the outcome of the move, for the reply.
+//
+// This function also handles the killing of processes. When a unit
+// is killed in server_processmsg, server_killclient is called, which
+// kills its process and closes the file descriptor once the process has
+// no live units left. It also switches off the value in the polling
+// table to prevent socket errors.
+MoveResult
+server_processmsg(int *grid_updated, struct pollfd *fds, Grid *grid,
+    Client *client, ClientMsg msg)
+{
+    ClientType type, adv_type;
+    Coordinate coord, from;
+    int i, energy;
+
+    TRACE(TR_PROCESS, client->idx);
+
+    coord = msg.move_request;
+    from = client->ui.pos;
+    type = client->ui.type;
+    adv_type = server_clientadvtype(client);
+
+    // Moves off the map are refused before they reach the unit index, as
+    // are jumps of more than one cell: the reply cache only looks one
+    // cell past its bound for a unit that moved.
+    if (!grid_onmap(grid, coord) || grid_distance(from, coord) > 1)
+    {
+        *grid_updated = 0;
+        return MOVE_INVALID;
+    }
+
+    // The reply the move was based on may predate an obstacle on the
+    // cell. A unit already standing on one may stay there.
+    if (!grid_equal(coord, from) && grid_isobstacle(grid, coord))
+    {
+        *grid_updated = 0;
+        return MOVE_DENIED_OBSTACLE;
+    }
+
+    // The units on the cell, in index order.
+    for (i = unitmap_first(grid, coord); i >= 0; i = grid->units.next[i])
+    {
+        // A unit asking to stay is not in its own way.
+        if (i == client->idx)
+            continue;
+
+        // Types are equal => this is a collision with an ally.
+        // This move is not allowed, so the request is denied. Load
+        // generators do not fight either, so that a load run keeps
+        // its population.
+        if (type == grid->clients[i].ui.type || grid->loadgen)
+        {
+            *grid_updated = 0;
+            return type == grid->clients[i].ui.type ?
+                MOVE_DENIED_ALLY : MOVE_DENIED_ADV;
+        }
+        else
+        {
+            // This is a collision of a hunter into a prey.
+            // The prey shall be killed, and the hunter will gain
+            // its energy. We still have to check if the hunter has
+            // positive energy, as the prey can theoretically have
+            // a negative or zero energy.
+            if (type == CT_HUNTER)
+            {
+                client->ui.pos = msg.move_request;
+                unitmap_move(grid, client, from);
+                cache_move(grid, client, from);
+                client->ui.energy--;
+                energy = grid->clients[i].ui.energy;
+                client->ui.energy += energy;
+
+                if (client->ui.energy <= 0)
+                {
+                    server_killclient(grid, fds, client);
+                    LOG("[death] hunter %d exhausted\n", client->idx);
+                }
+
+                server_killclient(grid, fds, &grid->clients[i]);
+                LOG("[death] %d killed by hunter %d\n", i, client->idx);
+
+                *grid_updated = 1;
+                return server_clientalive(client) ?
+                    MOVE_CAPTURED : MOVE_KILLED;
+            }
+            else
+            {
+                // This (unfortunate) case occurs when a prey walks
+                // into a hunter. In this case, we need to kill the
+                // triggering client and yield its energy to the
+                // killing hunter.
+                client->ui.pos = msg.move_request;
+                unitmap_move(grid, client, from);
+                cache_move(grid, client, from);
+                energy = client->ui.energy;
+                grid->clients[i].ui.energy += energy;
+
+                server_killclient(grid, fds, client);
+                LOG("[death] prey %d fed hunter %d\n", client->idx, i);
+
+                *grid_updated = 1;
+                return MOVE_KILLED;
+            }
+        }
+    }
+
+    // This is the catch-all code for all movements without collisions.
+    if (grid_equal(client->ui.pos, msg.move_request))
+    {
+        // The move request is the same location as the current location,
+        // therefore the grid hasn't been updated and energy will not be
+        // lost. Return immediately.
+        *grid_updated = 0;
+        return MOVE_STAYED;
+    }
+
+    // Otherwise, update the position and remove 1 energy if the currently
+    // moving unit is a hunter.
+    client->ui.pos = msg.move_request;
+    unitmap_move(grid, client, from);
+    cache_move(grid, client, from);
+    if (type == CT_HUNTER)
+        client->ui.energy--;
+    if (client->ui.energy <= 0)
+    {
+        server_killclient(grid, fds, client);
+        LOG("[death] hunter %d exhausted\n", client->idx);
+        *grid_updated = 1;
+        return MOVE_KILLED;
+    }
+    *grid_updated = 1;
+
+    return MOVE_ACCEPTED;
+}
+
+// server_altmove - find an alternative to a denied move
+//     grid: The grid.
+//     client: The client whose move was denied.
+//     msg: Its reply, computed after the denial, so the unit that took
+//          the cell is among its objects.
+//
+// Returns the free neighboring cell that takes the unit the nearest to
+// its adversary for a hunter, or the farthest from it for a prey, as long
+// as that is better than staying; (-1, -1) if there is none. The rule is
+// that of clientmsg_new(), but over every free cell rather than the first
+// one found. Load generators never step next to their adversary.
+Coordinate
+server_altmove(Grid *grid, Client *client, ServerMsg *msg)
+{
+    Coordinate neighbors[4], best;
+    int num_neighbors, i, j, distance, best_distance;
+
+    grid_neighbors(neighbors, &num_neighbors, grid->mapsize, msg->pos);
+
+    best.x = best.y = -1;
+    best_distance = grid_distance(msg->pos, msg->adv_pos);
+
+    for (i = 0; i < num_neighbors; i++)
+    {
+        for (j = 0; j < msg->object_count; j++)
+            if (grid_equal(neighbors[i], msg->object_pos[j]))
+                break;
+
+        if (j < msg->object_count ||
+            (grid->loadgen && grid_equal(neighbors[i], msg->adv_pos)))
+            continue;
+
+        distance = grid_distance(neighbors[i], msg->adv_pos);
+
+        if (client->ui.type == CT_HUNTER ? distance < best_distance :
+            distance > best_distance)
+        {
+            best = neighbors[i];
+            best_distance = distance;
+        }
+    }
+
+    return best;
+}
+
+// server_redirect - answer a denied move
+//     server: The server state.
+//     client: The client whose move was denied.
+//     msgout: Its reply, computed after the denial.
+//     grid_updated: Set to 1 if the grid is updated.
+//
+// Offers the alternative of server_altmove() in the reply. With
+// --redirect, the server makes that move for the client instead, so the
+// denial costs no round trip, and the reply is computed again on the new
+// state. The client may die doing so, and then gets no reply.
+void
+server_redirect(Server *server, Client *client, ServerMsg *msgout,
+    int *grid_updated)
+{
+    ClientMsg msg;
+    MoveResult result;
+
+    msg.move_request = server_altmove(server->grid, client, msgout);
+
+    if (!server->config->redirect || msg.move_request.x < 0)
+    {
+        msgout->alt_move = msg.move_request;
+        return;
+    }
+
+    result = server_processmsg(grid_updated, server->fds, server->grid,
+        client, msg);
+    server->counters.redirects++;
+
+    if (!server_clientalive(client))
+        return;
+
+    *msgout = servermsg_new(server->grid, client);
+    msgout->result = result == MOVE_ACCEPTED ? MOVE_REDIRECTED : result;
+}
+
+// server_isstable - the end condition of the simulation
+//     grid: Grid containing all of the client information.
+//
+// Returns true if either preys or hunters have been defeated.
+int
+server_isstable(Grid *grid)
+{
+    int num_hunters = 0, num_preys = 0, i;
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        if (grid->clients[i].ui.type == CT_HUNTER)
+            num_hunters++;
+        else
+            num_preys++;
+    }
+
+    return (num_hunters == 0) && (num_preys >= 0) ||
+           (num_preys == 0) && (num_hunters >= 0);
+}
+
+// server_forkproc - fork a new client process
+//     proc: The process to start, with its type and units assigned.
+//     mapsize: The size of the map.
+//     units_per_proc: The number of units per process.
+//
+// Fills the Proc object with a new pid and a file descriptor; belonging
+// to the new client process. The child process then proceeds to exec its
+// own executable.
+void
+server_forkproc(Proc *proc, Grid *grid)
+{
+    int fd[2];
+    pid_t pid;
+
+    ipc_createpipe(fd);
+    ipc_setcloexec(fd);
+
+    pid = fork();
+
+    if (pid) // Server code.
+    {
+        server_linkproc(proc, pid, fd);
+        ipc_closeclientend(fd);
+    }
+    else // Client code.
+    {
+        // The server may be pinned, so a client always needs its own
+        // mask when there is a placement.
+        if (proc->cpu >= 0)
+            ipc_pincpu(0, proc->cpu);
+
+        ipc_redirstdio(fd);
+        ipc_execclient(proc->type, grid->mapsize,
+            grid->units_per_proc > 1 ? proc->num_units : 0, grid->compact,
+            grid->loadgen);
+    }
+}
+
+// server_linkproc - attach a pid and fd to a process
+//     proc: The process to attach information to.
+//     pid: Process ID of the child process.
+//     fd: Bidirectional pipe for the new connection.
+//
+// Populates a Proc object with PID and a file descriptor,
+// so that the server process can establish connection to it after
+// fork-execing. The server end of the pipe is made non-blocking.
+void
+server_linkproc(Proc *proc, pid_t pid, int *fd)
+{
+    proc->pid = pid;
+    proc->fd = fd[0];
+
+    // A stalled client must never block the server.
+    ipc_setnonblock(proc->fd);
+}
+
+// server_killclient - kill a client
+//     grid: The grid holding the process table.
+//     fds: The polling table, or NULL.
+//     client: The client to kill.
+//
+// Sets the alive flag of the client to zero to indicate death. Once
+// its process has no live units left, sends a signal to kill it, closes
+// the server-end of the bidirectional pipe that was created when the
+// process was created, and switches off its entry in the polling table.
+// Clients that were never given a process are only marked dead.
+void
+server_killclient(Grid *grid, struct pollfd *fds, Client *client)
+{
+    Proc *proc;
+    int status;
+
+    client->ui.alive = 0;
+    TRACE(TR_KILL, client->idx);
+    unitmap_remove(grid, client, client->ui.pos);
+    cache_kill(grid, client);
+
+    if (!grid->procs || client->proc < 0)
+        return;
+
+    proc = &grid->procs[client->proc];
+    proc->num_alive--;
+
+    if (proc->num_alive > 0)
+        return;
+
+    kill(proc->pid, SIGTERM);
+    waitpid(proc->pid, &status, 0);
+    close(proc->fd);
+
+    if (fds)
+        fds[client->proc].fd = -1;
+}
+
+// server_clientalive - check if client is alive
+//     client: The client to check.
+//
+// Returns true if the client is alive.
+int
+server_clientalive(Client *client)
+{
+    return client->ui.alive;
+}
+
+// server_clientadvtype - the type of a client's adversary
+//     client: The client to query.
+//
+// Returns CT_PREY for hunters, CT_HUNTER for preys.
+ClientType
+server_clientadvtype(Client *client)
+{
+    if (client->ui.type == CT_HUNTER)
+        return CT_PREY;
+
+    return CT_HUNTER;
+}
+
+// server_clientnearestadv - nearest adversary of client
+//     grid: The grid containing all of the clients' information.
+//     client: The client whose nearest adversary is asked.
+//
+// Returns the coordinates of the nearest unit of type CT_HUNTER
+// if client is a prey, CT_PREY otherwise, or (-1, -1) if there is none
+// left.
+Coordinate
+server_clientnearestadv(Grid *grid, Client *client)
+{
+    Coordinate result;
+    int i = server_clientnearestadvidx(grid, client);
+
+    if (i >= 0)
+        return grid->clients[i].ui.pos;
+
+    result.x = result.y = -1;
+
+    return result;
+}
+
+// server_clientnearestadvidx - index of the nearest adversary of client
+//     grid: The grid containing all of the clients' information.
+//     client: The client whose nearest adversary is asked.
+//
+// Returns the index of the nearest adversary, or -1 if there is none
+// left. Of adversaries at the same distance, the lowest index wins.
+int
+server_clientnearestadvidx(Grid *grid, Client *client)
+{
+    ClientType adv_type;
+    int i, distance, mindistance, result = -1;
+
+    adv_type = server_clientadvtype(client);
+
+    // Find the distance with the first adversary on the map.
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        if (adv_type != grid->clients[i].ui.type)
+            continue;
+
+        mindistance = grid_distance(client->ui.pos,
+            grid->clients[i].ui.pos);
+        result = i;
+        break;
+    }
+
+    // Compare the remaining adversaries to find the minimum
+    // distance.
+    for (; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        if (adv_type != grid->clients[i].ui.type)
+            continue;
+
+        distance = grid_distance(client->ui.pos,
+            grid->clients[i].ui.pos);
+
+        if (distance < mindistance)
+        {
+            mindistance = distance;
+            result = i;
+        }
+    }
+
+    return result;
+}
+
+// server_clientobjects - objects neighboring a certain client
+//     buf: Preallocated array of coordinates to fill with the result.
+//     num_objects: Holds the number of objects neighboring the client.
+//     grid: The grid containing the information on all of the clients.
+//     client: The client whose neighboting objects are queried.
+//
+// For every neighboring cell of the client, we look for either an
+//
+//     1. allied unit
+//     2. obstacle
+//
+// and we collect them into buf. The length of buf is stored in
+// num_objects. Both are looked up by cell, so this takes constant time.
+void
+server_clientobjects(Coordinate *buf, int *num_objects, Grid *grid,
+        Client *client)
+{
+    ClientType adv_type;
+    Coordinate neighbors[4];
+    int num_neighbors, i, j, k = 0;
+
+    adv_type = server_clientadvtype(client);
+    grid_neighbors(neighbors, &num_neighbors, grid->mapsize,
+        client->ui.pos);
+
+    for (i = 0; i < num_neighbors && k <= num_neighbors; i++)
+    {
+        if (grid_isobstacle(grid, neighbors[i]))
+        {
+            buf[k] = neighbors[i];
+            k++;
+
+            LOG("(%d, %d) found obstacle (%d, %d) as obstacle\n",
+                client->ui.pos.x, client->ui.pos.y,
+                neighbors[i].x, neighbors[i].y);
+
+            continue;
+        }
+
+        for (j = unitmap_first(grid, neighbors[i]); j >= 0;
+             j = grid->units.next[j])
+        {
+            // If a neighboring client is an enemy, it is not considered
+            // an obstacle.
+            if (grid->clients[j].ui.type == adv_type)
+                continue;
+
+            buf[k] = neighbors[i];
+            k++;
+
+            LOG("(%d, %d) found ally (%d, %d) as obstacle\n",
+                client->ui.pos.x, client->ui.pos.y,
+                neighbors[i].x, neighbors[i].y);
+
+            // Found an object, so we can skip to the next neighboring
+            // cell.
+            break;
+        }
+    }
+
+    *num_objects = k;
+}
+
+// server_collectmoves - read the moves of a tick
+//     server: The server state.
+//     now: The time poll() returned.
+//
+// Reads the requests of every ready process. Clients that have already
+// moved in the current tick will not send anything before their reply,
+// so a process is only ready once all of its units have moved.
+void
+server_collectmoves(Server *server, uint64_t now)
+{
+    Client *client;
+    Grid *grid = server->grid;
+    MuxClientMsg *msgin = server->msgin;
+    struct pollfd *fds = server->fds;
+    Tick *tick = &server->tick;
+    int i, k, count;
+
+    for (i = 0; i < grid->num_procs; i++)
+    {
+        if (fds[i].fd < 0 || !(CLIENT_RDY(i)))
+            continue;
+
+        if (!server->ready_ns[i])
+            server->ready_ns[i] = now;
+
+        count = server_recvproc(server, i);
+        if (count == 0)
+            continue;
+
+        for (k = 0; k < count; k++)
+        {
+            client = &grid->clients[grid->procs[i].units[msgin[k].slot]];
+
+            if (!server_clientalive(client) || tick->submitted[client->idx])
+                continue;
+
+            tick->moves[client->idx] = msgin[k].msg;
+            tick->submitted[client->idx] = 1;
+
+            // Moves off the map are taken for staying put.
+            if (!grid_onmap(grid, msgin[k].msg.move_request))
+                tick->moves[client->idx].move_request = client->ui.pos;
+            tick->num_submitted++;
+        }
+    }
+}
+
+// server_tick - resolve, apply and answer the moves of a tick
+//     server: The server state.
+//
+// Called once every live client has submitted a move. The moves are
+// resolved together by tick_resolve() -- optionally checked against
+// tick_resolvereference() -- and applied by tick_apply(). Every client
+// that is still alive then gets its reply, computed on the new state.
+// Denied moves get an alternative, but are never redirected: the moves
+// of a tick are all made at once.
+void
+server_tick(Server *server)
+{
+    Grid *grid = server->grid;
+    Tick *tick = &server->tick;
+    int i, grid_updated;
+    ServerMsg msgout;
+    Client *client;
+    uint64_t now, ready;
+
+    TRACE(TR_TICK, tick->count);
+    tick_resolve(tick, grid, server->config->threads);
+
+    if (server->config->tick_verify)
+        tick_verify(tick, grid);
+
+    grid_updated = tick_apply(tick, grid, server->fds);
+    server->num_moves += tick->num_submitted;
+
+    now = clock_nsec();
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        client = &grid->clients[i];
+
+        if (!tick->submitted[i])
+            continue;
+
+        if (!server_clientalive(client))
+        {
+            server->counters.results[MOVE_KILLED]++;
+            continue;
+        }
+
+        msgout = servermsg_new(grid, client);
+        msgout.result = tick->result[i];
+        server->counters.results[msgout.result]++;
+
+        if (msgout.result == MOVE_DENIED_ALLY ||
+            msgout.result == MOVE_DENIED_ADV ||
+            msgout.result == MOVE_DENIED_OBSTACLE)
+            msgout.alt_move = server_altmove(grid, client, &msgout);
+
+        msgout.delay_us = server_pace(server, client, &msgout, now);
+        servermsg_send(grid, client, msgout);
+    }
+
+    for (i = 0; i < grid->num_procs; i++)
+        server_flushproc(server, i);
+
+    now = clock_nsec();
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        if (!tick->submitted[i])
+            continue;
+
+        tick->submitted[i] = 0;
+
+        // Moves forced by the watchdog were never requested.
+        ready = server->ready_ns[grid->clients[i].proc];
+        if (ready == 0)
+            continue;
+
+        if (server->latency)
+            hist_add(&server->latency[i], now - ready);
+
+        if (server->config->num_loads > 0)
+            hist_add(&server->load_latency, now - ready);
+    }
+    memset(server->ready_ns, 0, grid->num_procs * sizeof(uint64_t));
+
+    tick->num_submitted = 0;
+    tick->count++;
+
+    if (grid_updated)
+        grid_print(grid);
+}
+
+// tick_init - allocate the state of the batch resolver
+//     tick: The state to initialize.
+//     grid: The grid of the game, whose arena holds the state.
+void
+tick_init(Tick *tick, Grid *grid)
+{
+    int n = grid->num_clients;
+
+    memset(tick, 0, sizeof(Tick));
+
+    tick->num_alive = n;
+    tick->moves = grid_alloc(grid, n * sizeof(ClientMsg));
+    tick->submitted = grid_alloc(grid, n);
+    tick->final = grid_alloc(grid, n * sizeof(Coordinate));
+    tick->captor = grid_alloc(grid, n * sizeof(int));
+    tick->result = grid_alloc(grid, n);
+    tick->ref_final = grid_alloc(grid, n * sizeof(Coordinate));
+    tick->ref_captor = grid_alloc(grid, n * sizeof(int));
+
+    cellmap_init(&tick->start, &grid->arena, n);
+    cellmap_init(&tick->claims[CT_HUNTER], &grid->arena, n);
+    cellmap_init(&tick->claims[CT_PREY], &grid->arena, n);
+    cellmap_init(&tick->hunters, &grid->arena, n);
+}
+
+// tick_claimtype - the type a client claims target cells for
+//     grid: The grid.
+//     client: The moving client.
+//
+// Load generators all claim for the hunters, so that no two of them end
+// the tick on the same cell.
+ClientType
+tick_claimtype(Grid *grid, Client *client)
+{
+    return grid->loadgen ? CT_HUNTER : client->ui.type;
+}
+
+// tick_phasestart - index the positions at the start of the tick
+//
+// This and the following tick_phase* functions are the stages of
+// tick_resolve(), run by parallel_for() over a range of client indices
+// with a TickJob as the context.
+void
+tick_phasestart(void *ctx, int begin, int end)
+{
+    TickJob *job = ctx;
+    Grid *grid = job->grid;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        SKIP_DEAD(i);
+
+        cellmap_claim(&job->tick->start, grid->clients[i].ui.pos, i);
+    }
+}
+
+// tick_phaseclaim - reject moves into allies and claim target cells
+//
+// A move into a cell held by an ally at the start of the tick is denied,
+// exactly like a collision with an ally in server_processmsg(). Every
+// other move claims its target cell for its type; of several allies
+// claiming the same cell, the one with the lowest index wins. Moves onto
+// obstacles are denied as well, and their units stay in place. Load
+// generators never share a cell: moves into any unit are denied, and
+// all of them claim cells as one type.
+void
+tick_phaseclaim(void *ctx, int begin, int end)
+{
+    TickJob *job = ctx;
+    Grid *grid = job->grid;
+    Tick *tick = job->tick;
+    Client *client;
+    Coordinate target;
+    int i, j;
+
+    for (i = begin; i < end; i++)
+    {
+        SKIP_DEAD(i);
+
+        client = &grid->clients[i];
+        target = tick->moves[i].move_request;
+        job->final[i] = client->ui.pos;
+
+        if (grid_equal(target, client->ui.pos) ||
+            grid_isobstacle(grid, target))
+            continue;
+
+        j = cellmap_get(&tick->start, target);
+        if (j >= 0 &&
+            (grid->clients[j].ui.type == client->ui.type || grid->loadgen))
+            continue;
+
+        job->final[i] = target;
+        cellmap_claim(&tick->claims[tick_claimtype(grid, client)], target, i);
+    }
+}
+
+// tick_phasemove - settle the contended cells
+//
+// Movers that lost their claim stay in place. The final cells of the
+// hunters are indexed for the capture phase.
+void
+tick_phasemove(void *ctx, int begin, int end)
+{
+    TickJob *job = ctx;
+    Grid *grid = job->grid;
+    Tick *tick = job->tick;
+    Client *client;
+    int i;
+
+    for (i = begin; i < end; i++)
+    {
+        SKIP_DEAD(i);
+
+        client = &grid->clients[i];
+
+        if (!grid_equal(job->final[i], client->ui.pos) &&
+            cellmap_get(&tick->claims[tick_claimtype(grid, client)],
+                job->final[i]) != i)
+            job->final[i] = client->ui.pos;
+
+        if (client->ui.type == CT_HUNTER)
+            cellmap_claim(&tick->hunters, job->final[i], i);
+    }
+}
+
+// tick_phasecapture - find the hunter capturing each prey
+//
+// A prey is captured by the hunter that ends the tick on the same cell,
+// or by a hunter it swapped cells with. Load generators are never
+// captured.
+void
+tick_phasecapture(void *ctx, int begin, int end)
+{
+    TickJob *job = ctx;
+    Grid *grid = job->grid;
+    Tick *tick = job->tick;
+    Client *client;
+    int i, j;
+
+    for (i = begin; i < end; i++)
+    {
+        job->captor[i] = -1;
+
+        SKIP_DEAD(i);
+
+        client = &grid->clients[i];
+        if (client->ui.type != CT_PREY || grid->loadgen)
+            continue;
+
+        j = cellmap_get(&tick->hunters, job->final[i]);
+
+        if (j < 0)
+        {
+            j = cellmap_get(&tick->start, job->final[i]);
+
+            if (j >= 0 && (grid->clients[j].ui.type != CT_HUNTER ||
+                !grid_equal(job->final[j], client->ui.pos)))
+                j = -1;
+        }
+
+        job->captor[i] = j;
+    }
+}
+
+// tick_resolve - resolve the moves of a tick in a batch
+//     tick: The resolver state, holding the submitted moves.
+//     grid: The grid, which is not modified.
+//     num_threads: The number of threads to resolve with.
+//
+// Computes the final position of every live client into tick->final,
+// and the capturing hunter of every prey (or -1) into tick->captor. The
+// outcome only depends on the grid and the submitted moves, not on the
+// arrival order of the requests or on the number of threads.
+void
+tick_resolve(Tick *tick, Grid *grid, int num_threads)
+{
+    TickJob job;
+    int n = grid->num_clients;
+
+    job.tick = tick;
+    job.grid = grid;
+    job.final = tick->final;
+    job.captor = tick->captor;
+
+    cellmap_clear(&tick->start);
+    cellmap_clear(&tick->claims[CT_HUNTER]);
+    cellmap_clear(&tick->claims[CT_PREY]);
+    cellmap_clear(&tick->hunters);
+
+    parallel_for(n, num_threads, tick_phasestart, &job);
+    parallel_for(n, num_threads, tick_phaseclaim, &job);
+    parallel_for(n, num_threads, tick_phasemove, &job);
+    parallel_for(n, num_threads, tick_phasecapture, &job);
+}
+
+// tick_resolvereference - resolve the moves of a tick, the slow way
+//     tick: The resolver state, holding the submitted moves.
+//     grid: The grid, which is not modified.
+//
+// A direct quadratic transcription of the rules implemented by the
+// tick_phase* functions, writing into tick->ref_final and
+// tick->ref_captor. Only used to check tick_resolve().
+void
+tick_resolvereference(Tick *tick, Grid *grid)
+{
+    Client *a, *b;
+    Coordinate *target;
+    char *claims;
+    int i, j, n = grid->num_clients;
+
+    target = malloc(n * sizeof(Coordinate));
+    claims = calloc(n, 1);
+
+    for (i = 0; i < n; i++)
+    {
+        SKIP_DEAD(i);
+
+        a = &grid->clients[i];
+        target[i] = tick->moves[i].move_request;
+        claims[i] = !grid_equal(target[i], a->ui.pos) &&
+            !grid_isobstacle(grid, target[i]);
+
+        for (j = 0; j < n && claims[i]; j++)
+        {
+            SKIP_DEAD(j);
+
+            b = &grid->clients[j];
+            if ((b->ui.type == a->ui.type || grid->loadgen) &&
+                grid_equal(b->ui.pos, target[i]))
+                claims[i] = 0;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        SKIP_DEAD(i);
+
+        a = &grid->clients[i];
+        tick->ref_final[i] = claims[i] ? target[i] : a->ui.pos;
+
+        for (j = 0; j < i && claims[i]; j++)
+            if (claims[j] &&
+                (grid->clients[j].ui.type == a->ui.type || grid->loadgen) &&
+                grid_equal(target[j], target[i]))
+                tick->ref_final[i] = a->ui.pos;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        tick->ref_captor[i] = -1;
+
+        SKIP_DEAD(i);
+
+        a = &grid->clients[i];
+        if (a->ui.type != CT_PREY || grid->loadgen)
+            continue;
+
+        for (j = 0; j < n; j++)
+        {
+            SKIP_DEAD(j);
+
+            b = &grid->clients[j];
+            if (b->ui.type != CT_HUNTER)
+                continue;
+
+            if (grid_equal(tick->ref_final[j], tick->ref_final[i]) ||
+                (grid_equal(b->ui.pos, tick->ref_final[i]) &&
+                grid_equal(tick->ref_final[j], a->ui.pos)))
+            {
+                tick->ref_captor[i] = j;
+                break;
+            }
+        }
+    }
+
+    free(claims);
+    free(target);
+}
+
+// tick_verify - check tick_resolve() against the reference
+//     tick: The resolver state, after tick_resolve().
+//     grid: The grid, which is not modified.
+//
+// On any difference, prints the first offending client on stderr and
+// aborts.
+void
+tick_verify(Tick *tick, Grid *grid)
+{
+    int i;
+
+    tick_resolvereference(tick, grid);
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        if (grid_equal(tick->final[i], tick->ref_final[i]) &&
+            tick->captor[i] == tick->ref_captor[i])
+            continue;
+
+        fprintf(stderr, "tick %llu: client %d resolved to (%d, %d) "
+            "captor %d, reference (%d, %d) captor %d\n",
+            (unsigned long long) tick->count, i,
+            tick->final[i].x, tick->final[i].y, tick->captor[i],
+            tick->ref_final[i].x, tick->ref_final[i].y, tick->ref_captor[i]);
+        abort();
+    }
+}
+
+// tick_denial - the result of a move that tick_resolve() denied
+//     tick: The resolver state, after tick_resolve().
+//     grid: The grid.
+//     client: The client whose move was denied.
+//
+// Moves are only denied by obstacles and allies, except between load
+// generators, which are denied by whoever held or won the cell, as in
+// server_processmsg().
+MoveResult
+tick_denial(Tick *tick, Grid *grid, Client *client)
+{
+    Coordinate target = tick->moves[client->idx].move_request;
+    int j;
+
+    if (grid_isobstacle(grid, target))
+        return MOVE_DENIED_OBSTACLE;
+
+    if (!grid->loadgen)
+        return MOVE_DENIED_ALLY;
+
+    j = cellmap_get(&tick->start, target);
+    if (j < 0)
+        j = cellmap_get(&tick->claims[CT_HUNTER], target);
+
+    return j >= 0 && grid->clients[j].ui.type != client->ui.type ?
+        MOVE_DENIED_ADV : MOVE_DENIED_ALLY;
+}
+
+// tick_apply - apply the resolved moves of a tick
+//     tick: The resolver state, after tick_resolve().
+//     grid: The grid to update.
+//     fds: Required to switch off file descriptors of killed processes.
+//
+// Moves every client to its final position; hunters that moved lose one
+// energy. Captured preys are then killed in index order and their energy
+// goes to their captor, and finally exhausted hunters are killed. This
+// follows the energy rules of server_processmsg(), and the outcome of
+// every move goes to tick->result. Updates the number of live clients
+// and returns true if the grid has changed.
+int
+tick_apply(Tick *tick, Grid *grid, struct pollfd *fds)
+{
+    Client *client, *hunter;
+    Coordinate request, from;
+    int i, grid_updated = 0;
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        client = &grid->clients[i];
+        request = tick->moves[i].move_request;
+
+        if (grid_equal(client->ui.pos, request))
+            tick->result[i] = MOVE_STAYED;
+        else if (grid_equal(tick->final[i], request))
+            tick->result[i] = MOVE_ACCEPTED;
+        else
+            tick->result[i] = tick_denial(tick, grid, client);
+
+        if (grid_equal(client->ui.pos, tick->final[i]))
+            continue;
+
+        from = client->ui.pos;
+        client->ui.pos = tick->final[i];
+        unitmap_move(grid, client, from);
+        if (client->ui.type == CT_HUNTER)
+            client->ui.energy--;
+        grid_updated = 1;
+    }
+
+    // A tick moves most units at once, so cached replies are not worth
+    // sorting out one by one.
+    if (grid_updated)
+        cache_flush(grid);
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        if (tick->captor[i] < 0)
+            continue;
+
+        hunter = &grid->clients[tick->captor[i]];
+        hunter->ui.energy += grid->clients[i].ui.energy;
+        tick->result[hunter->idx] = MOVE_CAPTURED;
+
+        server_killclient(grid, fds, &grid->clients[i]);
+        tick->num_alive--;
+        LOG("[death] %d killed by hunter %d\n", i, hunter->idx);
+        grid_updated = 1;
+    }
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        client = &grid->clients[i];
+        if (client->ui.type == CT_HUNTER && client->ui.energy <= 0)
+        {
+            server_killclient(grid, fds, client);
+            tick->num_alive--;
+            LOG("[death] hunter %d exhausted\n", i);
+            grid_updated = 1;
+        }
+    }
+
+    return grid_updated;
+}
+
+// cache_init - set up the reply cache of a grid
+//     grid: The grid, with its clients.
+//
+// Every entry starts out invalid, so the first reply of every unit is
+// computed in full. The radius grows until the diamond of cells within it
+// holds CACHE_REACH adversaries at the density of the map, or would span
+// more cells than there are units.
+void
+cache_init(Grid *grid)
+{
+    double area = (double) grid->mapsize.x * grid->mapsize.y;
+    double n = grid->num_clients, cells;
+    int r = 1;
+
+    grid->cache = grid_alloc(grid, grid->num_clients * sizeof(CacheEntry));
+
+    while (1)
+    {
+        cells = 2.0 * r * (r + 1) + 1;
+        if (cells * n / 2 >= CACHE_REACH * area ||
+            2.0 * (r + 1) * (r + 2) + 1 > n)
+            break;
+        r++;
+    }
+
+    grid->cache_radius = r;
+}
+
+// cache_lookup - fill a reply from the cache
+//     grid: The grid.
+//     client: The client the reply is for.
+//     msg: The reply, with its position set.
+//
+// The nearest adversary and the neighboring objects are taken from the
+// entry of the client where they are valid, and computed and stored
+// where not. A valid entry answers in constant time instead of a pass
+// over all units.
+void
+cache_lookup(Grid *grid, Client *client, ServerMsg *msg)
+{
+    CacheEntry *entry = &grid->cache[client->idx];
+
+    if (entry->adv_valid)
+        grid->cache_stats.adv_hits++;
+    else
+    {
+        grid->cache_stats.adv_misses++;
+        cache_scanadv(grid, client, entry);
+    }
+
+    if (entry->objects_valid)
+        grid->cache_stats.object_hits++;
+    else
+    {
+        grid->cache_stats.object_misses++;
+        server_clientobjects(entry->object_pos, &entry->object_count, grid,
+            client);
+        entry->objects_valid = 1;
+    }
+
+    msg->adv_pos = entry->adv_pos;
+    msg->object_count = entry->object_count;
+    memcpy(msg->object_pos, entry->object_pos,
+        entry->object_count * sizeof(Coordinate));
+}
+
+// cache_scanadv - compute the nearest adversary of a cache entry
+//     grid: The grid.
+//     client: The client of the entry.
+//     entry: The entry to fill.
+//
+// The same pass as server_clientnearestadvidx(), which also finds the
+// distance of the runner-up for the bound. An adversary beyond the cache
+// radius is found, but not kept.
+void
+cache_scanadv(Grid *grid, Client *client, CacheEntry *entry)
+{
+    ClientType adv_type = server_clientadvtype(client);
+    int i, distance;
+
+    entry->adv_idx = -1;
+    entry->adv_pos.x = entry->adv_pos.y = -1;
+    entry->adv_distance = INT_MAX;
+    entry->adv_bound = INT_MAX;
+
+    for (i = 0; i < grid->num_clients; i++)
+    {
+        SKIP_DEAD(i);
+
+        if (adv_type != grid->clients[i].ui.type)
+            continue;
+
+        distance = grid_distance(client->ui.pos, grid->clients[i].ui.pos);
+
+        if (distance < entry->adv_distance)
+        {
+            entry->adv_bound = entry->adv_distance;
+            entry->adv_distance = distance;
+            entry->adv_idx = i;
+        }
+        else if (distance < entry->adv_bound)
+            entry->adv_bound = distance;
+    }
+
+    if (entry->adv_bound > grid->cache_radius + 1)
+        entry->adv_bound = grid->cache_radius + 1;
+
+    if (entry->adv_idx >= 0)
+        entry->adv_pos = grid->clients[entry->adv_idx].ui.pos;
+
+    // Units never come back, so no adversary stays none.
+    entry->adv_valid = entry->adv_idx < 0 ||
+        entry->adv_distance < entry->adv_bound;
+}
+
+// cache_dropobjects - invalidate the objects of the units next to a cell
+//     grid: The grid.
+//     c: The cell.
+//     mover: Only the allies of this unit, or NULL for every unit.
+void
+cache_dropobjects(Grid *grid, Coordinate c, Client *mover)
+{
+    Coordinate neighbors[4];
+    int num_neighbors, i, j;
+
+    grid_neighbors(neighbors, &num_neighbors, grid->mapsize, c);
+
+    for (i = 0; i < num_neighbors; i++)
+        for (j = unitmap_first(grid, neighbors[i]); j >= 0;
+             j = grid->units.next[j])
+            if (!mover || grid->clients[j].ui.type == mover->ui.type)
+                grid->cache[j].objects_valid = 0;
+}
+
+// cache_updateadv - update a nearest adversary after a move
+//     entry: The entry, which is valid.
+//     other: The unit of the entry, an adversary of the mover.
+//     client: The unit that moved, already at its new position.
+//
+// The mover becomes the nearest adversary if it came closer than the one
+// cached, and stays it while it is below the bound. Only the entries that
+// could tie are dropped.
+void
+cache_updateadv(CacheEntry *entry, Client *other, Client *client)
+{
+    int distance = grid_distance(other->ui.pos, client->ui.pos);
+
+    if (entry->adv_idx == client->idx)
+    {
+        entry->adv_pos = client->ui.pos;
+        entry->adv_distance = distance;
+        entry->adv_valid = distance < entry->adv_bound;
+    }
+    else if (distance < entry->adv_distance ||
+        (distance == entry->adv_distance && client->idx < entry->adv_idx))
+    {
+        entry->adv_bound = entry->adv_distance;
+        entry->adv_idx = client->idx;
+        entry->adv_pos = client->ui.pos;
+        entry->adv_distance = distance;
+    }
+    else if (distance < entry->adv_bound)
+        entry->adv_bound = distance;
+}
+
+// cache_move - invalidate what a move changes
+//     grid: The grid.
+//     client: The unit that moved, already at its new position.
+//     from: Its position before the move.
+//
+// Allies next to either end of the move lose their objects, and so does
+// the unit itself. Nearest adversaries are kept up to date rather than
+// dropped wherever the bound tells the answer: a step brings every other
+// adversary at most one closer, so the unit keeps its own nearest
+// adversary while that stays below the lowered bound. The adversaries of
+// the unit are updated by cache_updateadv(). Since their bound is at
+// most the radius plus one, those whose entry the move can change are
+// within that distance of the new cell, and are found in the unit index:
+// a move costs the cells of that diamond rather than a pass over all
+// units.
+void
+cache_move(Grid *grid, Client *client, Coordinate from)
+{
+    Coordinate to = client->ui.pos, c;
+    CacheEntry *entry;
+    Client *other;
+    int r, x, y, w, i;
+
+    if (!grid->cache || grid_equal(from, to))
+        return;
+
+    entry = &grid->cache[client->idx];
+    entry->objects_valid = 0;
+
+    if (entry->adv_valid && entry->adv_idx >= 0)
+    {
+        if (entry->adv_bound != INT_MAX)
+            entry->adv_bound--;
+
+        entry->adv_distance = grid_distance(to, entry->adv_pos);
+        entry->adv_valid = entry->adv_distance < entry->adv_bound;
+    }
+
+    cache_dropobjects(grid, from, client);
+    cache_dropobjects(grid, to, client);
+
+    r = grid->cache_radius + 1;
+
+    for (x = to.x > r ? to.x - r : 0;
+         x <= to.x + r && x < grid->mapsize.y; x++)
+    {
+        w = r - abs(x - to.x);
+        c.x = x;
+
+        for (y = to.y > w ? to.y - w : 0;
+             y <= to.y + w && y < grid->mapsize.x; y++)
+        {
+            c.y = y;
+
+            for (i = unitmap_first(grid, c); i >= 0; i = grid->units.next[i])
+            {
+                other = &grid->clients[i];
+                entry = &grid->cache[i];
+
+                if (other->ui.type != client->ui.type && entry->adv_valid)
+                    cache_updateadv(entry, other, client);
+            }
+        }
+    }
 }
 
-// grid_fromfmt - parse a grid from standard input
+// cache_kill - invalidate what a death changes
+//     grid: The grid.
+//     client: The unit that died, already marked dead.
 //
-// Allocates and populates the necessary memory space for the grid,
-// using the values parsed from the standard input. The format is defined
-// in the homework text.
-Grid *
-grid_fromfmt(void)
+// Allies next to the unit lose their objects, and adversaries whose
+// nearest adversary it was lose that. Those are within the cache radius
+// of the unit, see cache_move().
+void
+cache_kill(Grid *grid, Client *client)
 {
-    Client client;
-    const char *fmt_coord = "%d %d";
-    const char *fmt_quantity = "%d";
-    const char *fmt_unit = "%d %d %d";
-    Coordinate coord;
-    Grid *grid;
-    int a, b, c, i;
-    UnitInfo ui;
+    Coordinate pos = client->ui.pos, c;
+    int r, x, y, w, i;
 
-    grid = malloc(sizeof(Grid));
+    if (!grid->cache)
+        return;
 
-    // <width> <height>
-    scanf(fmt_coord, &a, &b);
-    grid->mapsize.x = a;
-    grid->mapsize.y = b;
+    cache_dropobjects(grid, pos, client);
 
-    // <num_obstacles>
-    scanf(fmt_quantity, &a);
-    grid->num_obstacles = a;
-    grid->obstacles = malloc(a * sizeof(Coordinate));
+    r = grid->cache_radius;
 
-    // <x> <y>
-    for (i = 0; i < grid->num_obstacles; i++)
+    for (x = pos.x > r ? pos.x - r : 0;
+         x <= pos.x + r && x < grid->mapsize.y; x++)
     {
-        scanf(fmt_coord, &a, &b);
-        coord.x = a;
-        coord.y = b;
-        grid->obstacles[i] = coord;
-    }
-    
-    // <num_hunters>
-    scanf(fmt_quantity, &a);
-    grid->num_clients = a;
-    grid->clients = malloc(a * sizeof(Client));
+        w = r - abs(x - pos.x);
+        c.x = x;
 
-    // <x> <y> <energy>
-    for (i = 0; i < grid->num_clients; i++)
-    {
-        scanf(fmt_unit, &a, &b, &c);
-        coord.x = a;
-        coord.y = b;
-        ui.type = CT_HUNTER;
-        ui.pos = coord;
-        ui.energy = c;
-        ui.alive = 1;
-        client.ui = ui;
-        grid->clients[i] = client;
+        for (y = pos.y > w ? pos.y - w : 0;
+             y <= pos.y + w && y < grid->mapsize.x; y++)
+        {
+            c.y = y;
+
+            for (i = unitmap_first(grid, c); i >= 0; i = grid->units.next[i])
+                if (grid->cache[i].adv_idx == client->idx)
+                    grid->cache[i].adv_valid = 0;
+        }
     }
-    
-    // <num_preys>
-    scanf(fmt_quantity, &a);
-    grid->num_clients += a;
-    grid->clients = realloc(grid->clients,
-        grid->num_clients * sizeof(Client));
-    
-    // <x> <y> <energy>
-    for (; i < grid->num_clients; i++)
-    {
-        scanf(fmt_unit, &a, &b, &c);
-        coord.x = a;
-        coord.y = b;
-        ui.type = CT_PREY;
-        ui.pos = coord;
-        ui.energy = c;
-        ui.alive = 1;
-        client.ui = ui;
-        grid->clients[i] = client;
-    }
-            
-    return grid;
 }
 
-// grid_neighbors - the neighboring cells of a cell
-//     buf: A preallocated array of Coordinates to fill with the result.
-//     num_neighbors: An integer to hold the number of neighbors found.
-//     mapsize: The size of the map.
-//     pos: The cell to search whose neighboring cells.
+// cache_obstacle - invalidate what an obstacle change changes
+//     grid: The grid.
+//     c: The cell whose obstacle was added or removed.
+//
+// Units next to the cell lose their objects.
 void
-grid_neighbors(Coordinate *buf, int *num_neighbors, Coordinate mapsize,
-    Coordinate pos)
+cache_obstacle(Grid *grid, Coordinate c)
 {
-    Coordinate coord;
-    int width = mapsize.x, height = mapsize.y, i = 0;
+    if (!grid->cache)
+        return;
 
-    // Top cell
-    coord.x = pos.x + 1;
-    coord.y = pos.y;
-    if (coord.x < height)
-    {
-        buf[i] = coord;
-        i++;
-    }
+    cache_dropobjects(grid, c, NULL);
+}
 
-    // Left cell
-    coord.x = pos.x;
-    coord.y = pos.y - 1;
-    if (coord.y >= 0)
-    {
-        buf[i] = coord;
-        i++;
-    }
-    
-    // Bottom cell
-    coord.x = pos.x - 1;
-    coord.y = pos.y;
-    if (coord.x >= 0)
-    {
-        buf[i] = coord;
-        i++;
-    }
-    
-    // Right cell
-    coord.x = pos.x;
-    coord.y = pos.y + 1;
-    if (coord.y < width)
+// cache_flush - invalidate the whole reply cache
+//     grid: The grid.
+void
+cache_flush(Grid *grid)
+{
+    int i;
+
+    if (!grid->cache)
+        return;
+
+    for (i = 0; i < grid->num_clients; i++)
     {
-        buf[i] = coord;
-        i++;
+        grid->cache[i].adv_valid = 0;
+        grid->cache[i].objects_valid = 0;
     }
-
-    *num_neighbors = i;
 }
 
-// grid_print - print a grid to standard output
-//     grid: The grid to print.
+// path_init - build the cluster graph of the pathfinding service
+//     grid: The grid, with its obstacles.
+//     budget_ns: The longest the graph may take to build.
+//     latency_ns: The longest a query may search for a full path, 0 for
+//                 no limit.
+//     num_threads: The threads to build the clusters with.
 //
-// Prints a grid to the standard output. The format is specified in the
-// homework text.
+// The map is split into clusters, and the entrances between them found
+// from the obstacles; every node then gets the distances to the others of
+// its cluster. Queries search this graph instead of the cells, see
+// path_next(). The obstacles are sorted into the bitmaps of the clusters
+// in one pass over them. The nodes of every cluster are then counted, so
+// that all of them and their distances fit in two blocks, and filled in,
+// both one cluster at a time in parallel. The service stays off on maps
+// with too many clusters and if the graph takes over budget, and hunters
+// keep to their greedy moves.
 void
-grid_print(Grid *grid)
+path_init(Grid *grid, uint64_t budget_ns, uint64_t latency_ns,
+    int num_threads)
 {
-    Coordinate c;
-    int i, j, k;
+    PathGraph *graph;
+    PathCluster *cluster;
+    PathNode *nodes;
+    PathJob job;
+    uint16_t *dist;
+    size_t num_nodes = 0, num_dist = 0;
+    int c;
+
+    graph = grid_alloc(grid, sizeof(PathGraph));
+    graph->size.x = (grid->mapsize.y + PATH_CLUSTER - 1) / PATH_CLUSTER;
+    graph->size.y = (grid->mapsize.x + PATH_CLUSTER - 1) / PATH_CLUSTER;
+    graph->latency_ns = latency_ns;
+
+    if ((uint64_t) graph->size.x * graph->size.y > PATH_MAXCLUSTERS)
+    {
+        fprintf(stderr, "pathfinding is off: the map has more than %d "
+            "clusters\n", PATH_MAXCLUSTERS);
+        return;
+    }
+
+    graph->num_clusters = graph->size.x * graph->size.y;
+    graph->clusters = grid_alloc(grid,
+        graph->num_clusters * sizeof(PathCluster));
+    graph->stats.latency = grid_alloc(grid, sizeof(Histogram));
+    grid->path = graph;
 
-    // Top left plus
-    putchar('+');
+    job.grid = grid;
+    job.start = clock_nsec();
+    job.budget_ns = budget_ns;
+    job.over = 0;
 
-    // Top edge
-    for (i = 0; i < grid->mapsize.x; i++)
-        putchar('-');
+    for (c = 0; c < grid->num_obstacles; c++)
+        path_setblocked(graph, grid->obstacles[c], 1);
 
-    // Top right plus
-    putchar('+');
+    parallel_for(graph->num_clusters, num_threads, path_phasecount, &job);
 
-    // End of first line
-    putchar('\n');
+    for (c = 0; c < graph->num_clusters && !job.over; c++)
+    {
+        cluster = &graph->clusters[c];
+        num_nodes += cluster->cap;
+        num_dist += cluster->cap * cluster->cap;
+    }
 
-    for (i = 0; i < grid->mapsize.y; i++)
+    if (!job.over)
     {
-        // Left edge
-        putchar('|');
+        nodes = grid_alloc(grid, num_nodes * sizeof(PathNode));
+        dist = grid_alloc(grid, num_dist * sizeof(uint16_t));
 
-        for (j = 0; j < grid->mapsize.x; j++)
+        for (c = 0; c < graph->num_clusters; c++)
         {
-            c.x = i;
-            c.y = j;
+            cluster = &graph->clusters[c];
+            cluster->nodes = nodes;
+            cluster->dist = dist;
+            nodes += cluster->cap;
+            dist += cluster->cap * cluster->cap;
+        }
 
-            for (k = 0; k < grid->num_obstacles; k++)
-                if (grid_equal(c, grid->obstacles[k]))
-                {
-                    putchar('X'); // Obstacle
-                    goto found;
-                }
+        parallel_for(graph->num_clusters, num_threads, path_phasebuild,
+            &job);
+    }
 
-            for (k = 0; k < grid->num_clients; k++)
-            {
-                SKIP_DEAD(k);
+    graph->build_ns = clock_nsec() - job.start;
 
-                if (grid_equal(c, grid->clients[k].ui.pos))
-                {
-                    if (grid->clients[k].ui.type == CT_HUNTER)
-                    {
-                        putchar('H'); // Hunter
-                        goto found;
-                    }
-                    else
-                    {
-                        putchar('P'); // Prey
-                        goto found;
-                    }
-                }
-            }
+    if (job.over)
+    {
+        fprintf(stderr, "pathfinding is off: the graph took over %.3f s "
+            "to build\n", budget_ns / 1e9);
+        grid->path = NULL;
+        return;
+    }
 
-            // No object was found at coordinate.
-            putchar(' ');
+    // Every node is pushed at most once per edge into it, but far fewer
+    // in practice; the heap grows if it has to.
+    graph->num_nodes = num_nodes;
+    graph->open_cap = num_nodes + PATH_MAXNODES;
+    graph->open = grid_alloc(grid, graph->open_cap * sizeof(PathOpen));
+}
 
-found: // Found an item to print, so skip to the next coordinate.
-            ;
-        }
+// path_cluster - the cluster of a cell
+//     graph: The cluster graph.
+//     c: The cell.
+int
+path_cluster(PathGraph *graph, Coordinate c)
+{
+    return c.x / PATH_CLUSTER * graph->size.y + c.y / PATH_CLUSTER;
+}
 
-        // Right edge
-        putchar('|');
-        putchar('\n');
-    }
-    
-    // Bottom left plus
-    putchar('+');
+// path_bounds - the cells of a cluster
+//     grid: The grid.
+//     c: The cluster.
+//     lo: Set to its first cell.
+//     extent: Set to its number of rows (x) and columns (y), less than
+//             PATH_CLUSTER at the bottom and right of the map.
+void
+path_bounds(Grid *grid, int c, Coordinate *lo, Coordinate *extent)
+{
+    lo->x = c / grid->path->size.y * PATH_CLUSTER;
+    lo->y = c % grid->path->size.y * PATH_CLUSTER;
+    extent->x = grid->mapsize.y - lo->x < PATH_CLUSTER ?
+        grid->mapsize.y - lo->x : PATH_CLUSTER;
+    extent->y = grid->mapsize.x - lo->y < PATH_CLUSTER ?
+        grid->mapsize.x - lo->y : PATH_CLUSTER;
+}
 
-    // Bottom edge
-    for (i = 0; i < grid->mapsize.x; i++)
-        putchar('-');
+// path_border - a cell on the border of a cluster
+//     lo: The first cell of the cluster.
+//     extent: Its size.
+//     dir: The side: 0 for the top, 1 for the bottom, 2 for the left and 3
+//          for the right.
+//     i: The column or row along the side.
+Coordinate
+path_border(Coordinate lo, Coordinate extent, int dir, int i)
+{
+    Coordinate c;
 
-    // Bottom right plus
-    putchar('+');
+    c.x = dir == 0 ? lo.x : dir == 1 ? lo.x + extent.x - 1 : lo.x + i;
+    c.y = dir == 2 ? lo.y : dir == 3 ? lo.y + extent.y - 1 : lo.y + i;
 
-    // End of last line
-    putchar('\n');
-    fflush(stdout);
+    return c;
+}
 
-#ifdef DEBUG
-    for (i = 0; i < grid->num_clients; i++)
+// path_across - the neighbor of a cell in a direction
+//     c: The cell.
+//     dir: As for path_border(); dir ^ 1 is the opposite direction.
+Coordinate
+path_across(Coordinate c, int dir)
+{
+    switch (dir)
     {
-        SKIP_DEAD(i);
-
-        LOG("client %d of type %d at (%d, %d), energy = %d\n",
-                i,
-                grid->clients[i].ui.type,
-                grid->clients[i].ui.pos.x,
-                grid->clients[i].ui.pos.y,
-                grid->clients[i].ui.energy
-        );
+    case 0:
+        c.x--;
+        break;
+    case 1:
+        c.x++;
+        break;
+    case 2:
+        c.y--;
+        break;
+    default:
+        c.y++;
     }
-#endif
+
+    return c;
 }
 
-// ipc_createpipe - create a bidirectional pipe
-//     fd: A two-element array of file descriptors to set.
-//
-// Creates a socket that acts similarly to a bidirectional pipe. Stores
-// the file descriptors in the variable fd.
-int
-ipc_createpipe(int *fd)
+// path_node - a node of the cluster graph
+//     graph: The cluster graph.
+//     id: The id of the node.
+PathNode *
+path_node(PathGraph *graph, int id)
 {
-    return socketpair(AF_UNIX, SOCK_STREAM, PF_UNIX, fd);
+    return &graph->clusters[id / PATH_MAXNODES].nodes[id % PATH_MAXNODES];
 }
 
-// ipc_packintarg - pack an integer into a string argument
-//     buf: The preallocated string buffer to fill.
-//     arg: The integer to convert into a string.
-//
-// Takes an integer and returns a string containing the integer.
-// Required for executing child processes with integer arguments.
+// path_isblocked - check for an obstacle in the bitmap of its cluster
+//     graph: The cluster graph.
+//     c: The cell.
 int
-ipc_packintarg(char *buf, int arg)
+path_isblocked(PathGraph *graph, Coordinate c)
 {
-    sprintf(buf, "%d", arg);
-}
+    PathCluster *cluster = &graph->clusters[path_cluster(graph, c)];
+    int i = c.x % PATH_CLUSTER * PATH_CLUSTER + c.y % PATH_CLUSTER;
 
-// ipc_closeclientend - close the client end of a bidirectional pipe
-//     fd: The file descriptor pair.
-//
-// Takes a bidirectional pipe, and (locally) closes the client end
-// of the pipe, so that other processes do not inherit it when forking.
-void
-ipc_closeclientend(int *fd)
-{
-    close(fd[1]);
+    return cluster->blocked[i / 64] >> (i % 64) & 1;
 }
 
-// ipc_execclient - executes the client processes
-//     type: Hunter or prey.
-//     mapsize: The size of the map.
-//
-// Packs the map size into string arguments and calls the correct
-// executable for the client process.
+// path_setblocked - put an obstacle in the bitmap of its cluster, or not
+//     graph: The cluster graph.
+//     c: The cell.
+//     blocked: Whether it holds an obstacle.
 void
-ipc_execclient(ClientType type, Coordinate mapsize)
+path_setblocked(PathGraph *graph, Coordinate c, int blocked)
 {
-    char arg1[32], arg2[32];
-
-    ipc_packintarg(arg1, mapsize.x);
-    ipc_packintarg(arg2, mapsize.y);
+    PathCluster *cluster = &graph->clusters[path_cluster(graph, c)];
+    int i = c.x % PATH_CLUSTER * PATH_CLUSTER + c.y % PATH_CLUSTER;
 
-    if (type == CT_HUNTER)
-        execl("./hunter", "hunter", arg1, arg2, (char *) NULL);
+    if (blocked)
+        cluster->blocked[i / 64] |= 1ULL << (i % 64);
     else
-        execl("./prey", "prey", arg1, arg2, (char *) NULL);
+        cluster->blocked[i / 64] &= ~(1ULL << (i % 64));
+}
 
-    perror("execl"); // execel returns only on error
-    _exit(EXIT_FAILURE);
+// path_local - the index of a cell in the search of its cluster
+//     lo: The first cell of the cluster.
+//     c: The cell.
+int
+path_local(Coordinate lo, Coordinate c)
+{
+    return (c.x - lo.x + 1) * PATH_STRIDE + c.y - lo.y + 1;
 }
 
-// ipc_redirstdio - redirect stdio to socket
-//     fd: The file descriptor pair.
-//
-// Redirects standard input and output to the specified socket.
+// path_load - unpack the obstacles of a cluster
+//     grid: The grid.
+//     c: The cluster.
+//     blocked: Room for PATH_CELLS cells, set to whether each cell holds
+//              an obstacle, by path_local(). The cells around the cluster
+//              are all blocked.
 void
-ipc_redirstdio(int *fd)
+path_load(Grid *grid, int c, unsigned char *blocked)
 {
-    dup2(fd[1], 0);
-    dup2(fd[1], 1);
+    PathCluster *cluster = &grid->path->clusters[c];
+    Coordinate lo, extent;
+    int r, col, i;
+
+    path_bounds(grid, c, &lo, &extent);
+    memset(blocked, 1, PATH_CELLS);
+
+    for (r = 0; r < extent.x; r++)
+        for (col = 0; col < extent.y; col++)
+        {
+            i = r * PATH_CLUSTER + col;
+            blocked[(r + 1) * PATH_STRIDE + col + 1] =
+                cluster->blocked[i / 64] >> (i % 64) & 1;
+        }
 }
 
-// ipc_setcloexec - mark file descriptors with close-on-exec
-//     fd: The file descriptor pair.
+// path_entrances - find the entrances of a cluster
+//     grid: The grid.
+//     c: The cluster.
+//     blocked: Set by path_load().
+//     nodes: Room for PATH_MAXNODES nodes, set to those of the cluster.
 //
-// Marks both ends of the specified file descriptor pair with the
-// close-on-exec flag, so that they are not inherited when client
-// processes are launched.
-void
-ipc_setcloexec(int *fd)
+// Returns the number of nodes. The clusters on both sides of a border see
+// the same runs of free cells facing each other, so their nodes pair up.
+int
+path_entrances(Grid *grid, int c, unsigned char *blocked, PathNode *nodes)
 {
-    fcntl(fd[0], F_SETFD, FD_CLOEXEC);
-    fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+    Coordinate lo, extent, cell, across;
+    int dir, len, run, open, i, n = 0;
+
+    path_load(grid, c, blocked);
+    path_bounds(grid, c, &lo, &extent);
+
+    for (dir = 0; dir < 4; dir++)
+    {
+        if (!grid_onmap(grid, path_across(path_border(lo, extent, dir, 0),
+            dir)))
+            continue;
+
+        len = dir < 2 ? extent.y : extent.x;
+
+        for (i = 0, run = 0; i <= len; i++)
+        {
+            open = 0;
+
+            if (i < len)
+            {
+                cell = path_border(lo, extent, dir, i);
+                across = path_across(cell, dir);
+                open = !blocked[path_local(lo, cell)] &&
+                    !path_isblocked(grid->path, across);
+            }
+
+            if (open)
+            {
+                run++;
+                continue;
+            }
+
+            if (run > 0)
+            {
+                memset(&nodes[n], 0, sizeof(PathNode));
+                nodes[n].cell = path_border(lo, extent, dir,
+                    i - run + (run - 1) / 2);
+                nodes[n].dir = dir;
+                n++;
+            }
+
+            run = 0;
+        }
+    }
+
+    return n;
 }
 
-// server_main - the main loop of the server process
-//
-// This function is responsible for initializing the grid, the clients,
-// forking the clients, and setting up the file descriptors. After all
-// these tasks have been completed, it will send initial messages to
-// all client messages and enter an event loop. Inside this event loop,
-// it will read requests from ready clients and serve their requests,
-// signaling other processes as required. The loop continues until
-// one type of adversaries have been defeated.
+// path_search - breadth-first search of a cluster
+//     blocked: Set by path_load().
+//     start: The cell to start from, by path_local().
+//     dist: Set to the distance of every cell from start, or
+//           PATH_UNREACHABLE.
+//     prev: Set to the previous cell of every reached cell on the way
+//           from start.
 void
-server_main(void)
+path_search(unsigned char *blocked, int start, uint16_t *dist,
+    uint16_t *prev)
 {
-    ClientMsg msgin;
-    Grid *grid;
-    int i, grid_updated = 0;
-    ServerMsg msgout;
-    struct pollfd *fds;
+    static const int step[4] = {-PATH_STRIDE, PATH_STRIDE, -1, 1};
+    uint16_t queue[PATH_CELLS];
+    int head = 0, tail = 0, i, j, k;
 
-    // Parse and print the grid.
-    grid = grid_fromfmt();
-    grid_print(grid);
+    memset(dist, 0xff, PATH_CELLS * sizeof(uint16_t));
 
-    // Allocate the file descriptor table for polling.
-    fds = malloc(grid->num_clients * sizeof(struct pollfd));
+    dist[start] = 0;
+    prev[start] = start;
+    queue[tail++] = start;
 
-    for (i = 0; i < grid->num_clients; i++)
+    while (head < tail)
     {
-        // Fork a new client process.
-        server_forkclient(&grid->clients[i], grid->mapsize);
+        i = queue[head++];
 
-        // We assign an unique index to every client process, this helps
-        // us in a few different ways we'll see later.
-        grid->clients[i].idx = i;
+        for (k = 0; k < 4; k++)
+        {
+            j = i + step[k];
 
-        // Prepare and send the initial message for the client process.
-        msgout = servermsg_new(grid, &grid->clients[i]);
-        servermsg_send(&grid->clients[i], msgout);
+            if (blocked[j] || dist[j] != PATH_UNREACHABLE)
+                continue;
 
-        // Save the file descriptors into the table data structure.
-        // We are interested in the POLLIN event of each file descriptor.
-        fds[i].fd = grid->clients[i].fd;
-        fds[i].events = POLLIN;
+            dist[j] = dist[i] + 1;
+            prev[j] = i;
+            queue[tail++] = j;
+        }
+    }
+}
+
+// path_sweep - distances between the nodes of a cluster
+//     blocked: Set by path_load().
+//     lo: The first cell of the cluster.
+//     extent: Its size.
+//     nodes: Its nodes.
+//     n: The number of nodes.
+//     dist: Set to the distance between every two nodes, n by n, or
+//           PATH_UNREACHABLE.
+//
+// A breadth-first search from every node, which moves the whole frontier
+// by one step at a time, a row of the cluster per word. This takes no
+// branches on the cells, unlike path_search(). Distances are symmetric,
+// so every search stops once it has reached the nodes after its own.
+void
+path_sweep(unsigned char *blocked, Coordinate lo, Coordinate extent,
+    PathNode *nodes, int n, uint16_t *dist)
+{
+    uint32_t free[PATH_STRIDE], reached[PATH_STRIDE];
+    uint32_t frontier[PATH_STRIDE], above, here, next, any;
+    int row[PATH_MAXNODES], col[PATH_MAXNODES];
+    int i, j, r, c, level, left;
+
+    memset(free, 0, sizeof(free));
+
+    for (r = 0; r < extent.x; r++)
+        for (c = 0; c < extent.y; c++)
+            free[r + 1] |= (uint32_t) !blocked[(r + 1) * PATH_STRIDE + c + 1]
+                << c;
+
+    for (j = 0; j < n; j++)
+    {
+        row[j] = nodes[j].cell.x - lo.x + 1;
+        col[j] = nodes[j].cell.y - lo.y;
     }
 
-    // This is the main loop of the server.
-    while (!server_isstable(grid))
+    for (i = 0; i < n; i++)
     {
-        poll(fds, grid->num_clients, POLL_NOTIMEOUT);
+        memset(frontier, 0, sizeof(frontier));
+        frontier[row[i]] = 1u << col[i];
+        memcpy(reached, frontier, sizeof(reached));
+        dist[i * n + i] = 0;
+
+        // A corner cell has a node on either side.
+        for (j = i + 1, left = 0; j < n; j++)
+        {
+            if (row[j] == row[i] && col[j] == col[i])
+                dist[i * n + j] = dist[j * n + i] = 0;
+            else
+            {
+                dist[i * n + j] = dist[j * n + i] = PATH_UNREACHABLE;
+                left++;
+            }
+        }
 
-        for (i = 0; i < grid->num_clients; i++)
+        for (level = 1; left > 0; level++)
         {
-            SKIP_DEAD(i);
+            above = 0;
+            any = 0;
 
-            if (CLIENT_RDY(i))
+            for (r = 1; r <= extent.x; r++)
             {
-                msgin = clientmsg_recv(&grid->clients[i]);
-                server_processmsg(&grid_updated, fds, grid,
-                    &grid->clients[i], msgin);
-
-                // We check that the process is still alive before
-                // dispatching a response, because server_processmsg
-                // may have killed it in some scenarios.
-                if (server_clientalive(&grid->clients[i]))
-                {
-                    msgout = servermsg_new(grid, &grid->clients[i]);
-                    servermsg_send(&grid->clients[i], msgout);
-                }
+                here = frontier[r];
+                next = (here << 1 | here >> 1 | above | frontier[r + 1]) &
+                    free[r] & ~reached[r];
+                above = here;
+                frontier[r] = next;
+                reached[r] |= next;
+                any |= next;
+            }
+
+            if (!any)
+                break;
 
-                // Update the grid if necessary.
-                if (grid_updated)
+            for (j = i + 1; j < n; j++)
+                if (frontier[row[j]] >> col[j] & 1)
                 {
-                    grid_print(grid);
-                    grid_updated = 0;
+                    dist[i * n + j] = dist[j * n + i] = level;
+                    left--;
                 }
-            }
         }
     }
+}
 
-    // Take no prisoners -- kill all the remaining processes.
-    for (i = 0; i < grid->num_clients; i++)
-    {
-        SKIP_DEAD(i);
+// path_buildcluster - compute the nodes of a cluster and their distances
+//     grid: The grid.
+//     c: The cluster.
+//
+// Returns 0, leaving the cluster as it was, if it has no room for its
+// nodes, and 1 otherwise. Only touches the cluster itself, so clusters
+// can be built in parallel.
+int
+path_buildcluster(Grid *grid, int c)
+{
+    PathCluster *cluster = &grid->path->clusters[c];
+    PathNode nodes[PATH_MAXNODES];
+    unsigned char blocked[PATH_CELLS];
+    Coordinate lo, extent;
+    int n;
 
-        fds[i].fd = -1;
-        server_killclient(&grid->clients[i]);
-        LOG("[death] %d survived until the end\n", i);
-    }
+    n = path_entrances(grid, c, blocked, nodes);
+    if (n > cluster->cap)
+        return 0;
 
-    free(fds);
-    grid_destroy(grid);
+    path_bounds(grid, c, &lo, &extent);
+    path_sweep(blocked, lo, extent, nodes, n, cluster->dist);
 
-    LOG("[server] exiting gracefully\n");
-    exit(EXIT_SUCCESS);
+    memcpy(cluster->nodes, nodes, n * sizeof(PathNode));
+    cluster->num_nodes = n;
+
+    return 1;
 }
 
-// server_processmsg - process move requests
-//     grid_updated: Set to 1 if the grid is updated.
-//     fds: Required to switch off file descriptors of killed processes.
-//     grid: The grid containing the information of all clients.
-//     client: The client who triggered this function.
-//     msg: The move request to process.
-//
-// Processes a client message. Checks for collisions, deaths due to
-// collisions or the exhaustion of energy, transfers energy from preys to
-// hunters on their death, updates the coordinates of the clients.
+// path_phasecount - count the nodes of a range of clusters
+//     ctx: The PathJob.
+//     begin: The first cluster.
+//     end: One past the last cluster.
 //
-// This function also handles the killing of processes. When a process
-// is killed in server_processmsg, server_killclient is called and the
-// file descriptor is closed. Here, we switch off the value in the
-// polling table to prevent socket errors.
-void server_processmsg(int *grid_updated, struct pollfd *fds,
-    Grid *grid, Client *client, ClientMsg msg)
+// Sets the room of every cluster to its number of nodes.
+void
+path_phasecount(void *ctx, int begin, int end)
 {
-    ClientType type, adv_type;
-    Coordinate coord;
-    int i, energy;
-
-    coord = msg.move_request;
-    type = client->ui.type;
-    adv_type = server_clientadvtype(client);
+    PathJob *job = ctx;
+    PathNode nodes[PATH_MAXNODES];
+    unsigned char blocked[PATH_CELLS];
+    int c;
 
-    for (i = 0; i < grid->num_clients; i++)
+    for (c = begin; c < end; c++)
     {
-        SKIP_DEAD(i);
-
-        if (grid_equal(coord, grid->clients[i].ui.pos))
+        if (__atomic_load_n(&job->over, __ATOMIC_RELAXED) ||
+            clock_nsec() - job->start > job->budget_ns)
         {
-            // Types are equal => this is a collision with an ally.
-            // This move is not allowed, so the request is denied.
-            if (type == grid->clients[i].ui.type)
-            {
-                *grid_updated = 0;
-                return;
-            }
-            else
-            {
-                // This is a collision of a hunter into a prey.
-                // The prey shall be killed, and the hunter will gain
-                // its energy. We still have to check if the hunter has
-                // positive energy, as the prey can theoretically have
-                // a negative or zero energy.
-                if (type == CT_HUNTER)
-                {
-                    client->ui.pos = msg.move_request;
-                    client->ui.energy--;
-                    energy = grid->clients[i].ui.energy;
-                    client->ui.energy += energy;
-
-                    if (client->ui.energy <= 0)
-                    {
-                        fds[client->idx].fd = -1;
-                        server_killclient(client);
-                        LOG("[death] hunter %d exhausted\n", client->idx);
-                    }
-
-                    fds[i].fd = -1;
-                    server_killclient(&grid->clients[i]);
-                    LOG("[death] %d killed by hunter %d\n", i, client->idx);
-
-                    *grid_updated = 1;
-                    return;
-                }
-                else
-                {
-                    // This (unfortunate) case occurs when a prey walks
-                    // into a hunter. In this case, we need to kill the
-                    // triggering client and yield its energy to the
-                    // killing hunter.
-                    client->ui.pos = msg.move_request;
-                    energy = client->ui.energy;
-                    grid->clients[i].ui.energy += energy;
-
-                    fds[client->idx].fd = -1;
-                    server_killclient(client);
-                    LOG("[death] prey %d fed hunter %d\n", client->idx, i);
-
-                    *grid_updated = 1;
-                    return;
-                }
-            }
+            __atomic_store_n(&job->over, 1, __ATOMIC_RELAXED);
+            return;
         }
-    }
 
-    // This is the catch-all code for all movements without collisions.
-    if (grid_equal(client->ui.pos, msg.move_request))
-    {
-        // The move request is the same location as the current location,
-        // therefore the grid hasn't been updated and energy will not be
-        // lost. Return immediately.
-        *grid_updated = 0;
-        return;
+        job->grid->path->clusters[c].cap = path_entrances(job->grid, c,
+            blocked, nodes);
     }
+}
 
-    // Otherwise, update the position and remove 1 energy if the currently
-    // moving unit is a hunter.
-    client->ui.pos = msg.move_request;
-    if (type == CT_HUNTER)
-        client->ui.energy--;
-    if (client->ui.energy <= 0)
+// path_phasebuild - build a range of clusters
+//     ctx: The PathJob.
+//     begin: The first cluster.
+//     end: One past the last cluster.
+void
+path_phasebuild(void *ctx, int begin, int end)
+{
+    PathJob *job = ctx;
+    int c;
+
+    for (c = begin; c < end; c++)
     {
-        fds[client->idx].fd = -1;
-        server_killclient(client);
-        LOG("[death] hunter %d exhausted\n", client->idx);
+        if (__atomic_load_n(&job->over, __ATOMIC_RELAXED) ||
+            clock_nsec() - job->start > job->budget_ns)
+        {
+            __atomic_store_n(&job->over, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        path_buildcluster(job->grid, c);
     }
-    *grid_updated = 1;
 }
 
-// server_isstable - the end condition of the simulation
-//     grid: Grid containing all of the client information.
+// path_rebuild - build a cluster again after an obstacle change
+//     grid: The grid.
+//     c: The cluster.
 //
-// Returns true if either preys or hunters have been defeated.
-int
-server_isstable(Grid *grid)
+// A cluster that outgrows its room gets room for the most nodes a cluster
+// can have, so that this happens once at most.
+void
+path_rebuild(Grid *grid, int c)
 {
-    int num_hunters = 0, num_preys = 0, i;
+    PathCluster *cluster = &grid->path->clusters[c];
 
-    for (i = 0; i < grid->num_clients; i++)
-    {
-        SKIP_DEAD(i);
+    grid->path->stats.rebuilds++;
 
-        if (grid->clients[i].ui.type == CT_HUNTER)
-            num_hunters++;
-        else
-            num_preys++;
-    }
+    if (path_buildcluster(grid, c))
+        return;
 
-    return (num_hunters == 0) && (num_preys >= 0) ||
-           (num_preys == 0) && (num_hunters >= 0);
+    cluster->cap = PATH_MAXNODES;
+    cluster->nodes = grid_alloc(grid, PATH_MAXNODES * sizeof(PathNode));
+    cluster->dist = grid_alloc(grid,
+        PATH_MAXNODES * PATH_MAXNODES * sizeof(uint16_t));
+    path_buildcluster(grid, c);
 }
 
-// server_forkclient - fork a new process and link a client
-//     client: The client to link to the new process.
-//     mapsize: The size of the map.
+// path_obstacle - keep the cluster graph in step with an obstacle change
+//     grid: The grid.
+//     c: The cell that changed.
 //
-// Takes an unpopulated Client object and fills it with a new pid
-// and a file descriptor; belonging to the new client process.
-// The child process then proceeds to exec its own executable.
+// Rebuilds the cluster of the cell and, for a cell on its border, the
+// cluster across, whose entrances face it.
 void
-server_forkclient(Client *client, Coordinate mapsize)
+path_obstacle(Grid *grid, Coordinate c)
 {
-    int fd[2];
-    pid_t pid;
+    Coordinate across;
+    int cluster, dir;
 
-    ipc_createpipe(fd);
-    ipc_setcloexec(fd);
+    if (!grid->path)
+        return;
 
-    pid = fork();
+    path_setblocked(grid->path, c, grid_isobstacle(grid, c));
+    cluster = path_cluster(grid->path, c);
+    path_rebuild(grid, cluster);
 
-    if (pid) // Server code.
+    for (dir = 0; dir < 4; dir++)
     {
-        server_linkclient(client, pid, fd);
-        ipc_closeclientend(fd);
-    }
-    else // Client code.
-    {
-        ipc_redirstdio(fd);
-        ipc_execclient(client->ui.type, mapsize);
+        across = path_across(c, dir);
+
+        if (grid_onmap(grid, across) &&
+            path_cluster(grid->path, across) != cluster)
+            path_rebuild(grid, path_cluster(grid->path, across));
     }
 }
 
-// server_linkclient - attach a pid and fd to a client
-//     client: The client to attach process information to.
-//     pid: Process ID of the child process.
-//     fd: Bidirectional pipe for the new connection.
+// path_push - add a node to the open heap
+//     grid: The grid.
+//     f: The cost of the node plus the estimate of the rest.
+//     g: The cost of the node.
+//     id: The node.
 //
-// Populates a Client object with PID and a file descriptor,
-// so that the server process can establish connection to it after
-// fork-execing.
+// Of nodes with the same f, the one with the highest g comes first.
 void
-server_linkclient(Client *client, pid_t pid, int *fd)
+path_push(Grid *grid, int f, int g, int id)
 {
-    client->pid = pid;
-    client->fd = fd[0];
-}
+    PathGraph *graph = grid->path;
+    PathOpen *open = graph->open, entry;
+    int i, parent;
 
-// server_killclient - kill a client
-//     client: The client to kill.
-//
-// Sends a signal to kill the process associated with the specified
-// client object, and sets its alive flag to zero to indicate death.
-// Also closes the server-end of the bidirectional pipe that was
-// created when the process was created.
-void
-server_killclient(Client *client)
-{
-    int status;
+    if (graph->open_len == graph->open_cap)
+    {
+        graph->open_cap *= 2;
+        graph->open = grid_alloc(grid, graph->open_cap * sizeof(PathOpen));
+        memcpy(graph->open, open, graph->open_len * sizeof(PathOpen));
+        open = graph->open;
+    }
 
-    client->ui.alive = 0;
-    kill(client->pid, SIGTERM);
-    wait(&status);
-    close(client->fd);
+    entry.f = f;
+    entry.g = g;
+    entry.id = id;
+
+    for (i = graph->open_len++; i > 0; i = parent)
+    {
+        parent = (i - 1) / 2;
+
+        if (open[parent].f < f || (open[parent].f == f &&
+            open[parent].g >= g))
+            break;
+
+        open[i] = open[parent];
+    }
+
+    open[i] = entry;
 }
 
-// server_clientalive - check if client is alive
-//     client: The client to check.
+// path_pop - take the first node off the open heap
+//     graph: The cluster graph.
+//     top: Set to the entry of the node.
 //
-// Returns true if the client is alive.
+// Returns 0 if the heap is empty.
 int
-server_clientalive(Client *client)
+path_pop(PathGraph *graph, PathOpen *top)
 {
-    return client->ui.alive;
+    PathOpen *open = graph->open, last;
+    int i, child, n;
+
+    if (graph->open_len == 0)
+        return 0;
+
+    *top = open[0];
+    n = --graph->open_len;
+    last = open[n];
+
+    for (i = 0; (child = 2 * i + 1) < n; i = child)
+    {
+        if (child + 1 < n && (open[child + 1].f < open[child].f ||
+            (open[child + 1].f == open[child].f &&
+            open[child + 1].g > open[child].g)))
+            child++;
+
+        if (last.f < open[child].f || (last.f == open[child].f &&
+            last.g >= open[child].g))
+            break;
+
+        open[i] = open[child];
+    }
+
+    open[i] = last;
+
+    return 1;
 }
 
-// server_clientadvtype - the type of a client's adversary
-//     client: The client to query.
+// path_relax - reach a node of the cluster graph
+//     grid: The grid.
+//     id: The node.
+//     g: The cost of the way to it.
+//     prev: The node it comes from, -1 for the start.
+//     to: The goal of the search.
 //
-// Returns CT_PREY for hunters, CT_HUNTER for preys.
-ClientType
-server_clientadvtype(Client *client)
+// The node is opened again if this way is shorter than the last one.
+void
+path_relax(Grid *grid, int id, int g, int prev, Coordinate to)
 {
-    if (client->ui.type == CT_HUNTER)
-        return CT_PREY;
+    PathGraph *graph = grid->path;
+    PathNode *node = path_node(graph, id);
 
-    return CT_HUNTER;
+    if (node->stamp == graph->stamp && node->g <= g)
+        return;
+
+    node->stamp = graph->stamp;
+    node->g = g;
+    node->prev = prev;
+    path_push(grid, g + grid_distance(node->cell, to), g, id);
 }
 
-// server_clientnearestadv - nearest adversary of client
-//     grid: The grid containing all of the clients' information.
-//     client: The client whose nearest adversary is asked.
+// path_next - the next step of a unit on its way to a cell
+//     grid: The grid, with a cluster graph.
+//     from: The cell of the unit.
+//     to: The cell to go to.
 //
-// Returns the coordinates of the nearest unit of type CT_HUNTER
-// if client is a prey, CT_PREY otherwise.
+// An A* search of the cluster graph, from the nodes of the cluster of
+// from to the cell to through the nodes of its cluster, both reached by a
+// search of their cluster. The way from from to the first node of the
+// path that is not from is then taken from the search of its cluster.
+// The search takes longer with the length of the path; after the latency
+// budget, it settles for the node closest to to found so far. Returns the
+// next cell, or (-1, -1) if there is no way to to, or no need for one.
 Coordinate
-server_clientnearestadv(Grid *grid, Client *client)
+path_next(Grid *grid, Coordinate from, Coordinate to)
 {
-    ClientType adv_type;
-    Coordinate result;
-    int i, distance, mindistance;
+    PathGraph *graph = grid->path;
+    PathCluster *cluster;
+    PathNode *node, *other;
+    PathOpen top;
+    Coordinate none = {-1, -1}, lo[2], extent[2], step, across;
+    unsigned char blocked[2][PATH_CELLS];
+    uint16_t dist[2][PATH_CELLS], prev[2][PATH_CELLS];
+    uint64_t start, expanded = 0;
+    int cs, cg, best = INT_MAX, best_id = -1, closest_id = -1, closest;
+    int timed_out = 0, c, k, j, d, id;
+
+    if (!grid_onmap(grid, to) || grid_equal(from, to))
+        return none;
+
+    if (grid_distance(from, to) == 1)
+        return to;
+
+    start = clock_nsec();
+    graph->stats.queries++;
+
+    // Search the cluster of from from it, and the cluster of to from to.
+    cs = path_cluster(graph, from);
+    cg = path_cluster(graph, to);
+    path_bounds(grid, cs, &lo[0], &extent[0]);
+    path_bounds(grid, cg, &lo[1], &extent[1]);
+    path_load(grid, cs, blocked[0]);
+    path_search(blocked[0], path_local(lo[0], from), dist[0], prev[0]);
+
+    if (cg != cs)
+        path_load(grid, cg, blocked[1]);
+    else
+        memcpy(blocked[1], blocked[0], PATH_CELLS);
 
-    adv_type = server_clientadvtype(client);
+    path_search(blocked[1], path_local(lo[1], to), dist[1], prev[1]);
 
-    // Find the distance with the first adversary on the map.
-    for (i = 0; i < grid->num_clients; i++)
+    if (cg == cs)
+        best = dist[0][path_local(lo[0], to)];
+    if (best == PATH_UNREACHABLE)
+        best = INT_MAX;
+
+    if (++graph->stamp == 0)
     {
-        SKIP_DEAD(i);
+        for (c = 0; c < graph->num_clusters; c++)
+            for (k = 0; k < graph->clusters[c].num_nodes; k++)
+                graph->clusters[c].nodes[k].stamp = 0;
+        graph->stamp = 1;
+    }
 
-        if (adv_type != grid->clients[i].ui.type)
-            continue;
+    graph->open_len = 0;
+    cluster = &graph->clusters[cs];
 
-        mindistance = grid_distance(client->ui.pos,
-            grid->clients[i].ui.pos);
-        result = grid->clients[i].ui.pos;
+    for (k = 0; k < cluster->num_nodes; k++)
+    {
+        node = &cluster->nodes[k];
+        d = dist[0][path_local(lo[0], node->cell)];
+
+        if (d != PATH_UNREACHABLE)
+            path_relax(grid, cs * PATH_MAXNODES + k, d, -1, to);
     }
 
-    // Compare the remaining adversaries to find the minimum
-    // distance.
-    for (; i < grid->num_clients; i++)
-    {
-        SKIP_DEAD(i);
+    closest = grid_distance(from, to);
 
-        if (adv_type != grid->clients[i].ui.type)
+    while (path_pop(graph, &top) && top.f < best)
+    {
+        node = path_node(graph, top.id);
+        if (top.g > node->g)
             continue;
 
-        distance = grid_distance(client->ui.pos,
-            grid->clients[i].ui.pos);
-
-        if (distance < mindistance)
+        if (++expanded % PATH_CHECK == 0 && graph->latency_ns &&
+            clock_nsec() - start > graph->latency_ns)
         {
-            mindistance = distance;
-            result = grid->clients[i].ui.pos;
+            timed_out = 1;
+            break;
         }
-    }
-
-    return result;
-}
 
-// server_clientobjects - objects neighboring a certain client
-//     buf: Preallocated array of coordinates to fill with the result.
-//     num_objects: Holds the number of objects neighboring the client.
-//     grid: The grid containing the information on all of the clients.
-//     client: The client whose neighboting objects are queried.
-//
-// For every neighboring cell of the client, we look for either an
-//
-//     1. allied unit
-//     2. obstacle
-//
-// and we collect them into buf. The length of buf is stored in
-// num_objects.
-void
-server_clientobjects(Coordinate *buf, int *num_objects, Grid *grid,
-        Client *client)
-{
-    ClientType adv_type;
-    Coordinate neighbors[4], x, y;
-    int num_neighbors, i, j, k = 0;
+        if (grid_distance(node->cell, to) < closest)
+        {
+            closest = grid_distance(node->cell, to);
+            closest_id = top.id;
+        }
 
-    adv_type = server_clientadvtype(client);
-    grid_neighbors(neighbors, &num_neighbors, grid->mapsize,
-        client->ui.pos);
+        c = top.id / PATH_MAXNODES;
+        k = top.id % PATH_MAXNODES;
+        cluster = &graph->clusters[c];
 
-    for (i = 0; i < num_neighbors && k <= num_neighbors; i++)
-    {
-        for (j = 0; j < grid->num_obstacles; j++)
+        if (c == cg)
         {
-            x = grid->obstacles[j];
-            y = neighbors[i];
+            d = dist[1][path_local(lo[1], node->cell)];
 
-            if (grid_equal(x, y))
+            if (d != PATH_UNREACHABLE && top.g + d < best)
             {
-                buf[k] = x;
-                k++;
+                best = top.g + d;
+                best_id = top.id;
+            }
+        }
 
-                LOG("(%d, %d) found obstacle (%d, %d) as obstacle\n",
-                    client->ui.pos.x, client->ui.pos.y,
-                    x.x, x.y);
+        // Cross to the node facing this one in the next cluster.
+        across = path_across(node->cell, node->dir);
+        id = path_cluster(graph, across);
 
-                goto found;
+        for (j = 0; j < graph->clusters[id].num_nodes; j++)
+        {
+            other = &graph->clusters[id].nodes[j];
+
+            if (other->dir == (node->dir ^ 1) &&
+                grid_equal(other->cell, across))
+            {
+                path_relax(grid, id * PATH_MAXNODES + j, top.g + 1, top.id,
+                    to);
+                break;
             }
         }
 
-        for (j = 0; j < grid->num_clients; j++)
+        for (j = 0; j < cluster->num_nodes; j++)
         {
-            SKIP_DEAD(j);
+            d = cluster->dist[k * cluster->num_nodes + j];
 
-            // If a neighboring client is an enemy, it is not considered
-            // an obstacle.
-            if (grid->clients[j].ui.type == adv_type)
-                continue;
-            
-            x = grid->clients[j].ui.pos;
-            y = neighbors[i];
+            if (j != k && d != PATH_UNREACHABLE)
+                path_relax(grid, c * PATH_MAXNODES + j, top.g + d, top.id,
+                    to);
+        }
+    }
 
-            if (grid_equal(x, y))
-            {
-                buf[k] = x;
-                k++;
+    graph->stats.expanded += expanded;
+    hist_add(graph->stats.latency, clock_nsec() - start);
+
+    if (timed_out)
+        graph->stats.partial++;
+    else if (best < INT_MAX)
+        graph->stats.found++;
+    else
+        graph->stats.unreachable++;
 
-                LOG("(%d, %d) found ally (%d, %d) as obstacle\n",
-                    client->ui.pos.x, client->ui.pos.y,
-                    x.x, x.y);
+    if (best == INT_MAX)
+    {
+        if (!timed_out || closest_id < 0)
+            return none;
+        best_id = closest_id;
+    }
 
-                goto found;
-            }
-        }
-found: // Found an object, so we can skip to the next neighboring cell.
-        ;
+    // Head for the first node of the path that is not from, or for to.
+    step = to;
+    for (id = best_id; id >= 0; id = node->prev)
+    {
+        node = path_node(graph, id);
+        if (!grid_equal(node->cell, from))
+            step = node->cell;
     }
 
-    *num_objects = k;
+    if (grid_distance(from, step) == 1)
+        return step;
+
+    if (path_cluster(graph, step) != cs)
+        return none;
+
+    k = path_local(lo[0], step);
+    if (dist[0][k] == PATH_UNREACHABLE)
+        return none;
+
+    while (dist[0][k] > 1)
+        k = prev[0][k];
+
+    step.x = lo[0].x + k / PATH_STRIDE - 1;
+    step.y = lo[0].y + k % PATH_STRIDE - 1;
+
+    return step;
+}
+
+// path_report - print what the pathfinding service did
+//     grid: The grid.
+void
+path_report(Grid *grid)
+{
+    PathGraph *graph = grid->path;
+    PathStats *stats;
+
+    if (!graph)
+        return;
+
+    stats = &graph->stats;
+
+    fprintf(stderr, "path graph: %d clusters of %dx%d cells, %d nodes, "
+        "built in %.3f s, %llu clusters rebuilt\n", graph->num_clusters,
+        PATH_CLUSTER, PATH_CLUSTER, graph->num_nodes, graph->build_ns / 1e9,
+        (unsigned long long) stats->rebuilds);
+
+    if (stats->queries == 0)
+        return;
+
+    fprintf(stderr, "path queries %llu: found %llu, partial %llu, "
+        "unreachable %llu; %.1f nodes each, p50 %.1f us, p99 %.1f us, "
+        "max %.1f us\n", (unsigned long long) stats->queries,
+        (unsigned long long) stats->found,
+        (unsigned long long) stats->partial,
+        (unsigned long long) stats->unreachable,
+        (double) stats->expanded / stats->queries,
+        hist_percentile(stats->latency, 0.50) / 1e3,
+        hist_percentile(stats->latency, 0.99) / 1e3,
+        stats->latency->max / 1e3);
 }
 
 #endif // PHGAME_H
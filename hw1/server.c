@@ -1,9 +1,372 @@
 #include "phgame.h"
 
+#include <getopt.h>
+
+void
+usage(void)
+{
+    fprintf(stderr,
+        "usage: server [options] < map\n"
+        "  -s, --sched POLICY   linear, roundrobin (default) or oldest\n"
+        "  -b, --budget N       serve at most N requests per wakeup\n"
+        "  -S, --stats          report per-client latency on exit\n"
+        "  -t, --tick           resolve moves in synchronous batches\n"
+        "  -V, --tick-verify    check every batch against the reference\n"
+        "  -j, --threads N      threads for the batch resolver\n"
+        "  -P, --parse-only     parse the map, report the time and exit\n"
+        "  -k, --units-per-proc N  drive up to N units per client process\n"
+        "  -d, --deadline MS    answer deadline for client processes\n"
+        "  -w, --watchdog POLICY  evict (default) or penalize late clients\n"
+        "  -q, --send-cap BYTES  cap on the send queue of a process\n"
+        "  -i, --io BACKEND     poll (default) or uring\n"
+        "  -r, --rate N         cap all units together to N moves/s\n"
+        "  -H, --hunter-rate N  moves/s of each hunter, 0 for flat out\n"
+        "  -R, --prey-rate N    moves/s of each prey, 0 for flat out\n"
+        "  -x, --seed N         seed for the random think times\n"
+        "  -T, --trace FILE     write a Chrome trace (needs make trace)\n"
+        "  -v, --view MODE      full (default), window or overview\n"
+        "  -g, --view-size WxH  size of the window or overview (80x24)\n"
+        "  -f, --follow N       center the window on unit N, or on the\n"
+        "                       densest region with dense (default)\n"
+        "  -p, --publish NAME   serve frames to spectators under NAME\n"
+        "  -e, --encoding ENC   auto (default), wide, compact or delta\n"
+        "                       messages; delta replies only carry what\n"
+        "                       changed since the last one\n"
+        "  -c, --control FIFO   take obstacle commands from a named pipe\n"
+        "  -G, --loadgen        drive the units with load generators\n"
+        "  -L, --load N,...     sweep load generators over total rates in\n"
+        "                       moves/s, 0 for unlimited, and report the\n"
+        "                       throughput and latency of every step\n"
+        "  -l, --load-step MS   length of a step of the sweep (2000)\n"
+        "  -a, --affinity POLICY  none (default), spread or group: pin the\n"
+        "                       server to a core, and the clients to the\n"
+        "                       others in turn or by region of the map\n"
+        "  -C, --server-cpu N   core of the server, the first one if unset;\n"
+        "                       the threads of -j run there as well\n"
+        "  -z, --lod RADIUS     slow down units farther than RADIUS from\n"
+        "                       their nearest adversary, more with distance\n"
+        "  -Z, --lod-interval MS  least wait of the first slowed level (10)\n"
+        "  -y, --reply-cache    reuse the parts of replies that no move\n"
+        "                       or death has changed\n"
+        "  -A, --redirect       make the best free move in place of a move\n"
+        "                       denied by an ally, instead of only\n"
+        "                       offering it in the reply\n"
+        "  -W, --wait POLICY    spin (default) on the clients, block, or\n"
+        "                       adaptive: spin for a while after every\n"
+        "                       piece of work, then block\n"
+        "  -M, --spin-max US    longest spin of the adaptive wait (100)\n"
+        "  -O, --occupancy MODE  auto (default), dense or sparse index of\n"
+        "                       the units by cell; auto picks dense for\n"
+        "                       small, crowded maps\n"
+        "  -F, --pathfind       give hunters their next step around the\n"
+        "                       obstacles, from a cluster graph of the map\n"
+        "  -B, --path-budget MS  longest the graph may take to build,\n"
+        "                       or pathfinding is off (10000)\n"
+        "  -U, --path-latency US  longest search for a full path, after\n"
+        "                       which a partial one is used; 0 for no\n"
+        "                       limit (200)\n");
+    exit(EXIT_FAILURE);
+}
+
 int
 main(int argc, char **argv)
 {
-    server_main();
+    static struct option options[] = {
+        {"sched", required_argument, NULL, 's'},
+        {"budget", required_argument, NULL, 'b'},
+        {"stats", no_argument, NULL, 'S'},
+        {"tick", no_argument, NULL, 't'},
+        {"tick-verify", no_argument, NULL, 'V'},
+        {"threads", required_argument, NULL, 'j'},
+        {"parse-only", no_argument, NULL, 'P'},
+        {"units-per-proc", required_argument, NULL, 'k'},
+        {"deadline", required_argument, NULL, 'd'},
+        {"watchdog", required_argument, NULL, 'w'},
+        {"send-cap", required_argument, NULL, 'q'},
+        {"io", required_argument, NULL, 'i'},
+        {"rate", required_argument, NULL, 'r'},
+        {"hunter-rate", required_argument, NULL, 'H'},
+        {"prey-rate", required_argument, NULL, 'R'},
+        {"seed", required_argument, NULL, 'x'},
+        {"trace", required_argument, NULL, 'T'},
+        {"view", required_argument, NULL, 'v'},
+        {"view-size", required_argument, NULL, 'g'},
+        {"follow", required_argument, NULL, 'f'},
+        {"publish", required_argument, NULL, 'p'},
+        {"encoding", required_argument, NULL, 'e'},
+        {"control", required_argument, NULL, 'c'},
+        {"loadgen", no_argument, NULL, 'G'},
+        {"load", required_argument, NULL, 'L'},
+        {"load-step", required_argument, NULL, 'l'},
+        {"affinity", required_argument, NULL, 'a'},
+        {"server-cpu", required_argument, NULL, 'C'},
+        {"lod", required_argument, NULL, 'z'},
+        {"lod-interval", required_argument, NULL, 'Z'},
+        {"reply-cache", no_argument, NULL, 'y'},
+        {"redirect", no_argument, NULL, 'A'},
+        {"wait", required_argument, NULL, 'W'},
+        {"spin-max", required_argument, NULL, 'M'},
+        {"occupancy", required_argument, NULL, 'O'},
+        {"pathfind", no_argument, NULL, 'F'},
+        {"path-budget", required_argument, NULL, 'B'},
+        {"path-latency", required_argument, NULL, 'U'},
+        {NULL, 0, NULL, 0}
+    };
+    ServerConfig config;
+    char *arg, *end;
+    int opt;
+
+    memset(&config, 0, sizeof(ServerConfig));
+    config.sched = SCHED_ROUNDROBIN;
+    config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    config.units_per_proc = 1;
+    config.send_cap = SEND_CAP_DEFAULT;
+    config.type_rate[CT_HUNTER] = PACE_RANDOM;
+    config.type_rate[CT_PREY] = PACE_RANDOM;
+    config.seed = 1;
+    config.view_width = VIEW_WIDTH;
+    config.view_height = VIEW_HEIGHT;
+    config.follow = VIEW_DENSEST;
+    config.load_step_ms = LOAD_STEPMS;
+    config.server_cpu = -1;
+    config.lod_interval = LOD_INTERVAL;
+    config.spin_max = WAIT_SPINMAX;
+    config.path_budget_ms = PATH_BUDGET;
+    config.path_latency_us = PATH_LATENCY;
+
+    while ((opt = getopt_long(argc, argv, "s:b:StVj:Pk:d:w:q:i:r:H:R:x:T:v:g:f:p:e:c:GL:l:a:C:z:Z:yAW:M:O:FB:U:", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (!strcmp(optarg, "linear"))
+                config.sched = SCHED_LINEAR;
+            else if (!strcmp(optarg, "roundrobin"))
+                config.sched = SCHED_ROUNDROBIN;
+            else if (!strcmp(optarg, "oldest"))
+                config.sched = SCHED_OLDEST;
+            else
+                usage();
+            break;
+        case 'b':
+            config.budget = atoi(optarg);
+            break;
+        case 'S':
+            config.stats = 1;
+            break;
+        case 't':
+            config.tick = 1;
+            break;
+        case 'V':
+            config.tick = 1;
+            config.tick_verify = 1;
+            break;
+        case 'j':
+            config.threads = atoi(optarg);
+            break;
+        case 'P':
+            config.parse_only = 1;
+            break;
+        case 'k':
+            config.units_per_proc = atoi(optarg);
+            if (config.units_per_proc < 1)
+                usage();
+            break;
+        case 'd':
+            config.deadline_ms = atoi(optarg);
+            break;
+        case 'w':
+            if (!strcmp(optarg, "evict"))
+                config.watchdog = WATCHDOG_EVICT;
+            else if (!strcmp(optarg, "penalize"))
+                config.watchdog = WATCHDOG_PENALIZE;
+            else
+                usage();
+            break;
+        case 'q':
+            config.send_cap = strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            if (!strcmp(optarg, "poll"))
+                config.io = IO_POLL;
+            else if (!strcmp(optarg, "uring"))
+                config.io = IO_URING;
+            else
+                usage();
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'H':
+            config.type_rate[CT_HUNTER] = atof(optarg);
+            if (config.type_rate[CT_HUNTER] < 0)
+                usage();
+            break;
+        case 'R':
+            config.type_rate[CT_PREY] = atof(optarg);
+            if (config.type_rate[CT_PREY] < 0)
+                usage();
+            break;
+        case 'x':
+            config.seed = strtoull(optarg, NULL, 10);
+            if (config.seed == 0)
+                usage();
+            break;
+        case 'T':
+            config.trace_path = optarg;
+            break;
+        case 'v':
+            if (!strcmp(optarg, "full"))
+                config.view = VIEW_FULL;
+            else if (!strcmp(optarg, "window"))
+                config.view = VIEW_WINDOW;
+            else if (!strcmp(optarg, "overview"))
+                config.view = VIEW_OVERVIEW;
+            else
+                usage();
+            break;
+        case 'g':
+            if (sscanf(optarg, "%dx%d", &config.view_width,
+                &config.view_height) != 2 || config.view_width < 1 ||
+                config.view_height < 1)
+                usage();
+            break;
+        case 'f':
+            if (!strcmp(optarg, "dense"))
+                config.follow = VIEW_DENSEST;
+            else
+                config.follow = atoi(optarg);
+            break;
+        case 'p':
+            config.publish = optarg;
+            break;
+        case 'e':
+            if (!strcmp(optarg, "auto"))
+                config.encoding = ENC_AUTO;
+            else if (!strcmp(optarg, "wide"))
+                config.encoding = ENC_WIDE;
+            else if (!strcmp(optarg, "compact"))
+                config.encoding = ENC_COMPACT;
+            else if (!strcmp(optarg, "delta"))
+                config.encoding = ENC_DELTA;
+            else
+                usage();
+            break;
+        case 'c':
+            config.control = optarg;
+            break;
+        case 'G':
+            config.loadgen = 1;
+            break;
+        case 'L':
+            config.num_loads = 0;
+            for (arg = optarg; *arg; arg = *end == ',' ? end + 1 : end)
+            {
+                if (config.num_loads == LOAD_MAXSTEPS)
+                    usage();
+                config.load[config.num_loads] = strtod(arg, &end);
+                if (end == arg || config.load[config.num_loads] < 0)
+                    usage();
+                config.num_loads++;
+            }
+            if (config.num_loads == 0)
+                usage();
+            break;
+        case 'l':
+            config.load_step_ms = atoi(optarg);
+            if (config.load_step_ms < 1)
+                usage();
+            break;
+        case 'a':
+            if (!strcmp(optarg, "none"))
+                config.placement = PLACE_NONE;
+            else if (!strcmp(optarg, "spread"))
+                config.placement = PLACE_SPREAD;
+            else if (!strcmp(optarg, "group"))
+                config.placement = PLACE_GROUP;
+            else
+                usage();
+            break;
+        case 'C':
+            config.server_cpu = atoi(optarg);
+            if (config.server_cpu < 0)
+                usage();
+            break;
+        case 'z':
+            config.lod_radius = atoi(optarg);
+            if (config.lod_radius < 1)
+                usage();
+            break;
+        case 'Z':
+            if (atoi(optarg) < 1)
+                usage();
+            config.lod_interval = atoi(optarg) * 1000000ULL;
+            break;
+        case 'y':
+            config.reply_cache = 1;
+            break;
+        case 'A':
+            config.redirect = 1;
+            break;
+        case 'W':
+            if (!strcmp(optarg, "spin"))
+                config.wait = WAIT_SPIN;
+            else if (!strcmp(optarg, "block"))
+                config.wait = WAIT_BLOCK;
+            else if (!strcmp(optarg, "adaptive"))
+                config.wait = WAIT_ADAPTIVE;
+            else
+                usage();
+            break;
+        case 'M':
+            if (atoi(optarg) < 1)
+                usage();
+            config.spin_max = atoi(optarg) * 1000ULL;
+            break;
+        case 'O':
+            if (!strcmp(optarg, "auto"))
+                config.occupancy = UNITMAP_AUTO;
+            else if (!strcmp(optarg, "dense"))
+                config.occupancy = UNITMAP_DENSE;
+            else if (!strcmp(optarg, "sparse"))
+                config.occupancy = UNITMAP_SPARSE;
+            else
+                usage();
+            break;
+        case 'F':
+            config.pathfind = 1;
+            break;
+        case 'B':
+            if (atoi(optarg) < 0)
+                usage();
+            config.path_budget_ms = atoi(optarg);
+            break;
+        case 'U':
+            if (atoi(optarg) < 0)
+                usage();
+            config.path_latency_us = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    // A core for the server alone spreads the clients over the others.
+    if (config.server_cpu >= 0 && config.placement == PLACE_NONE)
+        config.placement = PLACE_SPREAD;
+
+    // A sweep runs load generators, flat out unless told otherwise, so
+    // that the offered rate is the only limit.
+    if (config.num_loads > 0)
+    {
+        config.loadgen = 1;
+        if (config.type_rate[CT_HUNTER] == PACE_RANDOM)
+            config.type_rate[CT_HUNTER] = 0;
+        if (config.type_rate[CT_PREY] == PACE_RANDOM)
+            config.type_rate[CT_PREY] = 0;
+    }
+
+    server_main(&config);
     
     return 0;
 }
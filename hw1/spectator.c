@@ -0,0 +1,90 @@
+#include "phgame.h"
+
+// Watches a game published by `server --publish NAME`:
+//
+//     spectator [-l] <name>
+//
+// Frames are read from the shared memory ring of the server and written
+// to standard output, one after the other. Spectators never slow the
+// game down; one that cannot keep up skips frames, and -l skips straight
+// to the latest frame every time. The number of skipped frames is
+// reported on standard error when the game is over.
+
+#define SPECTATOR_IDLE_US 1000
+
+int
+main(int argc, char **argv)
+{
+    Spectate spectate;
+    SpectateHeader *header;
+    uint64_t next = 1, expected, skipped = 0;
+    size_t len;
+    char *buf;
+    int latest = 0, done = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-l"))
+    {
+        latest = 1;
+        argc--;
+        argv++;
+    }
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: spectator [-l] <name>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    spectate_attach(&spectate, argv[1]);
+    header = spectate.header;
+
+    buf = malloc(header->slot_size);
+    if (!buf)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    // Start from the latest frame, there is no telling how old the others
+    // are.
+    next = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    if (next == 0)
+        next = 1;
+
+    while (1)
+    {
+        if (latest)
+        {
+            expected = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+            if (expected > next)
+            {
+                skipped += expected - next;
+                next = expected;
+            }
+        }
+
+        expected = next;
+
+        if (spectate_read(&spectate, &next, buf, &len))
+        {
+            skipped += next - 1 - expected;
+            fwrite(buf, 1, len, stdout);
+            fflush(stdout);
+            continue;
+        }
+
+        // The last frames may have been published since the read failed,
+        // so once the game is over, read on until there is nothing left.
+        if (done)
+            break;
+
+        done = __atomic_load_n(&header->done, __ATOMIC_ACQUIRE);
+        if (!done)
+            usleep(SPECTATOR_IDLE_US);
+    }
+
+    fprintf(stderr, "game over, skipped %llu frames\n",
+        (unsigned long long) skipped);
+
+    return 0;
+}